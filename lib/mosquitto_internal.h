@@ -72,6 +72,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "time_mosq.h"
 #ifdef WITH_BROKER
 struct mosquitto_client_msg;
+struct mosquitto_cold;
 #endif
 
 enum mosquitto_msg_direction {
@@ -106,15 +107,33 @@ struct _mosquitto_packet{
 	uint8_t command;
 	uint8_t have_remaining;
 	uint8_t remaining_count;
+#ifdef WITH_BROKER
+	uint8_t ctrl_count; /* control packets held in a pooled packet, else 0 */
+#endif
 	uint16_t mid;
 	uint32_t remaining_mult;
 	uint32_t remaining_length;
 	uint32_t packet_length;
 	uint32_t to_process;
 	uint32_t pos;
+#ifdef WITH_BROKER
+	uint32_t queued_ms; /* low 32 bits of the ms time it was queued for sending */
+#endif
 	uint8_t *payload;
 	struct _mosquitto_packet *next;
+#ifdef WITH_BROKER
+	struct _mosquitto_frame *frame; /* payload is borrowed from this frame */
+#endif
+};
+
+#ifdef WITH_BROKER
+/* A serialised packet that is shared by the packets of several clients. */
+struct _mosquitto_frame{
+	uint8_t *payload;
+	uint32_t packet_length;
+	int ref_count;
 };
+#endif
 
 struct mosquitto_message_all{
 	struct mosquitto_message_all *next;
@@ -125,6 +144,61 @@ struct mosquitto_message_all{
 	struct mosquitto_message msg;
 };
 
+#ifdef WITH_BROKER
+/* A client of the broker. There can be a very large number of these, most
+ * of them idle, so fields are ordered by how often they are used. Those
+ * touched for every packet read or written fill the first cache line, and
+ * state that only some clients ever need lives in struct mosquitto_cold,
+ * which is only allocated the first time it is used. A client that has
+ * connected and done nothing since never allocates it, so nothing but the
+ * fields here may be needed to accept, ack and keep alive a connection. */
+struct mosquitto {
+	/* Every read and write. */
+	struct event *event;
+	struct _mosquitto_packet *current_out_packet;
+	struct _mosquitto_packet *out_packet;
+	struct _mosquitto_packet *out_packet_last;
+	struct mosquitto_client_msg *msgs;
+	time_t last_msg_in;
+#ifndef WIN32
+	int sock;
+#else
+	SOCKET sock;
+#endif
+	enum mosquitto_client_state state;
+
+	/* Every packet of some kinds. */
+	uint64_t out_bytes; /* bytes in the out queues and current_out_packet not yet sent */
+	time_t last_msg_out;
+#ifdef WITH_TLS
+	SSL *ssl;
+#endif
+	uint16_t keepalive;
+	uint16_t last_mid;
+	bool clean_session;
+	bool want_write;
+	bool out_packet_corked;
+	bool read_paused; /* EV_READ interest dropped for backpressure */
+	bool rate_paused; /* EV_READ interest dropped by a rate limit */
+	bool is_bridge;
+	int db_index;
+	struct _mosquitto_packet in_packet;
+	struct _mqtt3_listener *listener;
+	struct _mosquitto_acl_user *acl_list;
+	char *id;
+
+	/* Connect, disconnect and the periodic sweep. */
+	char *address;
+	char *username;
+	char *password;
+	struct mosquitto_message *will;
+	struct _mqtt3_bridge *bridge;
+	struct mosquitto_cold *cold;
+#ifdef WITH_TLS
+	SSL_CTX *ssl_ctx; /* bridges only */
+#endif
+};
+#else
 struct mosquitto {
 #ifndef WIN32
 	int sock;
@@ -165,7 +239,7 @@ struct mosquitto {
 
 	bool want_write;
 
-#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+#ifdef WITH_THREADING
 	pthread_mutex_t callback_mutex;
 	pthread_mutex_t log_callback_mutex;
 	pthread_mutex_t msgtime_mutex;
@@ -176,17 +250,6 @@ struct mosquitto {
 	pthread_t thread_id;
 #endif
 
-#ifdef WITH_BROKER
-	bool is_bridge;
-	struct _mqtt3_bridge *bridge;
-	struct mosquitto_client_msg *msgs;
-	struct _mosquitto_acl_user *acl_list;
-	struct _mqtt3_listener *listener;
-	time_t disconnect_t;
-	int pollfd_index;
-	int db_index;
-	struct _mosquitto_packet *out_packet_last;
-#else
 	void *userdata;
 	bool in_callback;
 	unsigned int message_retry;
@@ -212,10 +275,10 @@ struct mosquitto {
 	struct mosquitto_message_all *messages_last;
 	int inflight_messages;
 	int max_inflight_messages;
-#endif
 
   //with libevent support
   struct event *event;
 };
+#endif
 
 #endif
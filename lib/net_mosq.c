@@ -35,6 +35,7 @@
 #ifndef WIN32
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
@@ -77,6 +78,9 @@ extern unsigned long g_msgs_received;
 extern unsigned long g_msgs_sent;
 extern unsigned long g_pub_msgs_received;
 extern unsigned long g_pub_msgs_sent;
+extern uint64_t g_out_wait_ms[2];
+extern uint64_t g_out_wait_max[2];
+extern unsigned long g_out_wait_count[2];
 #  endif
 #else
 #  include <read_handle.h>
@@ -93,6 +97,32 @@ extern unsigned long g_pub_msgs_sent;
 int tls_ex_index_mosq = -1;
 #endif
 
+#ifdef WITH_BROKER
+/* A packet for the fixed size control packets: PUBACK, PUBREC, PUBREL,
+ * PUBCOMP, UNSUBACK, PINGREQ, PINGRESP and DISCONNECT. The bytes are part of
+ * the same allocation, and the structs are kept on a free list once sent, so
+ * acknowledging a message normally costs no heap traffic at all. */
+struct _mosquitto_ctrl_packet{
+	struct _mosquitto_packet packet;
+	uint8_t bytes[MOSQ_CTRL_PACKET_BYTES];
+};
+
+static struct _mosquitto_packet *ctrl_pool = NULL;
+static int ctrl_pool_count = 0;
+
+static void _mosquitto_ctrl_pool_cleanup(void)
+{
+	struct _mosquitto_packet *packet;
+
+	while(ctrl_pool){
+		packet = ctrl_pool;
+		ctrl_pool = ctrl_pool->next;
+		_mosquitto_free(packet);
+	}
+	ctrl_pool_count = 0;
+}
+#endif
+
 void _mosquitto_net_init(void)
 {
 #ifdef WIN32
@@ -112,6 +142,9 @@ void _mosquitto_net_init(void)
 
 void _mosquitto_net_cleanup(void)
 {
+#ifdef WITH_BROKER
+	_mosquitto_ctrl_pool_cleanup();
+#endif
 #ifdef WITH_TLS
 	ERR_free_strings();
 	EVP_cleanup();
@@ -133,14 +166,128 @@ void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet)
 	packet->remaining_count = 0;
 	packet->remaining_mult = 1;
 	packet->remaining_length = 0;
+#ifdef WITH_BROKER
+	if(packet->frame){
+		_mosquitto_frame_release(packet->frame);
+		packet->frame = NULL;
+	}else if(packet->ctrl_count){
+		/* The bytes belong to the pooled packet itself. */
+	}else if(packet->payload){
+		_mosquitto_free(packet->payload);
+	}
+#else
 	if(packet->payload) _mosquitto_free(packet->payload);
+#endif
 	packet->payload = NULL;
 	packet->to_process = 0;
 	packet->pos = 0;
 }
 
+/* Clean up and free a packet that was queued for sending. */
+void _mosquitto_packet_free(struct _mosquitto_packet *packet)
+{
+	if(!packet) return;
+
+#ifdef WITH_BROKER
+	if(packet->ctrl_count){
+		_mosquitto_packet_cleanup(packet);
+		packet->ctrl_count = 0;
+		if(ctrl_pool_count < MOSQ_CTRL_POOL_MAX){
+			packet->next = ctrl_pool;
+			ctrl_pool = packet;
+			ctrl_pool_count++;
+			return;
+		}
+		_mosquitto_free(packet);
+		return;
+	}
+#endif
+	_mosquitto_packet_cleanup(packet);
+	_mosquitto_free(packet);
+}
+
+#ifdef WITH_BROKER
+void _mosquitto_frame_release(struct _mosquitto_frame *frame)
+{
+	if(!frame) return;
+
+	frame->ref_count--;
+	if(frame->ref_count == 0){
+		if(frame->payload) _mosquitto_free(frame->payload);
+		_mosquitto_free(frame);
+	}
+}
+#endif
+
+#ifdef WITH_BROKER
+/* Everything but PUBLISH goes in the control lane, which is written ahead of
+ * queued PUBLISH data at the next packet boundary so that acks and pings
+ * aren't held up behind a backlog. DISCONNECT stays behind the data so that
+ * nothing queued before it is lost. */
+static int _mosquitto_packet_lane(uint8_t command)
+{
+	command &= 0xF0;
+	if(command == PUBLISH || command == DISCONNECT){
+		return MOSQ_LANE_DATA;
+	}
+	return MOSQ_LANE_CTRL;
+}
+
+/* Whether a packet in out_packet goes ahead of the control lane. Data
+ * packets that writev() has already started on must be finished first.
+ * Control packets only go in out_packet when it holds nothing else, so that
+ * a client that never has a backlog doesn't need a control lane at all, and
+ * they are still in front of everything queued after them. */
+static bool _mosquitto_packet_ahead(struct _mosquitto_packet *packet)
+{
+	return packet && (packet->pos || _mosquitto_packet_lane(packet->command) == MOSQ_LANE_CTRL);
+}
+
+/* Take the packet to be written next off its lane, see
+ * _mosquitto_packet_ahead(). _mosquitto_net_writev() gathers in the same
+ * order. */
+static struct _mosquitto_packet *_mosquitto_packet_next(struct mosquitto *mosq)
+{
+	struct mosquitto_cold *cold = mosq->cold;
+	struct _mosquitto_packet *packet;
+
+	if(cold && cold->ctrl_packet && !_mosquitto_packet_ahead(mosq->out_packet)){
+		packet = cold->ctrl_packet;
+		cold->ctrl_packet = packet->next;
+		if(!cold->ctrl_packet){
+			cold->ctrl_packet_last = NULL;
+		}
+	}else{
+		packet = mosq->out_packet;
+		if(packet){
+			mosq->out_packet = packet->next;
+			if(!mosq->out_packet){
+				mosq->out_packet_last = NULL;
+			}
+		}
+	}
+	return packet;
+}
+
+/* The control lane, or NULL if a control packet can go in out_packet. */
+static struct mosquitto_cold *_mosquitto_ctrl_lane(struct mosquitto *mosq)
+{
+	if(mosq->cold && mosq->cold->ctrl_packet){
+		return mosq->cold;
+	}
+	if(!mosq->out_packet || _mosquitto_packet_lane(mosq->out_packet_last->command) == MOSQ_LANE_CTRL){
+		return NULL;
+	}
+	/* Without it the packet still goes out, just behind the backlog. */
+	return mqtt3_context_cold(mosq);
+}
+#endif
+
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet)
 {
+#ifdef WITH_BROKER
+	struct mosquitto_cold *cold;
+#endif
 
 	assert(mosq);
 	assert(packet);
@@ -150,6 +297,27 @@ int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *pa
 
 	packet->next = NULL;
 
+#ifdef WITH_BROKER
+#  ifdef WITH_SYS_TREE
+	packet->queued_ms = (uint32_t)mosquitto_time_ms();
+#  endif
+	if(_mosquitto_packet_lane(packet->command) == MOSQ_LANE_CTRL
+			&& (cold = _mosquitto_ctrl_lane(mosq))){
+		if(cold->ctrl_packet){
+			cold->ctrl_packet_last->next = packet;
+		}else{
+			cold->ctrl_packet = packet;
+		}
+		cold->ctrl_packet_last = packet;
+	}else{
+		if(mosq->out_packet){
+			mosq->out_packet_last->next = packet;
+		}else{
+			mosq->out_packet = packet;
+		}
+		mosq->out_packet_last = packet;
+	}
+#else
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 	if(mosq->out_packet){
 		mosq->out_packet_last->next = packet;
@@ -158,9 +326,15 @@ int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *pa
 	}
 	mosq->out_packet_last = packet;
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
+#endif
 
 
 #ifdef WITH_BROKER
+	mqtt3_out_bytes_update(mosq, packet->packet_length);
+	if(mosq->out_packet_corked){
+		/* The caller will flush once it has queued everything. */
+		return MOSQ_ERR_SUCCESS;
+	}
 	return _mosquitto_packet_write(mosq);
 #else
 	if(mosq->in_callback == false && mosq->threaded == false){
@@ -172,6 +346,66 @@ int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *pa
 
 }
 
+#ifdef WITH_BROKER
+/* Queue a control packet of two bytes, or four with a message id. If the
+ * last packet in the control lane is a pooled one it is appended to that, so
+ * a run of acks goes out as one block of bytes. Otherwise a pooled packet is
+ * used. */
+int _mosquitto_packet_queue_ctrl(struct mosquitto *mosq, uint8_t command, uint16_t mid, bool with_mid)
+{
+	struct _mosquitto_packet *packet;
+	uint8_t bytes[4];
+	uint32_t len = with_mid ? 4 : 2;
+
+	assert(mosq);
+
+	bytes[0] = command;
+	bytes[1] = len - 2;
+	bytes[2] = MOSQ_MSB(mid);
+	bytes[3] = MOSQ_LSB(mid);
+
+	if(mosq->cold && mosq->cold->ctrl_packet){
+		packet = mosq->cold->ctrl_packet_last;
+	}else if(mosq->out_packet && _mosquitto_packet_lane(mosq->out_packet_last->command) == MOSQ_LANE_CTRL){
+		packet = mosq->out_packet_last;
+	}else{
+		packet = NULL;
+	}
+	if(packet && _mosquitto_packet_lane(command) == MOSQ_LANE_CTRL
+			&& packet->ctrl_count && packet->ctrl_count < UINT8_MAX
+			&& packet->packet_length + len <= MOSQ_CTRL_PACKET_BYTES){
+
+		memcpy(&(packet->payload[packet->packet_length]), bytes, len);
+		packet->packet_length += len;
+		packet->to_process += len;
+		packet->ctrl_count++;
+		mqtt3_out_bytes_update(mosq, len);
+		if(mosq->out_packet_corked){
+			return MOSQ_ERR_SUCCESS;
+		}
+		return _mosquitto_packet_write(mosq);
+	}
+
+	if(ctrl_pool){
+		packet = ctrl_pool;
+		ctrl_pool = ctrl_pool->next;
+		ctrl_pool_count--;
+		memset(packet, 0, sizeof(struct _mosquitto_packet));
+	}else{
+		packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_ctrl_packet));
+		if(!packet) return MOSQ_ERR_NOMEM;
+	}
+	packet->payload = ((struct _mosquitto_ctrl_packet *)packet)->bytes;
+	memcpy(packet->payload, bytes, len);
+	packet->command = command;
+	packet->remaining_length = len - 2;
+	packet->packet_length = len;
+	packet->ctrl_count = 1;
+
+	return _mosquitto_packet_queue(mosq, packet);
+}
+#endif
+
 /* Close a socket associated with a context and set it to -1.
  * Returns 1 on failure (context is NULL)
  * Returns 0 on success.
@@ -206,6 +440,12 @@ int _mosquitto_socket_close(struct mosquitto *mosq)
       free(mosq->event);
       mosq->event = NULL;
     }
+  if (mosq->cold)
+    {
+      mosq->cold->write_pending = false;
+    }
+  mosq->read_paused = false;
+  mosq->rate_paused = false;
 #endif
 
 	return rc;
@@ -222,9 +462,15 @@ static unsigned int psk_client_callback(SSL *ssl, const char *hint,
 	mosq = SSL_get_ex_data(ssl, tls_ex_index_mosq);
 	if(!mosq) return 0;
 
+#ifdef WITH_BROKER
+	snprintf(identity, max_identity_len, "%s", mosq->bridge->tls_psk_identity);
+
+	len = _mosquitto_hex2bin(mosq->bridge->tls_psk, psk, max_psk_len);
+#else
 	snprintf(identity, max_identity_len, "%s", mosq->tls_psk_identity);
 
 	len = _mosquitto_hex2bin(mosq->tls_psk, psk, max_psk_len);
+#endif
 	if (len < 0) return 0;
 	return len;
 }
@@ -347,7 +593,7 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
  * Returns sock number on success.
  */
 #ifdef WITH_BROKER
-int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking, struct mosquitto_funcs_data *data)
+int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking, struct event_base *base)
 #else
 int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking)
 #endif
@@ -357,17 +603,31 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 #ifdef WITH_TLS
 	int ret;
 	BIO *bio;
+	bool use_tls;
+#  ifdef WITH_BROKER
+	/* Only bridges connect out, their TLS settings are kept on the bridge. */
+	struct _mqtt3_bridge *tls = mosq->bridge;
+#  else
+	struct mosquitto *tls = mosq;
+#  endif
 #endif
 #ifdef WITH_BROKER
-  struct mosquitto_db *db = data->db;
-  struct event_base *base = data->base;
   struct event * event;
 #endif
 
 	if(!mosq || !host || !port) return MOSQ_ERR_INVAL;
 
 #ifdef WITH_TLS
-	if(mosq->tls_cafile || mosq->tls_capath || mosq->tls_psk){
+#  ifdef WITH_BROKER
+	use_tls = tls && (tls->tls_cafile || tls->tls_capath
+#    ifdef REAL_WITH_TLS_PSK
+			|| tls->tls_psk
+#    endif
+			);
+#  else
+	use_tls = tls->tls_cafile || tls->tls_capath || tls->tls_psk;
+#  endif
+	if(use_tls){
 		blocking = true;
 	}
 #endif
@@ -378,24 +638,24 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 
   // TLS 处理暂时跳过
 #ifdef WITH_TLS
-	if(mosq->tls_cafile || mosq->tls_capath || mosq->tls_psk){
+	if(use_tls){
 #if OPENSSL_VERSION_NUMBER >= 0x10001000L
-		if(!mosq->tls_version || !strcmp(mosq->tls_version, "tlsv1.2")){
+		if(!tls->tls_version || !strcmp(tls->tls_version, "tlsv1.2")){
 			mosq->ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-		}else if(!strcmp(mosq->tls_version, "tlsv1.1")){
+		}else if(!strcmp(tls->tls_version, "tlsv1.1")){
 			mosq->ssl_ctx = SSL_CTX_new(TLSv1_1_client_method());
-		}else if(!strcmp(mosq->tls_version, "tlsv1")){
+		}else if(!strcmp(tls->tls_version, "tlsv1")){
 			mosq->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
 		}else{
-			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", mosq->tls_version);
+			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", tls->tls_version);
 			COMPAT_CLOSE(sock);
 			return MOSQ_ERR_INVAL;
 		}
 #else
-		if(!mosq->tls_version || !strcmp(mosq->tls_version, "tlsv1")){
+		if(!tls->tls_version || !strcmp(tls->tls_version, "tlsv1")){
 			mosq->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
 		}else{
-			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", mosq->tls_version);
+			_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Protocol %s not supported.", tls->tls_version);
 			COMPAT_CLOSE(sock);
 			return MOSQ_ERR_INVAL;
 		}
@@ -415,6 +675,7 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
     SSL_CTX_set_mode(mosq->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
 
+#ifndef WITH_BROKER
 		if(mosq->tls_ciphers){
 			ret = SSL_CTX_set_cipher_list(mosq->ssl_ctx, mosq->tls_ciphers);
 			if(ret == 0){
@@ -423,29 +684,35 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 				return MOSQ_ERR_TLS;
 			}
 		}
-		if(mosq->tls_cafile || mosq->tls_capath){
-			ret = SSL_CTX_load_verify_locations(mosq->ssl_ctx, mosq->tls_cafile, mosq->tls_capath);
+#endif
+		if(tls->tls_cafile || tls->tls_capath){
+			ret = SSL_CTX_load_verify_locations(mosq->ssl_ctx, tls->tls_cafile, tls->tls_capath);
 			if(ret == 0){
 #ifdef WITH_BROKER
-				if(mosq->tls_cafile && mosq->tls_capath){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\" and bridge_capath \"%s\".", mosq->tls_cafile, mosq->tls_capath);
-				}else if(mosq->tls_cafile){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\".", mosq->tls_cafile);
+				if(tls->tls_cafile && tls->tls_capath){
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\" and bridge_capath \"%s\".", tls->tls_cafile, tls->tls_capath);
+				}else if(tls->tls_cafile){
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_cafile \"%s\".", tls->tls_cafile);
 				}else{
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_capath \"%s\".", mosq->tls_capath);
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check bridge_capath \"%s\".", tls->tls_capath);
 				}
 #else
-				if(mosq->tls_cafile && mosq->tls_capath){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\" and capath \"%s\".", mosq->tls_cafile, mosq->tls_capath);
-				}else if(mosq->tls_cafile){
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\".", mosq->tls_cafile);
+				if(tls->tls_cafile && tls->tls_capath){
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\" and capath \"%s\".", tls->tls_cafile, tls->tls_capath);
+				}else if(tls->tls_cafile){
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check cafile \"%s\".", tls->tls_cafile);
 				}else{
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check capath \"%s\".", mosq->tls_capath);
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load CA certificates, check capath \"%s\".", tls->tls_capath);
 				}
 #endif
 				COMPAT_CLOSE(sock);
 				return MOSQ_ERR_TLS;
 			}
+#ifdef WITH_BROKER
+			/* Bridges have never had tls_cert_reqs set, so the remote
+			 * certificate isn't verified. */
+			SSL_CTX_set_verify(mosq->ssl_ctx, SSL_VERIFY_NONE, NULL);
+#else
 			if(mosq->tls_cert_reqs == 0){
 				SSL_CTX_set_verify(mosq->ssl_ctx, SSL_VERIFY_NONE, NULL);
 			}else{
@@ -456,26 +723,27 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 				SSL_CTX_set_default_passwd_cb(mosq->ssl_ctx, mosq->tls_pw_callback);
 				SSL_CTX_set_default_passwd_cb_userdata(mosq->ssl_ctx, mosq);
 			}
+#endif
 
-			if(mosq->tls_certfile){
-				ret = SSL_CTX_use_certificate_chain_file(mosq->ssl_ctx, mosq->tls_certfile);
+			if(tls->tls_certfile){
+				ret = SSL_CTX_use_certificate_chain_file(mosq->ssl_ctx, tls->tls_certfile);
 				if(ret != 1){
 #ifdef WITH_BROKER
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate, check bridge_certfile \"%s\".", mosq->tls_certfile);
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate, check bridge_certfile \"%s\".", tls->tls_certfile);
 #else
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate \"%s\".", mosq->tls_certfile);
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client certificate \"%s\".", tls->tls_certfile);
 #endif
 					COMPAT_CLOSE(sock);
 					return MOSQ_ERR_TLS;
 				}
 			}
-			if(mosq->tls_keyfile){
-				ret = SSL_CTX_use_PrivateKey_file(mosq->ssl_ctx, mosq->tls_keyfile, SSL_FILETYPE_PEM);
+			if(tls->tls_keyfile){
+				ret = SSL_CTX_use_PrivateKey_file(mosq->ssl_ctx, tls->tls_keyfile, SSL_FILETYPE_PEM);
 				if(ret != 1){
 #ifdef WITH_BROKER
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file, check bridge_keyfile \"%s\".", mosq->tls_keyfile);
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file, check bridge_keyfile \"%s\".", tls->tls_keyfile);
 #else
-					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file \"%s\".", mosq->tls_keyfile);
+					_mosquitto_log_printf(mosq, MOSQ_LOG_ERR, "Error: Unable to load client key file \"%s\".", tls->tls_keyfile);
 #endif
 					COMPAT_CLOSE(sock);
 					return MOSQ_ERR_TLS;
@@ -488,7 +756,7 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 				}
 			}
 #ifdef REAL_WITH_TLS_PSK
-		}else if(mosq->tls_psk){
+		}else if(tls->tls_psk){
 			SSL_CTX_set_psk_client_callback(mosq->ssl_ctx, psk_client_callback);
 #endif
 		}
@@ -524,8 +792,7 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 	mosq->sock = sock;
 
 #ifdef WITH_BROKER
-  data->context = mosq;
-  event = event_new(base, sock, EV_READ|EV_PERSIST, handle_reads_writes, data);
+  event = event_new(base, sock, EV_READ|EV_PERSIST, handle_reads_writes, mosq);
   if (!event)
     {
       // can not accept more events
@@ -605,6 +872,46 @@ int _mosquitto_read_string(struct _mosquitto_packet *packet, char **str) //为
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Read a string without copying it. *str points into the packet payload, is
+ * not NUL terminated and is only valid until the packet is freed. */
+int _mosquitto_read_string_view(struct _mosquitto_packet *packet, const char **str, uint16_t *len)
+{
+	int rc;
+
+	assert(packet);
+	rc = _mosquitto_read_uint16(packet, len);
+	if(rc) return rc;
+	if(packet->pos+(*len) > packet->remaining_length) return MOSQ_ERR_PROTOCOL;
+
+	*str = (const char *)&(packet->payload[packet->pos]);
+	packet->pos += *len;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* As _mosquitto_read_string_view(), but *str is NUL terminated. The string
+ * is moved down over its own two byte length so the terminator only ever
+ * overwrites bytes that have already been read, never the rest of the
+ * packet. It is only valid until the packet is freed. */
+int _mosquitto_read_string_borrow(struct _mosquitto_packet *packet, char **str, uint16_t *len)
+{
+	uint8_t *start;
+	int rc;
+
+	assert(packet);
+	rc = _mosquitto_read_uint16(packet, len);
+	if(rc) return rc;
+	if(packet->pos+(*len) > packet->remaining_length) return MOSQ_ERR_PROTOCOL;
+
+	start = &(packet->payload[packet->pos-2]);
+	memmove(start, start+2, *len);
+	start[*len] = '\0';
+	packet->pos += *len;
+
+	*str = (char *)start;
+	return MOSQ_ERR_SUCCESS;
+}
+
 void _mosquitto_write_string(struct _mosquitto_packet *packet, const char *str, uint16_t length)
 {
 	assert(packet);
@@ -736,10 +1043,83 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 #endif
 }
 
+#if defined(WITH_BROKER) && !defined(WIN32)
+/* Write the current packet together with as many of the packets queued
+ * behind it as will fit in a single writev() call. Any bytes written beyond
+ * the end of the current packet are credited to the queued packets here, so
+ * the caller only has to account for the current one. */
+static ssize_t _mosquitto_net_writev(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+{
+	struct iovec iov[MOSQ_WRITEV_MAX];
+	struct _mosquitto_packet *queued[MOSQ_WRITEV_MAX];
+	struct _mosquitto_packet *next, *rest, *ctrl;
+	ssize_t write_length;
+	size_t extra;
+	int count = 0;
+	int i;
+
+#ifdef WITH_TLS
+	if(mosq->ssl){
+		return _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+	}
+#endif
+	ctrl = mosq->cold ? mosq->cold->ctrl_packet : NULL;
+	if(!mosq->out_packet && !ctrl){
+		return _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+	}
+
+	iov[count].iov_base = &(packet->payload[packet->pos]);
+	iov[count].iov_len = packet->to_process;
+	count++;
+	/* In the order _mosquitto_packet_next() will take them: what goes ahead
+	 * of the control lane, the control lane, then the rest of out_packet. */
+	for(next=mosq->out_packet; _mosquitto_packet_ahead(next) && count<MOSQ_WRITEV_MAX; next=next->next){
+		queued[count] = next;
+		count++;
+	}
+	rest = next;
+	for(next=ctrl; next && count<MOSQ_WRITEV_MAX; next=next->next){
+		queued[count] = next;
+		count++;
+	}
+	for(next=rest; next && count<MOSQ_WRITEV_MAX; next=next->next){
+		queued[count] = next;
+		count++;
+	}
+	for(i=1; i<count; i++){
+		iov[i].iov_base = &(queued[i]->payload[queued[i]->pos]);
+		iov[i].iov_len = queued[i]->to_process;
+	}
+
+	errno = 0;
+	write_length = writev(mosq->sock, iov, count);
+	if(write_length > (ssize_t)packet->to_process){
+		extra = write_length - packet->to_process;
+		for(i=1; i<count && extra>0; i++){
+			next = queued[i];
+			if(extra >= next->to_process){
+				extra -= next->to_process;
+				next->pos += next->to_process;
+				next->to_process = 0;
+			}else{
+				next->pos += extra;
+				next->to_process -= extra;
+				extra = 0;
+			}
+		}
+	}
+	return write_length;
+}
+#endif
+
 int _mosquitto_packet_write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
 	struct _mosquitto_packet *packet;
+#if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
+	uint64_t wait_ms;
+	int lane;
+#endif
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
@@ -749,6 +1129,11 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 	pthread_mutex_lock(&mosq->current_out_packet_mutex);
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 
+#ifdef WITH_BROKER
+	if(!mosq->current_out_packet){
+		mosq->current_out_packet = _mosquitto_packet_next(mosq);
+	}
+#else
 	if(mosq->out_packet && !mosq->current_out_packet){
 		mosq->current_out_packet = mosq->out_packet;
 		mosq->out_packet = mosq->out_packet->next;
@@ -756,18 +1141,33 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 			mosq->out_packet_last = NULL;
 		}
 	}
+#endif
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 
 	while(mosq->current_out_packet){
 		packet = mosq->current_out_packet;
 
 		while(packet->to_process > 0){
+#if defined(WITH_BROKER) && !defined(WIN32)
+			write_length = _mosquitto_net_writev(mosq, packet);
+#else
 			write_length = _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+#endif
       printf("have send out %zd bytes.\n",write_length);
 
 			if(write_length > 0){
 #if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
 				g_bytes_sent += write_length;
+#endif
+#ifdef WITH_BROKER
+				mqtt3_out_bytes_update(mosq, -(int64_t)write_length);
+#endif
+#if defined(WITH_BROKER) && !defined(WIN32)
+				/* Anything past this packet has already been credited to the
+				 * packets queued behind it. */
+				if(write_length > (ssize_t)packet->to_process){
+					write_length = packet->to_process;
+				}
 #endif
 				packet->to_process -= write_length;
 				packet->pos += write_length;
@@ -778,7 +1178,12 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 				if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
           // 当前的包未发完，但是socket不可写，等待下一次再写出去
 					pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+#ifdef WITH_BROKER
+					/* Carry on as soon as the socket is writable again. */
+					return mqtt3_event_write_set(mosq, true);
+#else
 					return MOSQ_ERR_SUCCESS;
+#endif
 				}else{
 					pthread_mutex_unlock(&mosq->current_out_packet_mutex);
 					switch(errno){
@@ -794,10 +1199,17 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
     // 当前包发送全部发送完毕
 #ifdef WITH_BROKER
 #  ifdef WITH_SYS_TREE
-		g_msgs_sent++;
+		g_msgs_sent += packet->ctrl_count ? packet->ctrl_count : 1;
 		if(((packet->command)&0xF6) == PUBLISH){
 			g_pub_msgs_sent++;
 		}
+		lane = _mosquitto_packet_lane(packet->command);
+		wait_ms = (uint32_t)mosquitto_time_ms() - packet->queued_ms;
+		g_out_wait_ms[lane] += wait_ms;
+		g_out_wait_count[lane]++;
+		if(wait_ms > g_out_wait_max[lane]){
+			g_out_wait_max[lane] = wait_ms;
+		}
 #  endif
 #else
     // 线程安全的函数
@@ -815,6 +1227,9 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 
 		/* Free data and reset values */
 		pthread_mutex_lock(&mosq->out_packet_mutex);
+#ifdef WITH_BROKER
+		mosq->current_out_packet = _mosquitto_packet_next(mosq);
+#else
 		mosq->current_out_packet = mosq->out_packet;
 		if(mosq->out_packet){
 			mosq->out_packet = mosq->out_packet->next;
@@ -822,10 +1237,10 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 				mosq->out_packet_last = NULL;
 			}
 		}
+#endif
 		pthread_mutex_unlock(&mosq->out_packet_mutex);
 
-		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 
 		pthread_mutex_lock(&mosq->msgtime_mutex);
 		mosq->last_msg_out = mosquitto_time();
@@ -984,6 +1399,10 @@ int _mosquitto_packet_read(struct mosquitto_db *db, struct mosquitto *mosq)
 	}
   #endif
 	rc = mqtt3_packet_handle(db, mosq);
+	if(!rc && mosq->listener && mosq->listener->rate_limited && mosq->sock != INVALID_SOCKET){
+		mqtt3_rate_charge(db, mosq, 1 + mosq->in_packet.remaining_count + mosq->in_packet.remaining_length,
+				((mosq->in_packet.command)&0xF0) == PUBLISH);
+	}
 #else
 	rc = _mosquitto_packet_handle(mosq);
 #endif
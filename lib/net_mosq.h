@@ -66,13 +66,32 @@ struct mosquitto_db;
 #define MOSQ_MSB(A) (uint8_t)((A & 0xFF00) >> 8)
 #define MOSQ_LSB(A) (uint8_t)(A & 0x00FF)
 
+/* Maximum number of queued packets gathered into one writev() call. */
+#define MOSQ_WRITEV_MAX 64
+
+/* Bytes of control packets (acks, pings) that share one pooled packet, and
+ * the number of free pooled packets kept for reuse. */
+#define MOSQ_CTRL_PACKET_BYTES 64
+#define MOSQ_CTRL_POOL_MAX 1024
+
+/* Output lanes of a broker context, used to index the wait time counters. */
+#define MOSQ_LANE_CTRL 0
+#define MOSQ_LANE_DATA 1
+
 void _mosquitto_net_init(void);
 void _mosquitto_net_cleanup(void);
 
 void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet);
+void _mosquitto_packet_free(struct _mosquitto_packet *packet);
+#ifdef WITH_BROKER
+void _mosquitto_frame_release(struct _mosquitto_frame *frame);
+#endif
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet);
 #ifdef WITH_BROKER
-int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking, struct mosquitto_funcs_data *data);
+int _mosquitto_packet_queue_ctrl(struct mosquitto *mosq, uint8_t command, uint16_t mid, bool with_mid);
+#endif
+#ifdef WITH_BROKER
+int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking, struct event_base *base);
 #else
 int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking);
 #endif
@@ -82,6 +101,8 @@ int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const cha
 int _mosquitto_read_byte(struct _mosquitto_packet *packet, uint8_t *byte);
 int _mosquitto_read_bytes(struct _mosquitto_packet *packet, void *bytes, uint32_t count);
 int _mosquitto_read_string(struct _mosquitto_packet *packet, char **str);
+int _mosquitto_read_string_view(struct _mosquitto_packet *packet, const char **str, uint16_t *len);
+int _mosquitto_read_string_borrow(struct _mosquitto_packet *packet, char **str, uint16_t *len);
 int _mosquitto_read_uint16(struct _mosquitto_packet *packet, uint16_t *word);
 
 void _mosquitto_write_byte(struct _mosquitto_packet *packet, uint8_t byte);
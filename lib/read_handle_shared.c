@@ -69,10 +69,11 @@ int _mosquitto_handle_pingresp(struct mosquitto *mosq)
 		return MOSQ_ERR_PROTOCOL;
 	}
 #endif
-	mosq->ping_t = 0; /* No longer waiting for a PINGRESP. */
 #ifdef WITH_BROKER
+	if(mosq->cold) mosq->cold->ping_t = 0; /* No longer waiting for a PINGRESP. */
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PINGRESP from %s", mosq->id);
 #else
+	mosq->ping_t = 0; /* No longer waiting for a PINGRESP. */
 	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received PINGRESP", mosq->id);
 #endif
 	return MOSQ_ERR_SUCCESS;
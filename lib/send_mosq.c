@@ -51,6 +51,9 @@ extern uint64_t g_pub_bytes_sent;
 int _mosquitto_send_pingreq(struct mosquitto *mosq)
 {
 	int rc;
+#ifdef WITH_BROKER
+	struct mosquitto_cold *cold;
+#endif
 	assert(mosq);
 #ifdef WITH_BROKER
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PINGREQ to %s", mosq->id);
@@ -59,7 +62,12 @@ int _mosquitto_send_pingreq(struct mosquitto *mosq)
 #endif
 	rc = _mosquitto_send_simple_command(mosq, PINGREQ);
 	if(rc == MOSQ_ERR_SUCCESS){
+#ifdef WITH_BROKER
+		cold = mqtt3_context_cold(mosq);
+		if(cold) cold->ping_t = mosquitto_time();
+#else
 		mosq->ping_t = mosquitto_time();
+#endif
 	}
 	return rc;
 }
@@ -99,12 +107,7 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 #ifdef WITH_BROKER
 	size_t len;
 #ifdef WITH_BRIDGE
-	int i;
-	struct _mqtt3_bridge_topic *cur_topic;
-	bool match;
 	int rc;
-	char *mapped_topic = NULL;
-	char *topic_temp = NULL;
 #endif
 #endif
 	assert(mosq);
@@ -123,52 +126,8 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 	}
 #ifdef WITH_BRIDGE
 	if(mosq->bridge && mosq->bridge->topics && mosq->bridge->topic_remapping){
-		for(i=0; i<mosq->bridge->topic_count; i++){
-			cur_topic = &mosq->bridge->topics[i];
-			if(cur_topic->remote_prefix || cur_topic->local_prefix){
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->local_topic, topic, &match);
-				if(rc){
-					return rc;
-				}
-				if(match){
-					mapped_topic = _mosquitto_strdup(topic);
-					if(!mapped_topic) return MOSQ_ERR_NOMEM;
-					if(cur_topic->local_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->local_prefix, mapped_topic, strlen(cur_topic->local_prefix))){
-							topic_temp = _mosquitto_strdup(mapped_topic+strlen(cur_topic->local_prefix));
-							_mosquitto_free(mapped_topic);
-							if(!topic_temp){
-								return MOSQ_ERR_NOMEM;
-							}
-							mapped_topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->remote_prefix){
-						/* This prefix needs adding. */
-						len = strlen(mapped_topic) + strlen(cur_topic->remote_prefix)+1;
-						topic_temp = _mosquitto_calloc(len+1, sizeof(char));
-						if(!topic_temp){
-							_mosquitto_free(mapped_topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->remote_prefix, mapped_topic);
-						_mosquitto_free(mapped_topic);
-						mapped_topic = topic_temp;
-					}
-					_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
-#ifdef WITH_SYS_TREE
-					g_pub_bytes_sent += payloadlen;
-#endif
-					rc =  _mosquitto_send_real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup);
-					_mosquitto_free(mapped_topic);
-					return rc;
-				}
-			}
-		}
+		rc = mqtt3_bridge_remap_outgoing(mosq, topic, &topic);
+		if(rc) return rc;
 	}
 #endif
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
@@ -205,6 +164,11 @@ int _mosquitto_send_pubrel(struct mosquitto *mosq, uint16_t mid, bool dup)
 /* For PUBACK, PUBCOMP, PUBREC, and PUBREL */
 int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, uint16_t mid, bool dup)
 {
+#ifdef WITH_BROKER
+	assert(mosq);
+	/* Written into a pooled packet, see _mosquitto_packet_queue_ctrl(). */
+	return _mosquitto_packet_queue_ctrl(mosq, dup ? command|8 : command, mid, true);
+#else
 	struct _mosquitto_packet *packet = NULL;
 	int rc;
 
@@ -227,11 +191,17 @@ int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, ui
 	packet->payload[packet->pos+1] = MOSQ_LSB(mid);
 
 	return _mosquitto_packet_queue(mosq, packet);
+#endif
 }
 
 /* For DISCONNECT, PINGREQ and PINGRESP */
 int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 {
+#ifdef WITH_BROKER
+	assert(mosq);
+	/* Written into a pooled packet, see _mosquitto_packet_queue_ctrl(). */
+	return _mosquitto_packet_queue_ctrl(mosq, command, 0, false);
+#else
 	struct _mosquitto_packet *packet = NULL;
 	int rc;
 
@@ -249,6 +219,7 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 	}
 
 	return _mosquitto_packet_queue(mosq, packet);
+#endif
 }
 
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup)
@@ -286,3 +257,61 @@ int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const cha
 
 	return _mosquitto_packet_queue(mosq, packet); //packet都是入队列的，不是一次写出去
 }
+
+#ifdef WITH_BROKER
+/* Serialise a QoS 0 PUBLISH once so that it can be queued to any number of
+ * clients with _mosquitto_send_frame(). The caller owns the returned
+ * reference. */
+int _mosquitto_frame_publish(const char *topic, uint32_t payloadlen, const void *payload, bool retain, struct _mosquitto_frame **frame)
+{
+	struct _mosquitto_packet packet;
+	int rc;
+
+	assert(topic);
+	assert(frame);
+
+	memset(&packet, 0, sizeof(struct _mosquitto_packet));
+	packet.command = PUBLISH | retain;
+	packet.remaining_length = 2+strlen(topic) + payloadlen;
+	rc = _mosquitto_packet_alloc(&packet);
+	if(rc) return rc;
+
+	/* Variable header (topic string) */
+	_mosquitto_write_string(&packet, topic, strlen(topic));
+	/* Payload */
+	if(payloadlen){
+		_mosquitto_write_bytes(&packet, payload, payloadlen);
+	}
+
+	*frame = _mosquitto_malloc(sizeof(struct _mosquitto_frame));
+	if(!(*frame)){
+		_mosquitto_free(packet.payload);
+		return MOSQ_ERR_NOMEM;
+	}
+	(*frame)->payload = packet.payload;
+	(*frame)->packet_length = packet.packet_length;
+	(*frame)->ref_count = 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int _mosquitto_send_frame(struct mosquitto *mosq, struct _mosquitto_frame *frame)
+{
+	struct _mosquitto_packet *packet = NULL;
+
+	assert(mosq);
+	assert(frame);
+
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->command = frame->payload[0];
+	packet->payload = frame->payload;
+	packet->packet_length = frame->packet_length;
+	packet->frame = frame;
+	frame->ref_count++;
+
+	return _mosquitto_packet_queue(mosq, packet);
+}
+#endif
@@ -47,4 +47,10 @@ int _mosquitto_send_pubrel(struct mosquitto *mosq, uint16_t mid, bool dup);
 int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const char *topic, uint8_t topic_qos);
 int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, const char *topic);
 
+#ifdef WITH_BROKER
+struct _mosquitto_frame;
+int _mosquitto_frame_publish(const char *topic, uint32_t payloadlen, const void *payload, bool retain, struct _mosquitto_frame **frame);
+int _mosquitto_send_frame(struct mosquitto *mosq, struct _mosquitto_frame *frame);
+#endif
+
 #endif
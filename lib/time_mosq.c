@@ -93,3 +93,34 @@ time_t mosquitto_time(void)
 #endif
 }
 
+
+#ifdef WITH_BROKER
+/* As mosquitto_time(), but in milliseconds. */
+uint64_t mosquitto_time_ms(void)
+{
+#ifdef WIN32
+	if(tick64){
+		return GetTickCount64();
+	}else{
+		return GetTickCount();
+	}
+#elif _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec*1000 + tp.tv_nsec/1000000;
+#elif defined(__APPLE__)
+	static mach_timebase_info_data_t tb;
+	uint64_t ticks;
+
+	ticks = mach_absolute_time();
+
+	if(tb.denom == 0){
+		mach_timebase_info(&tb);
+	}
+	return (ticks/1000000)*(tb.numer/tb.denom);
+#else
+	return (uint64_t)time(NULL)*1000;
+#endif
+}
+#endif
@@ -34,5 +34,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <time.h>
 
 time_t mosquitto_time(void);
+#ifdef WITH_BROKER
+#include <stdint.h>
+uint64_t mosquitto_time_ms(void);
+#endif
 
 #endif
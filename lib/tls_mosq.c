@@ -64,7 +64,11 @@ int _mosquitto_server_certificate_verify(int preverify_ok, X509_STORE_CTX *ctx)
 	mosq = SSL_get_ex_data(ssl, tls_ex_index_mosq);
 	if(!mosq) return 0;
 
+#ifdef WITH_BROKER
+	if(mosq->bridge->tls_insecure == false){
+#else
 	if(mosq->tls_insecure == false){
+#endif
 		if(X509_STORE_CTX_get_error_depth(ctx) == 0){
 			/* FIXME - use X509_check_host() etc. for sufficiently new openssl (>=1.1.x) */
 			cert = X509_STORE_CTX_get_current_cert(ctx);
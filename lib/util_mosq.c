@@ -33,6 +33,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifdef WIN32
 #include <winsock2.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #include "mosquitto.h"
@@ -111,7 +114,11 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq)
 	if(mosq->sock != INVALID_SOCKET &&
 			(now - last_msg_out >= mosq->keepalive || now - last_msg_in >= mosq->keepalive)){
 
+#ifdef WITH_BROKER
+		if(mosq->state == mosq_cs_connected && (!mosq->cold || mosq->cold->ping_t == 0)){
+#else
 		if(mosq->state == mosq_cs_connected && mosq->ping_t == 0){
+#endif
 			_mosquitto_send_pingreq(mosq);
 			/* Reset last msg times to give the server time to send a pingresp */
 			pthread_mutex_lock(&mosq->msgtime_mutex);
@@ -148,36 +155,139 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq)
 }
 
 /* Convert ////some////over/slashed///topic/etc/etc//
- * into some/over/slashed/topic/etc/etc
+ * into /some/over/slashed/topic/etc/etc
+ * The result is never longer than the input, so this is done in place and
+ * *subtopic is left pointing at the same string.
  */
 int _mosquitto_fix_sub_topic(char **subtopic)
 {
-	char *fixed = NULL;
-	char *token;
-	char *saveptr = NULL;
+	char *src, *dst;
 
 	assert(subtopic);
 	assert(*subtopic);
 
-	if(strlen(*subtopic) == 0) return MOSQ_ERR_SUCCESS;
-	/* size of fixed here is +1 for the terminating 0 and +1 for the spurious /
-	 * that gets appended. */
-	fixed = _mosquitto_calloc(strlen(*subtopic)+2, 1);
-	if(!fixed) return MOSQ_ERR_NOMEM;
+	src = dst = *subtopic;
+	while(*src){
+		if(*src == '/'){
+			while(src[1] == '/') src++;
+			/* Drop a trailing slash. */
+			if(src[1] == '\0') break;
+		}
+		*dst++ = *src++;
+	}
+	*dst = '\0';
+	return MOSQ_ERR_SUCCESS;
+}
 
-	if((*subtopic)[0] == '/'){
-		fixed[0] = '/';
+/* Check the UTF-8 sequence starting at str[0], a byte with the top bit set,
+ * and return its length or 0 if it is malformed, overlong, a surrogate or
+ * beyond U+10FFFF. */
+static int _mosquitto_utf8_seq_len(const unsigned char *str, uint32_t avail)
+{
+	unsigned char lo = 0x80, hi = 0xBF;
+	int len, i;
+
+	if(str[0] >= 0xC2 && str[0] <= 0xDF){
+		len = 2;
+	}else if(str[0] >= 0xE0 && str[0] <= 0xEF){
+		len = 3;
+		if(str[0] == 0xE0) lo = 0xA0;
+		if(str[0] == 0xED) hi = 0x9F;
+	}else if(str[0] >= 0xF0 && str[0] <= 0xF4){
+		len = 4;
+		if(str[0] == 0xF0) lo = 0x90;
+		if(str[0] == 0xF4) hi = 0x8F;
+	}else{
+		return 0;
 	}
-	token = strtok_r(*subtopic, "/", &saveptr);
-	while(token){
-		strcat(fixed, token);
-		strcat(fixed, "/");
-		token = strtok_r(NULL, "/", &saveptr);
+	if(avail < (uint32_t)len) return 0;
+	if(str[1] < lo || str[1] > hi) return 0;
+	for(i=2; i<len; i++){
+		if(str[i] < 0x80 || str[i] > 0xBF) return 0;
+	}
+	return len;
+}
+
+/* Validate the len bytes of a PUBLISH topic and normalise it in place the same
+ * way as _mosquitto_fix_sub_topic(), in a single pass: runs of / are collapsed
+ * and a trailing / is dropped. *len is updated to the new length.
+ * Returns MOSQ_ERR_PROTOCOL if the topic contains a NUL or isn't valid UTF-8,
+ * MOSQ_ERR_INVAL if it contains a wildcard.
+ */
+int _mosquitto_pub_topic_check(char *topic, uint32_t *len)
+{
+	unsigned char *src = (unsigned char *)topic;
+	unsigned char *dst = src;
+	unsigned char *end = src + *len;
+	unsigned char *block_end;
+	bool slash = false; /* last byte written was a / */
+	int n;
+#ifdef __SSE2__
+	__m128i v, special;
+	int mask;
+#endif
+
+	while(src < end){
+#ifdef __SSE2__
+		/* Plain ASCII without wildcards or doubled slashes is the common
+		 * case and is handled 16 bytes at a time. A block with anything
+		 * else in it goes through the byte loop below. */
+		if(end - src >= 16){
+			v = _mm_loadu_si128((const __m128i *)src);
+			special = _mm_or_si128(_mm_or_si128(
+						_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+						_mm_cmpeq_epi8(v, _mm_set1_epi8('#'))),
+					_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+			if(!_mm_movemask_epi8(special) && !_mm_movemask_epi8(v)
+					&& !(mask & ((mask<<1) | slash))){
+
+				_mm_storeu_si128((__m128i *)dst, v);
+				slash = (mask & 0x8000) != 0;
+				src += 16;
+				dst += 16;
+				continue;
+			}
+		}
+		block_end = src + 16 < end ? src + 16 : end;
+#else
+		block_end = end;
+#endif
+		while(src < block_end){
+			if(*src < 0x80){
+				switch(*src){
+					case '\0':
+						return MOSQ_ERR_PROTOCOL;
+					case '+':
+					case '#':
+						return MOSQ_ERR_INVAL;
+					case '/':
+						if(slash){
+							src++;
+							continue;
+						}
+						slash = true;
+						break;
+					default:
+						slash = false;
+						break;
+				}
+				*dst++ = *src++;
+			}else{
+				/* May run past block_end, which is fine. */
+				n = _mosquitto_utf8_seq_len(src, end-src);
+				if(!n) return MOSQ_ERR_PROTOCOL;
+				memmove(dst, src, n);
+				src += n;
+				dst += n;
+				slash = false;
+			}
+		}
 	}
+	if(slash) dst--;
+	*dst = '\0';
 
-	fixed[strlen(fixed)-1] = '\0';
-	_mosquitto_free(*subtopic);
-	*subtopic = fixed;
+	*len = dst - (unsigned char *)topic;
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -39,6 +39,7 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq);
 int _mosquitto_fix_sub_topic(char **subtopic);
 uint16_t _mosquitto_mid_generate(struct mosquitto *mosq);
 int _mosquitto_topic_wildcard_len_check(const char *str);
+int _mosquitto_pub_topic_check(char *topic, uint32_t *len);
 FILE *_mosquitto_fopen(const char *path, const char *mode);
 
 #ifdef REAL_WITH_TLS_PSK
@@ -55,44 +55,14 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef WITH_BRIDGE
 
-int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge, struct event_base *base)
+/* Find or create the context for one connection of a bridge and start
+ * connecting it. Takes ownership of id. */
+static int _bridge_context_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge, char *id, struct event_base *base)
 {
 	int i;
 	struct mosquitto *new_context = NULL;
 	int null_index = -1;
 	struct mosquitto **tmp_contexts;
-	char hostname[256];
-	int len;
-	char *id;
-  int ret;
-
-	assert(db);
-	assert(bridge);
-  assert(base);
-
-  // 构造bridge的id值，用来标识一个bridge，具体的构造规则可以参考mosquitto.conf文件
-	if(bridge->clientid){
-		id = _mosquitto_strdup(bridge->clientid);
-    if(!id){
-      return MOSQ_ERR_NOMEM;
-    }
-	}else{
-		if(!gethostname(hostname, 256)){
-			len = strlen(hostname) + strlen(bridge->name) + 2;
-			id = _mosquitto_malloc(len);
-			if(!id){
-				return MOSQ_ERR_NOMEM;
-			}
-			ret = snprintf(id, len, "%s.%s", hostname, bridge->name);
-      // TODO 防御性编程？
-      if (ret<0) //赋值出错了
-        {
-          return 1;
-        }
-		}else{
-			return 1;
-		}
-	}
 
 	/* Search for existing id (possible from persistent db) and also look for a
 	 * gap in the db->contexts[] array in case the id isn't found. */
@@ -113,6 +83,7 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge, stru
 		/* id wasn't found, so generate a new context */
 		new_context = mqtt3_context_init(-1);
 		if(!new_context){
+			_mosquitto_free(id);
 			return MOSQ_ERR_NOMEM;
 		}
 
@@ -124,7 +95,9 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge, stru
 				db->contexts = tmp_contexts;
 				db->contexts[db->context_count-1] = new_context;
 			}else{
+				db->context_count--;
 				_mosquitto_free(new_context);
+				_mosquitto_free(id);
 				return MOSQ_ERR_NOMEM;
 			}
 		}else{
@@ -137,29 +110,141 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge, stru
 	}
 
 	new_context->bridge = bridge;
+	mqtt3_db_inflight_init(new_context);
 	new_context->is_bridge = true;
+	bridge->context = new_context;
 
 	new_context->username = new_context->bridge->username;
 	new_context->password = new_context->bridge->password;
 
-#ifdef WITH_TLS
-	new_context->tls_cafile = new_context->bridge->tls_cafile;
-	new_context->tls_capath = new_context->bridge->tls_capath;
-	new_context->tls_certfile = new_context->bridge->tls_certfile;
-	new_context->tls_keyfile = new_context->bridge->tls_keyfile;
-	new_context->tls_version = new_context->bridge->tls_version;
-	new_context->tls_insecure = new_context->bridge->tls_insecure;
-#ifdef REAL_WITH_TLS_PSK
-	new_context->tls_psk_identity = new_context->bridge->tls_psk_identity;
-	new_context->tls_psk = new_context->bridge->tls_psk;
-#endif
-#endif
-
 	bridge->try_private_accepted = true;
 
 	return mqtt3_bridge_connect(db, new_context, base);
 }
 
+/* Give each extra connection of a bridge its own copy of the bridge so that
+ * the connection state (current address, restart time, remap buffer) is kept
+ * apart. The configuration strings and topics are shared with the original,
+ * which is always partition 0, apart from the notification topic: each
+ * connection has its own retained state message and will. */
+static int _bridge_partitions_new(struct _mqtt3_bridge *bridge)
+{
+	struct _mqtt3_bridge *copy;
+	int len;
+	int i;
+
+	bridge->partitions = _mosquitto_calloc(bridge->connection_count, sizeof(struct _mqtt3_bridge *));
+	if(!bridge->partitions) return MOSQ_ERR_NOMEM;
+
+	bridge->partition = 0;
+	bridge->partitions[0] = bridge;
+	for(i=1; i<bridge->connection_count; i++){
+		copy = _mosquitto_malloc(sizeof(struct _mqtt3_bridge));
+		if(!copy) return MOSQ_ERR_NOMEM;
+
+		memcpy(copy, bridge, sizeof(struct _mqtt3_bridge));
+		copy->partition = i;
+		copy->remap_out_buf = NULL;
+		copy->remap_out_buf_len = 0;
+		copy->remap_in_buf = NULL;
+		copy->remap_in_buf_len = 0;
+		copy->context = NULL;
+		copy->away_count = 0;
+		copy->notification_topic = NULL;
+		bridge->partitions[i] = copy;
+		if(bridge->notification_topic){
+			len = strlen(bridge->notification_topic) + 12;
+			copy->notification_topic = _mosquitto_malloc(len);
+			if(!copy->notification_topic) return MOSQ_ERR_NOMEM;
+			snprintf(copy->notification_topic, len, "%s/%d", bridge->notification_topic, i);
+		}
+		if(copy->round_robin){
+			/* Spread the connections over the configured addresses. */
+			copy->cur_address = i % copy->address_count;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge, struct event_base *base)
+{
+	int i;
+	char hostname[256];
+	int len;
+	char *id;
+	char *partition_id;
+	int ret;
+	int rc;
+	int rc2;
+
+	assert(db);
+	assert(bridge);
+  assert(base);
+
+  // 构造bridge的id值，用来标识一个bridge，具体的构造规则可以参考mosquitto.conf文件
+	if(bridge->clientid){
+		id = _mosquitto_strdup(bridge->clientid);
+    if(!id){
+      return MOSQ_ERR_NOMEM;
+    }
+	}else{
+		if(!gethostname(hostname, 256)){
+			len = strlen(hostname) + strlen(bridge->name) + 2;
+			id = _mosquitto_malloc(len);
+			if(!id){
+				return MOSQ_ERR_NOMEM;
+			}
+			ret = snprintf(id, len, "%s.%s", hostname, bridge->name);
+      // TODO 防御性编程？
+      if (ret<0) //赋值出错了
+        {
+          _mosquitto_free(id);
+          return 1;
+        }
+		}else{
+			return 1;
+		}
+	}
+
+	if(mqtt3_bridge_remap_compile(bridge)){
+		_mosquitto_free(id);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	if(bridge->connection_count <= 1){
+		return _bridge_context_new(db, bridge, id, base);
+	}
+
+	if(_bridge_partitions_new(bridge)){
+		_mosquitto_free(id);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	/* Connection 0 keeps the plain id so that an existing single connection
+	 * bridge carries on with its persistent session. The others get the
+	 * partition number appended. */
+	rc = MOSQ_ERR_SUCCESS;
+	for(i=1; i<bridge->connection_count; i++){
+		len = strlen(id) + 12;
+		partition_id = _mosquitto_malloc(len);
+		if(!partition_id){
+			_mosquitto_free(id);
+			return MOSQ_ERR_NOMEM;
+		}
+		snprintf(partition_id, len, "%s.%d", id, i);
+		rc2 = _bridge_context_new(db, bridge->partitions[i], partition_id, base);
+		if(rc2 == MOSQ_ERR_NOMEM){
+			_mosquitto_free(id);
+			return rc2;
+		}
+		if(rc2 && !rc) rc = rc2;
+	}
+	rc2 = _bridge_context_new(db, bridge, id, base);
+	if(rc2 && !rc) rc = rc2;
+
+	return rc;
+}
+
 int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context, struct event_base *base)
 {
 	int rc;
@@ -177,7 +262,7 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context, str
 	context->keepalive = context->bridge->keepalive;
 	context->clean_session = context->bridge->clean_session;
 	context->in_packet.payload = NULL;
-	context->ping_t = 0;
+	if(context->cold) context->cold->ping_t = 0;
 	context->bridge->lazy_reconnect = false;
   // 释放掉所有残留未发出去和接收到的包
 	mqtt3_bridge_packet_cleanup(context);
@@ -194,7 +279,10 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context, str
 	 */
 	mqtt3_subs_clean_session(db, context, &db->subs);
   // 删除所有订阅后，重新订阅一次
-	for(i=0; i<context->bridge->topic_count; i++){
+	/* Only the first connection of a multi-connection bridge subscribes
+	 * locally, messages are then spread over the others by
+	 * mqtt3_bridge_partition(). */
+	for(i=0; context->bridge->partition == 0 && i<context->bridge->topic_count; i++){
 		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
 			if(mqtt3_sub_add(db, context, context->bridge->topics[i].local_topic, context->bridge->topics[i].qos, &db->subs)) return 1;
@@ -271,15 +359,325 @@ void mqtt3_bridge_packet_cleanup(struct mosquitto *context)
 	if(!context) return;
 
 	_mosquitto_packet_cleanup(context->current_out_packet);
+	if(context->cold){
+		while(context->cold->ctrl_packet){
+			packet = context->cold->ctrl_packet;
+			context->cold->ctrl_packet = context->cold->ctrl_packet->next;
+			_mosquitto_packet_free(packet);
+		}
+	}
   while(context->out_packet){
-		_mosquitto_packet_cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 	}
 
   // TODO mosquitto对入包的管理非常奇怪，难道只是用一个in_packet就搞定了所有的入包么...
 	_mosquitto_packet_cleanup(&(context->in_packet));
 }
 
+
+/* One topic level of a compiled set of bridge topic patterns. */
+struct _mqtt3_bridge_remap_node{
+	struct _mqtt3_bridge_remap_node *children;
+	struct _mqtt3_bridge_remap_node *next;
+	char *level; /* "+" and "#" are wildcards */
+	int level_len;
+	int rule; /* lowest index into bridge->topics of a pattern ending here, or -1 */
+};
+
+static void _remap_node_free(struct _mqtt3_bridge_remap_node *node)
+{
+	struct _mqtt3_bridge_remap_node *next;
+
+	while(node){
+		next = node->next;
+		_remap_node_free(node->children);
+		if(node->level) _mosquitto_free(node->level);
+		_mosquitto_free(node);
+		node = next;
+	}
+}
+
+static int _remap_node_add(struct _mqtt3_bridge_remap_node *root, const char *pattern, int rule)
+{
+	struct _mqtt3_bridge_remap_node *node = root;
+	struct _mqtt3_bridge_remap_node *child;
+	const char *end;
+	int len;
+
+	while(1){
+		end = strchr(pattern, '/');
+		len = end ? (size_t)(end - pattern) : strlen(pattern);
+
+		for(child = node->children; child; child = child->next){
+			if(child->level_len == len && !memcmp(child->level, pattern, len)) break;
+		}
+		if(!child){
+			child = _mosquitto_calloc(1, sizeof(struct _mqtt3_bridge_remap_node));
+			if(!child) return MOSQ_ERR_NOMEM;
+			child->level = _mosquitto_malloc(len+1);
+			if(!child->level){
+				_mosquitto_free(child);
+				return MOSQ_ERR_NOMEM;
+			}
+			memcpy(child->level, pattern, len);
+			child->level[len] = '\0';
+			child->level_len = len;
+			child->rule = -1;
+			child->next = node->children;
+			node->children = child;
+		}
+		node = child;
+		if(!end) break;
+		pattern = end+1;
+	}
+	if(node->rule == -1 || rule < node->rule){
+		node->rule = rule;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Find the lowest numbered pattern below node that matches topic, using the
+ * same rules as mosquitto_topic_matches_sub(). topic is NULL once every
+ * level has been used, which lets "foo/#" match "foo". */
+static void _remap_node_match(struct _mqtt3_bridge_remap_node *node, const char *topic, int *best)
+{
+	struct _mqtt3_bridge_remap_node *child;
+	const char *end = NULL;
+	int len = 0;
+
+	if(topic){
+		end = strchr(topic, '/');
+		len = end ? (size_t)(end - topic) : strlen(topic);
+	}
+	for(child = node->children; child; child = child->next){
+		if(child->level_len == 1 && child->level[0] == '#'){
+			if(child->rule != -1 && (*best == -1 || child->rule < *best)){
+				*best = child->rule;
+			}
+			continue;
+		}
+		if(!topic) continue;
+		if((child->level_len == 1 && child->level[0] == '+')
+				|| (child->level_len == len && !memcmp(child->level, topic, len))){
+
+			if(end){
+				_remap_node_match(child, end+1, best);
+			}else{
+				if(child->rule != -1 && (*best == -1 || child->rule < *best)){
+					*best = child->rule;
+				}
+				_remap_node_match(child, NULL, best);
+			}
+		}
+	}
+}
+
+void mqtt3_bridge_remap_cleanup(struct _mqtt3_bridge *bridge)
+{
+	if(!bridge) return;
+
+	_remap_node_free(bridge->remap_out);
+	bridge->remap_out = NULL;
+	_remap_node_free(bridge->remap_in);
+	bridge->remap_in = NULL;
+}
+
+/* Compile the patterns of all topics that need remapping into one trie per
+ * direction, so each message only walks its own topic levels once. */
+int mqtt3_bridge_remap_compile(struct _mqtt3_bridge *bridge)
+{
+	struct _mqtt3_bridge_topic *cur_topic;
+	int i;
+
+	assert(bridge);
+
+	mqtt3_bridge_remap_cleanup(bridge);
+	if(!bridge->topic_remapping) return MOSQ_ERR_SUCCESS;
+
+	bridge->remap_out = _mosquitto_calloc(1, sizeof(struct _mqtt3_bridge_remap_node));
+	bridge->remap_in = _mosquitto_calloc(1, sizeof(struct _mqtt3_bridge_remap_node));
+	if(!bridge->remap_out || !bridge->remap_in){
+		mqtt3_bridge_remap_cleanup(bridge);
+		return MOSQ_ERR_NOMEM;
+	}
+	bridge->remap_out->rule = -1;
+	bridge->remap_in->rule = -1;
+
+	for(i=0; i<bridge->topic_count; i++){
+		cur_topic = &bridge->topics[i];
+		if(!cur_topic->remote_prefix && !cur_topic->local_prefix) continue;
+
+		if(_remap_node_add(bridge->remap_out, cur_topic->local_topic, i)
+				|| _remap_node_add(bridge->remap_in, cur_topic->remote_topic, i)){
+
+			mqtt3_bridge_remap_cleanup(bridge);
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Replace strip_prefix at the start of topic with add_prefix. The result
+ * points either into topic itself or at *buf, which is grown as needed and
+ * reused for the next message. */
+static int _bridge_remap(const char *topic, const char *strip_prefix, int strip_len,
+		const char *add_prefix, int add_len, char **buf, int *buf_len, const char **mapped)
+{
+	int len;
+	char *tmp;
+
+	if(strip_prefix && !strncmp(strip_prefix, topic, strip_len)){
+		/* This prefix needs removing. */
+		topic += strip_len;
+	}
+	if(!add_prefix){
+		*mapped = topic;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	/* This prefix needs adding. */
+	len = add_len + strlen(topic) + 1;
+	if(len > *buf_len){
+		tmp = _mosquitto_realloc(*buf, len);
+		if(!tmp) return MOSQ_ERR_NOMEM;
+		*buf = tmp;
+		*buf_len = len;
+	}
+	memcpy(*buf, add_prefix, add_len);
+	memcpy(&(*buf)[add_len], topic, len - add_len);
+	*mapped = *buf;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Map an outgoing topic onto the remote broker's topic namespace. On success
+ * *mapped points either into topic itself or at the context's outgoing remap
+ * buffer, which is only valid until the next call. */
+int mqtt3_bridge_remap_outgoing(struct mosquitto *context, const char *topic, const char **mapped)
+{
+	struct _mqtt3_bridge *bridge;
+	struct _mqtt3_bridge_topic *cur_topic;
+	int rule = -1;
+
+	assert(context);
+	assert(topic);
+	assert(mapped);
+
+	*mapped = topic;
+	bridge = context->bridge;
+	if(!bridge || !bridge->remap_out) return MOSQ_ERR_SUCCESS;
+
+	_remap_node_match(bridge->remap_out, topic, &rule);
+	if(rule == -1) return MOSQ_ERR_SUCCESS;
+
+	cur_topic = &bridge->topics[rule];
+	return _bridge_remap(topic, cur_topic->local_prefix, cur_topic->local_prefix_len,
+			cur_topic->remote_prefix, cur_topic->remote_prefix_len,
+			&bridge->remap_out_buf, &bridge->remap_out_buf_len, mapped);
+}
+
+/* Map an incoming topic from the remote broker's topic namespace onto ours,
+ * as mqtt3_bridge_remap_outgoing() but using the incoming remap buffer. */
+int mqtt3_bridge_remap_incoming(struct mosquitto *context, const char *topic, const char **mapped)
+{
+	struct _mqtt3_bridge *bridge;
+	struct _mqtt3_bridge_topic *cur_topic;
+	int rule = -1;
+
+	assert(context);
+	assert(topic);
+	assert(mapped);
+
+	*mapped = topic;
+	bridge = context->bridge;
+	if(!bridge || !bridge->remap_in) return MOSQ_ERR_SUCCESS;
+
+	_remap_node_match(bridge->remap_in, topic, &rule);
+	if(rule == -1) return MOSQ_ERR_SUCCESS;
+
+	cur_topic = &bridge->topics[rule];
+	return _bridge_remap(topic, cur_topic->remote_prefix, cur_topic->remote_prefix_len,
+			cur_topic->local_prefix, cur_topic->local_prefix_len,
+			&bridge->remap_in_buf, &bridge->remap_in_buf_len, mapped);
+}
+
+/* The partition a topic belongs to when all connections are up. */
+static int _bridge_home(struct _mqtt3_bridge *bridge, const char *topic)
+{
+	uint32_t hash = 2166136261U;
+
+	while(*topic){
+		hash ^= (uint8_t)*topic;
+		hash *= 16777619U;
+		topic++;
+	}
+	return hash % bridge->connection_count;
+}
+
+/* Choose which connection of a multi-connection bridge carries a message
+ * sent to context. Messages are spread by a hash of the topic so that
+ * ordering is kept per topic. If that connection is down, the next
+ * connected one is used instead. The topic stays there until everything
+ * queued away from its own connection has gone, even if that connection
+ * comes back in the meantime, so that newer messages can't overtake the
+ * older ones. */
+struct mosquitto *mqtt3_bridge_partition(struct mosquitto *context, const char *topic)
+{
+	struct _mqtt3_bridge *bridge;
+	struct mosquitto *dest;
+	int start;
+	int i;
+
+	assert(context);
+	assert(topic);
+
+	bridge = context->bridge;
+	if(!bridge || bridge->connection_count <= 1 || !bridge->partitions) return context;
+
+	start = _bridge_home(bridge, topic);
+	i = bridge->partitions[start]->away_count ? 1 : 0;
+	for(; i<bridge->connection_count; i++){
+		dest = bridge->partitions[(start+i) % bridge->connection_count]->context;
+		if(dest && dest->sock != INVALID_SOCKET){
+			return dest;
+		}
+	}
+	/* Nothing else is connected, queue on the connection the topic belongs
+	 * to. */
+	dest = bridge->partitions[start]->context;
+	if(!dest) dest = context;
+	return dest;
+}
+
+/* Keep count of the messages that are queued on a connection other than
+ * the home partition of their topic, see mqtt3_bridge_partition(). */
+void mqtt3_bridge_msg_added(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct _mqtt3_bridge *bridge = context->bridge;
+	int home;
+
+	if(!bridge || bridge->connection_count <= 1 || !bridge->partitions) return;
+	if(msg->direction != mosq_md_out) return;
+
+	home = _bridge_home(bridge, msg->store->msg.topic);
+	if(home != bridge->partition){
+		msg->away = true;
+		bridge->partitions[home]->away_count++;
+	}
+}
+
+void mqtt3_bridge_msg_removed(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct _mqtt3_bridge *bridge = context->bridge;
+	int home;
+
+	if(!msg->away) return;
+
+	home = _bridge_home(bridge, msg->store->msg.topic);
+	bridge->partitions[home]->away_count--;
+	assert(bridge->partitions[home]->away_count >= 0);
+	msg->away = false;
+}
+
 #endif
@@ -70,6 +70,7 @@ extern SERVICE_STATUS_HANDLE service_handle;
 
 static int _conf_parse_bool(char **token, const char *name, bool *value, char *saveptr);
 static int _conf_parse_int(char **token, const char *name, int *value, char *saveptr);
+static int _conf_parse_rate(char **token, const char *name, struct _mqtt3_listener *listener, struct mqtt3_rate_limit *limit, char *saveptr);
 static int _conf_parse_string(char **token, const char *name, char **value, char *saveptr);
 static int _config_read_file(struct mqtt3_config *config, bool reload, const char *file, struct config_recurse *config_tmp, int level, int *lineno);
 
@@ -148,6 +149,10 @@ static void _config_init_reload(struct mqtt3_config *config)
 	}
 #endif
 	config->log_timestamp = true;
+	config->match_cache_size = 1024;
+	config->max_buffered_bytes = 0;
+	config->max_total_buffered_bytes = 0;
+	config->buffered_bytes_timeout = 60;
 	if(config->password_file) _mosquitto_free(config->password_file);
 	config->password_file = NULL;
 	config->persistence = false;
@@ -159,8 +164,15 @@ static void _config_init_reload(struct mqtt3_config *config)
 	if(config->psk_file) _mosquitto_free(config->psk_file);
 	config->psk_file = NULL;
 	config->queue_qos0_messages = false;
+	config->queue_spill_threshold = 0;
+	if(config->queue_spill_location) _mosquitto_free(config->queue_spill_location);
+	config->queue_spill_location = NULL;
+	config->queue_spill_segment_size = 1048576;
+	config->retained_batch_size = 100;
 	config->retry_interval = 20;
-	config->store_clean_interval = 10;
+	config->session_hibernate_after = 0;
+	config->inflight_adaptive_max = 1000;
+	config->shared_subscription_policy = sp_round_robin;
 	config->sys_interval = 10;
 	config->upgrade_outgoing_qos = false;
 	if(config->auth_options){
@@ -184,6 +196,17 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->default_listener.port = 0;
 	config->default_listener.max_connections = -1;
 	config->default_listener.mount_point = NULL;
+	config->default_listener.conflate_messages = false;
+	config->default_listener.inflight_window = -1;
+	config->default_listener.inflight_adaptive = false;
+	memset(&config->default_listener.rate_listener, 0, sizeof(struct mqtt3_rate_limit));
+	memset(&config->default_listener.rate_user, 0, sizeof(struct mqtt3_rate_limit));
+	memset(&config->default_listener.rate_client, 0, sizeof(struct mqtt3_rate_limit));
+	config->default_listener.rate_limited = false;
+	memset(&config->default_listener.bucket, 0, sizeof(struct mosquitto_bucket));
+	config->default_listener.user_buckets = NULL;
+	config->default_listener.client_buckets = NULL;
+	config->default_listener.buckets_released = false;
 	config->default_listener.socks = NULL;
 	config->default_listener.sock_count = 0;
 	config->default_listener.client_count = 0;
@@ -198,6 +221,13 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->default_listener.require_certificate = false;
 	config->default_listener.crlfile = NULL;
 	config->default_listener.use_identity_as_username = false;
+	config->default_listener.tls_session_cache_size = 1024;
+	config->default_listener.tls_session_timeout = 7200;
+	config->default_listener.tls_session_tickets = true;
+	config->default_listener.tls_ticket_key_file = NULL;
+	config->default_listener.tls_ticket_key_rotate = 3600;
+	config->default_listener.ticket_keys = NULL;
+	config->default_listener.ticket_key_count = 0;
 #endif
 	config->listeners = NULL;
 	config->listener_count = 0;
@@ -227,11 +257,13 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 	if(config->persistence_file) _mosquitto_free(config->persistence_file);
 	if(config->persistence_filepath) _mosquitto_free(config->persistence_filepath);
 	if(config->psk_file) _mosquitto_free(config->psk_file);
+	if(config->queue_spill_location) _mosquitto_free(config->queue_spill_location);
 	if(config->listeners){
 		for(i=0; i<config->listener_count; i++){
 			if(config->listeners[i].host) _mosquitto_free(config->listeners[i].host);
 			if(config->listeners[i].mount_point) _mosquitto_free(config->listeners[i].mount_point);
 			if(config->listeners[i].socks) _mosquitto_free(config->listeners[i].socks);
+			mqtt3_rate_cleanup(&config->listeners[i]);
 #ifdef WITH_TLS
 			if(config->listeners[i].cafile) _mosquitto_free(config->listeners[i].cafile);
 			if(config->listeners[i].capath) _mosquitto_free(config->listeners[i].capath);
@@ -239,6 +271,7 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 			if(config->listeners[i].ciphers) _mosquitto_free(config->listeners[i].ciphers);
 			if(config->listeners[i].psk_hint) _mosquitto_free(config->listeners[i].psk_hint);
 			if(config->listeners[i].crlfile) _mosquitto_free(config->listeners[i].crlfile);
+			mqtt3_tls_session_cleanup(&config->listeners[i]);
 #endif
 		}
 		_mosquitto_free(config->listeners);
@@ -267,6 +300,20 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 				_mosquitto_free(config->bridges[i].topics);
 			}
 			if(config->bridges[i].notification_topic) _mosquitto_free(config->bridges[i].notification_topic);
+			mqtt3_bridge_remap_cleanup(&config->bridges[i]);
+			if(config->bridges[i].remap_out_buf) _mosquitto_free(config->bridges[i].remap_out_buf);
+			if(config->bridges[i].remap_in_buf) _mosquitto_free(config->bridges[i].remap_in_buf);
+			if(config->bridges[i].partitions){
+				for(j=1; j<config->bridges[i].connection_count; j++){
+					if(config->bridges[i].partitions[j]){
+						if(config->bridges[i].partitions[j]->remap_out_buf) _mosquitto_free(config->bridges[i].partitions[j]->remap_out_buf);
+						if(config->bridges[i].partitions[j]->remap_in_buf) _mosquitto_free(config->bridges[i].partitions[j]->remap_in_buf);
+						if(config->bridges[i].partitions[j]->notification_topic) _mosquitto_free(config->bridges[i].partitions[j]->notification_topic);
+						_mosquitto_free(config->bridges[i].partitions[j]);
+					}
+				}
+				_mosquitto_free(config->bridges[i].partitions);
+			}
 #ifdef REAL_WITH_TLS_PSK
 			if(config->bridges[i].tls_psk_identity) _mosquitto_free(config->bridges[i].tls_psk_identity);
 			if(config->bridges[i].tls_psk) _mosquitto_free(config->bridges[i].tls_psk);
@@ -375,11 +422,20 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 			|| config->default_listener.require_certificate
 			|| config->default_listener.crlfile
 			|| config->default_listener.use_identity_as_username
+			|| config->default_listener.tls_session_cache_size != 1024
+			|| config->default_listener.tls_session_timeout != 7200
+			|| !config->default_listener.tls_session_tickets
+			|| config->default_listener.tls_ticket_key_file
+			|| config->default_listener.tls_ticket_key_rotate != 3600
 #endif
 			|| config->default_listener.host
       || config->default_listener.port // 什么时候设置的
 			|| config->default_listener.max_connections != -1
-			|| config->default_listener.mount_point){
+			|| config->default_listener.mount_point
+			|| config->default_listener.conflate_messages
+			|| config->default_listener.inflight_window != -1
+			|| config->default_listener.inflight_adaptive
+			|| config->default_listener.rate_limited){
 
       // 初始化broker的socket
 		config->listener_count++;
@@ -407,6 +463,17 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 		}
 
 		config->listeners[config->listener_count-1].max_connections = config->default_listener.max_connections;
+		config->listeners[config->listener_count-1].conflate_messages = config->default_listener.conflate_messages;
+		config->listeners[config->listener_count-1].inflight_window = config->default_listener.inflight_window;
+		config->listeners[config->listener_count-1].inflight_adaptive = config->default_listener.inflight_adaptive;
+		config->listeners[config->listener_count-1].rate_listener = config->default_listener.rate_listener;
+		config->listeners[config->listener_count-1].rate_user = config->default_listener.rate_user;
+		config->listeners[config->listener_count-1].rate_client = config->default_listener.rate_client;
+		config->listeners[config->listener_count-1].rate_limited = config->default_listener.rate_limited;
+		memset(&config->listeners[config->listener_count-1].bucket, 0, sizeof(struct mosquitto_bucket));
+		config->listeners[config->listener_count-1].user_buckets = NULL;
+		config->listeners[config->listener_count-1].client_buckets = NULL;
+		config->listeners[config->listener_count-1].buckets_released = false;
 		config->listeners[config->listener_count-1].client_count = 0;
 		config->listeners[config->listener_count-1].socks = NULL;
 		config->listeners[config->listener_count-1].sock_count = 0;
@@ -423,6 +490,13 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].ssl_ctx = NULL;
 		config->listeners[config->listener_count-1].crlfile = config->default_listener.crlfile;
 		config->listeners[config->listener_count-1].use_identity_as_username = config->default_listener.use_identity_as_username;
+		config->listeners[config->listener_count-1].tls_session_cache_size = config->default_listener.tls_session_cache_size;
+		config->listeners[config->listener_count-1].tls_session_timeout = config->default_listener.tls_session_timeout;
+		config->listeners[config->listener_count-1].tls_session_tickets = config->default_listener.tls_session_tickets;
+		config->listeners[config->listener_count-1].tls_ticket_key_file = config->default_listener.tls_ticket_key_file;
+		config->listeners[config->listener_count-1].tls_ticket_key_rotate = config->default_listener.tls_ticket_key_rotate;
+		config->listeners[config->listener_count-1].ticket_keys = NULL;
+		config->listeners[config->listener_count-1].ticket_key_count = 0;
 #endif
 	}
 
@@ -793,6 +867,21 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge and/or TLS support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_connections")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_int(&token, "bridge_connections", &cur_bridge->connection_count, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->connection_count < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_connections value (%d).", cur_bridge->connection_count);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "bridge_identity")){
 #if defined(WITH_BRIDGE) && defined(REAL_WITH_TLS_PSK)
@@ -867,6 +956,18 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge and/or TLS support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_max_inflight_messages")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_int(&token, "bridge_max_inflight_messages", &cur_bridge->max_inflight_messages, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->max_inflight_messages < 0) cur_bridge->max_inflight_messages = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "bridge_psk")){
 #if defined(WITH_BRIDGE) && defined(REAL_WITH_TLS_PSK)
@@ -922,6 +1023,9 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge and/or TLS support not available.");
 #endif
+				}else if(!strcmp(token, "buffered_bytes_timeout")){
+					if(_conf_parse_int(&token, "buffered_bytes_timeout", &config->buffered_bytes_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->buffered_bytes_timeout < 0) config->buffered_bytes_timeout = 0;
 				}else if(!strcmp(token, "cafile")){
 #if defined(WITH_TLS)
 					if(reload) continue; // Listeners not valid for reloading.
@@ -1002,6 +1106,9 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						}
 					}
 					if(_conf_parse_string(&token, "clientid_prefixes", &config->clientid_prefixes, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "conflate_messages")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "conflate_messages", &cur_listener->conflate_messages, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "connection")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1027,6 +1134,8 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						cur_bridge->restart_timeout = 30;
 						cur_bridge->threshold = 10;
 						cur_bridge->try_private = true;
+						cur_bridge->max_inflight_messages = -1;
+						cur_bridge->connection_count = 1;
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty connection value in configuration.");
 						return MOSQ_ERR_INVAL;
@@ -1124,6 +1233,19 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						closedir(dh);
 #endif
 					}
+				}else if(!strcmp(token, "inflight_adaptive")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "inflight_adaptive", &cur_listener->inflight_adaptive, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "inflight_adaptive_max")){
+					if(_conf_parse_int(&token, "inflight_adaptive_max", &config->inflight_adaptive_max, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->inflight_adaptive_max < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: inflight_adaptive_max must be at least 1.");
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "inflight_window")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "inflight_window", &cur_listener->inflight_window, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->inflight_window < 0) cur_listener->inflight_window = 0;
 				}else if(!strcmp(token, "keepalive_interval")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1167,6 +1289,13 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						cur_listener = &config->listeners[config->listener_count-1];
 						memset(cur_listener, 0, sizeof(struct _mqtt3_listener));
 						cur_listener->port = port_tmp;
+						cur_listener->inflight_window = -1;
+#ifdef WITH_TLS
+						cur_listener->tls_session_cache_size = 1024;
+						cur_listener->tls_session_timeout = 7200;
+						cur_listener->tls_session_tickets = true;
+						cur_listener->tls_ticket_key_rotate = 3600;
+#endif
 						token = strtok_r(NULL, " ", &saveptr);
 						if(token){
 							cur_listener->host = _mosquitto_strdup(token);
@@ -1264,6 +1393,12 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty log_type value in configuration.");
 					}
+				}else if(!strcmp(token, "match_cache_size")){
+					if(_conf_parse_int(&token, "match_cache_size", &config->match_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->match_cache_size < 0) config->match_cache_size = 0;
+				}else if(!strcmp(token, "max_buffered_bytes")){
+					if(_conf_parse_int(&token, "max_buffered_bytes", &config->max_buffered_bytes, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->max_buffered_bytes < 0) config->max_buffered_bytes = 0;
 				}else if(!strcmp(token, "max_connections")){
 					if(reload) continue; // Listeners not valid for reloading.
 					token = strtok_r(NULL, " ", &saveptr);
@@ -1289,6 +1424,9 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_queued_messages value in configuration.");
 					}
+				}else if(!strcmp(token, "max_total_buffered_bytes")){
+					if(_conf_parse_int(&token, "max_total_buffered_bytes", &config->max_total_buffered_bytes, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->max_total_buffered_bytes < 0) config->max_total_buffered_bytes = 0;
 				}else if(!strcmp(token, "message_size_limit")){
 					if(_conf_parse_int(&token, "message_size_limit", &config->message_size_limit, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->message_size_limit < 0 || config->message_size_limit > MQTT_MAX_PAYLOAD){
@@ -1431,6 +1569,26 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #endif
 				}else if(!strcmp(token, "queue_qos0_messages")){
 					if(_conf_parse_bool(&token, token, &config->queue_qos0_messages, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "queue_spill_location")){
+					if(_conf_parse_string(&token, "queue_spill_location", &config->queue_spill_location, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "queue_spill_segment_size")){
+					if(_conf_parse_int(&token, "queue_spill_segment_size", &config->queue_spill_segment_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->queue_spill_segment_size < 4096){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: queue_spill_segment_size must be at least 4096.");
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "queue_spill_threshold")){
+					if(_conf_parse_int(&token, "queue_spill_threshold", &config->queue_spill_threshold, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->queue_spill_threshold < 0) config->queue_spill_threshold = 0;
+				}else if(!strcmp(token, "rate_limit_client")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_rate(&token, "rate_limit_client", cur_listener, &cur_listener->rate_client, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "rate_limit_listener")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_rate(&token, "rate_limit_listener", cur_listener, &cur_listener->rate_listener, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "rate_limit_user")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_rate(&token, "rate_limit_user", cur_listener, &cur_listener->rate_user, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "require_certificate")){
 #ifdef WITH_TLS
 					if(reload) continue; // Listeners not valid for reloading.
@@ -1453,6 +1611,9 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "retained_batch_size")){
+					if(_conf_parse_int(&token, "retained_batch_size", &config->retained_batch_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->retained_batch_size < 0) config->retained_batch_size = 0;
 				}else if(!strcmp(token, "retry_interval")){
 					if(_conf_parse_int(&token, "retry_interval", &config->retry_interval, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->retry_interval < 1 || config->retry_interval > 3600){
@@ -1470,6 +1631,24 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "session_hibernate_after")){
+					if(_conf_parse_int(&token, "session_hibernate_after", &config->session_hibernate_after, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->session_hibernate_after < 0) config->session_hibernate_after = 0;
+				}else if(!strcmp(token, "shared_subscription_policy")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "round_robin")){
+							config->shared_subscription_policy = sp_round_robin;
+						}else if(!strcmp(token, "least_loaded")){
+							config->shared_subscription_policy = sp_least_loaded;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid shared_subscription_policy value in configuration (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty shared_subscription_policy value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "start_type")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1500,11 +1679,7 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "store_clean_interval")){
-					if(_conf_parse_int(&token, "store_clean_interval", &config->store_clean_interval, saveptr)) return MOSQ_ERR_INVAL;
-					if(config->store_clean_interval < 0 || config->store_clean_interval > 65535){
-						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid store_clean_interval value (%d).", config->store_clean_interval);
-						return MOSQ_ERR_INVAL;
-					}
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: store_clean_interval is no longer needed and will be ignored.");
 				}else if(!strcmp(token, "sys_interval")){
 					if(_conf_parse_int(&token, "sys_interval", &config->sys_interval, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->sys_interval < 1 || config->sys_interval > 65535){
@@ -1525,6 +1700,47 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_cache_size")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_cache_size", &cur_listener->tls_session_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_cache_size < 0) cur_listener->tls_session_cache_size = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_tickets")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "tls_session_tickets", &cur_listener->tls_session_tickets, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_timeout")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_timeout", &cur_listener->tls_session_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_timeout < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: tls_session_timeout must be at least 1 second.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ticket_key_file")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_string(&token, "tls_ticket_key_file", &cur_listener->tls_ticket_key_file, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ticket_key_rotate")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_ticket_key_rotate", &cur_listener->tls_ticket_key_rotate, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_ticket_key_rotate < 0) cur_listener->tls_ticket_key_rotate = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
 				}else if(!strcmp(token, "tls_version")){
 #if defined(WITH_TLS)
@@ -1567,6 +1783,8 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						cur_topic->qos = 0;
 						cur_topic->local_prefix = NULL;
 						cur_topic->remote_prefix = NULL;
+						cur_topic->local_prefix_len = 0;
+						cur_topic->remote_prefix_len = 0;
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty topic value in configuration.");
 						return MOSQ_ERR_INVAL;
@@ -1606,6 +1824,7 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 										_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory");
 										return MOSQ_ERR_NOMEM;
 									}
+									cur_topic->local_prefix_len = strlen(cur_topic->local_prefix);
 								}
 
 								token = strtok_r(NULL, " ", &saveptr);
@@ -1622,6 +1841,7 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 											_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory");
 											return MOSQ_ERR_NOMEM;
 										}
+										cur_topic->remote_prefix_len = strlen(cur_topic->remote_prefix);
 									}
 								}
 							}
@@ -1779,6 +1999,31 @@ static int _conf_parse_bool(char **token, const char *name, bool *value, char *s
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* A rate limit is given as messages per second then bytes per second, either
+ * of which may be 0 for no limit. */
+static int _conf_parse_rate(char **token, const char *name, struct _mqtt3_listener *listener, struct mqtt3_rate_limit *limit, char *saveptr)
+{
+	char *bytes;
+
+	*token = strtok_r(NULL, " ", &saveptr);
+	bytes = strtok_r(NULL, " ", &saveptr);
+	if(!*token || !bytes){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s needs a message rate and a byte rate.", name);
+		return MOSQ_ERR_INVAL;
+	}
+	limit->messages = atoi(*token);
+	limit->bytes = atoi(bytes);
+	if(limit->messages < 0 || limit->bytes < 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid %s value in configuration.", name);
+		return MOSQ_ERR_INVAL;
+	}
+	if(limit->messages || limit->bytes){
+		listener->rate_limited = true;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
 static int _conf_parse_int(char **token, const char *name, int *value, char *saveptr)
 {
 	*token = strtok_r(NULL, " ", &saveptr);
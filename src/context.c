@@ -28,6 +28,7 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <assert.h>
+#include <string.h>
 
 #include <config.h>
 
@@ -53,7 +54,6 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->last_msg_out = mosquitto_time();
 	context->keepalive = 60; /* Default to 60s */
 	context->clean_session = true;
-	context->disconnect_t = 0;
 	context->id = NULL;
 	context->last_mid = 0;
 	context->will = NULL;
@@ -84,6 +84,11 @@ struct mosquitto *mqtt3_context_init(int sock)
 	}
 	context->bridge = NULL;
 	context->msgs = NULL;
+	context->out_packet_corked = false;
+	context->read_paused = false;
+	context->out_bytes = 0;
+	context->cold = NULL;
+	mqtt3_db_inflight_init(context);
 #ifdef WITH_TLS
 	context->ssl = NULL;
 #endif
@@ -130,6 +135,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->ssl = NULL;
 	}
 #endif
+	mqtt3_rate_release(context);
 	if(context->sock != -1){
 		if(context->listener){
 			context->listener->client_count--;
@@ -164,12 +170,33 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->id = NULL;
 	}
 	_mosquitto_packet_cleanup(&(context->in_packet));
-	_mosquitto_packet_cleanup(context->current_out_packet);
+	if(context->current_out_packet){
+		_mosquitto_packet_free(context->current_out_packet);
+		context->current_out_packet = NULL;
+	}
+	if(context->cold){
+		while(context->cold->ctrl_packet){
+			packet = context->cold->ctrl_packet;
+			context->cold->ctrl_packet = context->cold->ctrl_packet->next;
+			_mosquitto_packet_free(packet);
+		}
+	}
 	while(context->out_packet){
-		_mosquitto_packet_cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
+	}
+	if(context->out_bytes){
+		mqtt3_out_bytes_update(context, -(int64_t)context->out_bytes);
+	}
+	if(context->cold){
+		context->cold->out_over_t = 0;
+		if(context->cold->over_added){
+			/* No longer a publisher, so no longer part of the share. */
+			_mosquitto_get_db()->over_added -= context->cold->over_added;
+			_mosquitto_get_db()->over_publishers--;
+			context->cold->over_added = 0;
+		}
 	}
 	if(context->will){
 		if(context->will->topic) _mosquitto_free(context->will->topic);
@@ -178,22 +205,44 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->will = NULL;
 	}
 	if(do_free || context->clean_session){
+		mqtt3_db_conflate_clean(context);
 		msg = context->msgs;
 		while(msg){
 			next = msg->next;
-			msg->store->ref_count--;
+#ifdef WITH_BRIDGE
+			mqtt3_bridge_msg_removed(context, msg);
+#endif
+			mqtt3_db_msg_store_deref(_mosquitto_get_db(), msg->store);
 			_mosquitto_free(msg);
 			msg = next;
 		}
 		context->msgs = NULL;
+		if(context->cold){
+			context->cold->last_msg = NULL;
+			context->cold->msg_count = 0;
+			context->cold->msg_count12 = 0;
+			context->cold->msg_queued = 0;
+			context->cold->msg_inflight = 0;
+			context->cold->queued_hint = NULL;
+		}
+		mqtt3_retain_cursors_free(context);
 	}
 	if(do_free){
+		if(context->cold){
+			/* A persistent client's spool outlives the broker, the
+			 * persistent database refers to it. */
+			mqtt3_spool_free(_mosquitto_get_db(), &context->cold->spool, context->clean_session);
+			if(context->cold->topic_buf) _mosquitto_free(context->cold->topic_buf);
+			if(context->cold->subs) _mosquitto_free(context->cold->subs);
+			_mosquitto_free(context->cold);
+		}
 		_mosquitto_free(context);
 	}
 }
 
 void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *ctxt)
 {//断开一个连接，注意不会清楚相关的数据结构，等客户端再次连接上来的时候，这些数据还是能用的。除非clean session了
+	struct mosquitto_cold *cold;
 
 	if(ctxt->state != mosq_cs_disconnecting && ctxt->will){
 		/* Unexpected disconnect, queue the client will. */
@@ -201,13 +250,263 @@ void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *ctxt)
 	}
 
   // listener扮演什么角色？？
+	mqtt3_rate_release(ctxt);
 	if(ctxt->listener){
 		ctxt->listener->client_count--;
 		assert(ctxt->listener->client_count >= 0);
 		ctxt->listener = NULL;
 	}
-	ctxt->disconnect_t = mosquitto_time();
+	if(!ctxt->clean_session){
+		/* Only persistent clients are expired or hibernated. Without it the
+		 * client looks to have been gone for ever and is the first to go. */
+		cold = mqtt3_context_cold(ctxt);
+		if(cold) cold->disconnect_t = mosquitto_time();
+	}
 
 	_mosquitto_socket_close(ctxt);
+#ifdef WITH_BRIDGE
+	if(ctxt->bridge && ctxt->bridge->connection_count > 1){
+		/* Hand this connection's share of the traffic to the others. */
+		mqtt3_db_messages_failover(db, ctxt);
+	}
+#endif
+}
+
+struct mosquitto_cold *mqtt3_context_cold(struct mosquitto *context)
+{
+	if(!context->cold){
+		context->cold = _mosquitto_calloc(1, sizeof(struct mosquitto_cold));
+	}
+	return context->cold;
+}
+
+time_t mqtt3_context_disconnect_t(struct mosquitto *context)
+{
+	return context->cold ? context->cold->disconnect_t : 0;
+}
+
+/* Associate a client with its ACL, assuming we have ACLs loaded. */
+void mqtt3_context_acl_set(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_acl_user *acl_tail;
+
+	context->acl_list = NULL;
+	acl_tail = db->acl_list;
+	while(acl_tail){
+		if(context->username){
+			if(acl_tail->username && !strcmp(context->username, acl_tail->username)){
+				context->acl_list = acl_tail;
+				break;
+			}
+		}else{
+			if(acl_tail->username == NULL){
+				context->acl_list = acl_tail;
+				break;
+			}
+		}
+		acl_tail = acl_tail->next;
+	}
+}
+
+/*
+ * Swap a disconnected persistent client for a struct mosquitto_hibernated.
+ * Only clients with nothing queued in memory can be hibernated, anything
+ * still to be delivered to them must be in their spool. On success the
+ * context has been freed and its db->contexts slot emptied.
+ */
+int mqtt3_context_hibernate(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto_cold *cold;
+	struct mosquitto_hibernated *hibernated;
+	struct _clientid_index_hash *find_cih;
+	struct _mosquitto_subref *ref;
+	size_t len, idlen, userlen;
+	char *ptr;
+	int sub_count;
+	int i;
+
+	assert(context->sock == INVALID_SOCKET);
+	assert(context->id);
+
+	cold = context->cold;
+	if(context->msgs || (cold && cold->retain_cursors) || context->clean_session) return MOSQ_ERR_INVAL;
+
+	HASH_FIND_STR(db->clientid_index_hash, context->id, find_cih);
+	if(!find_cih) return MOSQ_ERR_NOT_FOUND;
+
+	idlen = strlen(context->id) + 1;
+	userlen = context->username ? strlen(context->username) + 1 : 0;
+	sub_count = cold ? cold->sub_count : 0;
+	len = sizeof(struct mosquitto_hibernated) + sizeof(struct _mosquitto_subref)*sub_count + idlen + userlen;
+	hibernated = _mosquitto_malloc(len);
+	if(!hibernated) return MOSQ_ERR_NOMEM;
+
+	ptr = (char *)hibernated + sizeof(struct mosquitto_hibernated);
+	hibernated->subs = (struct _mosquitto_subref *)ptr;
+	hibernated->sub_count = sub_count;
+	if(sub_count){
+		memcpy(hibernated->subs, cold->subs, sizeof(struct _mosquitto_subref)*sub_count);
+	}
+	ptr += sizeof(struct _mosquitto_subref)*sub_count;
+	hibernated->id = ptr;
+	memcpy(hibernated->id, context->id, idlen);
+	ptr += idlen;
+	if(userlen){
+		hibernated->username = ptr;
+		memcpy(hibernated->username, context->username, userlen);
+	}else{
+		hibernated->username = NULL;
+	}
+	hibernated->last_mid = context->last_mid;
+	hibernated->disconnect_t = cold ? cold->disconnect_t : 0;
+	hibernated->spool = NULL;
+	if(cold){
+		hibernated->spool = cold->spool;
+		cold->spool = NULL;
+		mqtt3_spool_release(hibernated->spool);
+	}
 
+	for(i=0; i<hibernated->sub_count; i++){
+		ref = &hibernated->subs[i];
+		ref->hier->subs[ref->leaf].hibernated = hibernated;
+		ref->hier->subs[ref->leaf].flags |= MOSQ_SUBLEAF_HIBERNATED;
+	}
+	if(cold) cold->sub_count = 0;
+
+	/* The hash is keyed on the id, which is about to be freed. */
+	HASH_DEL(db->clientid_index_hash, find_cih);
+	find_cih->db_context_index = -1;
+	find_cih->hibernated = hibernated;
+	HASH_ADD_KEYPTR(hh, db->clientid_index_hash, hibernated->id, strlen(hibernated->id), find_cih);
+
+	_mosquitto_free(context->id);
+	context->id = NULL;
+	db->contexts[context->db_index] = NULL;
+	mqtt3_context_cleanup(db, context, true);
+	db->hibernated_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Unpack a hibernated client into a full, still disconnected, context and
+ * free hibernated. */
+struct mosquitto *mqtt3_context_wake(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated)
+{
+	struct mosquitto *context;
+	struct mosquitto_cold *cold;
+	struct mosquitto **tmp_contexts;
+	struct _clientid_index_hash *find_cih;
+	struct _mosquitto_subref *ref;
+	int i;
+
+	HASH_FIND_STR(db->clientid_index_hash, hibernated->id, find_cih);
+	assert(find_cih && find_cih->hibernated == hibernated);
+
+	context = mqtt3_context_init(-1);
+	if(!context) return NULL;
+	context->clean_session = false;
+	cold = mqtt3_context_cold(context);
+	if(!cold){
+		mqtt3_context_cleanup(db, context, true);
+		return NULL;
+	}
+	context->id = _mosquitto_strdup(hibernated->id);
+	if(!context->id){
+		mqtt3_context_cleanup(db, context, true);
+		return NULL;
+	}
+	if(hibernated->username){
+		context->username = _mosquitto_strdup(hibernated->username);
+		if(!context->username){
+			_mosquitto_free(context->id);
+			context->id = NULL;
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
+		}
+	}
+	if(hibernated->sub_count){
+		cold->subs = _mosquitto_malloc(sizeof(struct _mosquitto_subref)*hibernated->sub_count);
+		if(!cold->subs){
+			_mosquitto_free(context->id);
+			context->id = NULL;
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
+		}
+		memcpy(cold->subs, hibernated->subs, sizeof(struct _mosquitto_subref)*hibernated->sub_count);
+		cold->sub_max = hibernated->sub_count;
+	}
+
+	for(i=0; i<db->context_count; i++){
+		if(!db->contexts[i]) break;
+	}
+	if(i == db->context_count){
+		tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+1));
+		if(!tmp_contexts){
+			_mosquitto_free(context->id);
+			context->id = NULL;
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
+		}
+		db->contexts = tmp_contexts;
+		db->context_count++;
+	}
+	db->contexts[i] = context;
+	context->db_index = i;
+
+	context->last_mid = hibernated->last_mid;
+	cold->disconnect_t = hibernated->disconnect_t;
+	cold->spool = hibernated->spool;
+	cold->sub_count = hibernated->sub_count;
+	for(i=0; i<cold->sub_count; i++){
+		ref = &cold->subs[i];
+		ref->hier->subs[ref->leaf].context = context;
+		ref->hier->subs[ref->leaf].flags &= ~MOSQ_SUBLEAF_HIBERNATED;
+	}
+	mqtt3_context_acl_set(db, context);
+
+	HASH_DEL(db->clientid_index_hash, find_cih);
+	find_cih->db_context_index = context->db_index;
+	find_cih->hibernated = NULL;
+	HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), find_cih);
+
+	_mosquitto_free(hibernated);
+	db->hibernated_count--;
+
+	return context;
+}
+
+/* Drop a hibernated client for good, as for an expired session. */
+void mqtt3_context_hibernated_expire(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated)
+{
+	struct _clientid_index_hash *find_cih;
+
+	mqtt3_subs_clean_hibernated(db, hibernated);
+	mqtt3_spool_free(db, &hibernated->spool, true);
+
+	HASH_FIND_STR(db->clientid_index_hash, hibernated->id, find_cih);
+	if(find_cih){
+		HASH_DEL(db->clientid_index_hash, find_cih);
+		_mosquitto_free(find_cih);
+	}
+	_mosquitto_free(hibernated);
+	db->hibernated_count--;
+}
+
+/* Free all hibernated clients at shutdown. Their spools are left on disk
+ * for the persistent database. */
+void mqtt3_context_hibernated_clean(struct mosquitto_db *db)
+{
+	struct _clientid_index_hash *cih, *tmp;
+	struct mosquitto_hibernated *hibernated;
+
+	HASH_ITER(hh, db->clientid_index_hash, cih, tmp){
+		hibernated = cih->hibernated;
+		if(!hibernated) continue;
+		mqtt3_subs_clean_hibernated(db, hibernated);
+		mqtt3_spool_free(db, &hibernated->spool, false);
+		HASH_DEL(db->clientid_index_hash, cih);
+		_mosquitto_free(cih);
+		_mosquitto_free(hibernated);
+		db->hibernated_count--;
+	}
 }
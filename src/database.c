@@ -36,18 +36,341 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <memory_mosq.h>
 #include <send_mosq.h>
 #include <time_mosq.h>
+#include <util_mosq.h>
 
 static int max_inflight = 20;
 static int max_queued = 100;
 #ifdef WITH_SYS_TREE
 extern unsigned long g_msgs_dropped;
+extern uint64_t g_pub_bytes_sent;
 #endif
 
+/* The in-flight window a context is configured with, its bridge's or
+ * listener's own or else max_inflight_messages. */
+static int _inflight_configured(struct mosquitto *context)
+{
+	int window = max_inflight;
+
+#ifdef WITH_BRIDGE
+	if(context->bridge && context->bridge->max_inflight_messages >= 0){
+		window = context->bridge->max_inflight_messages;
+	}
+#endif
+	if(context->listener && context->listener->inflight_window >= 0){
+		window = context->listener->inflight_window;
+	}
+	return window;
+}
+
+/* Return the in-flight window to use for a context, see
+ * mqtt3_db_inflight_init(). */
+static int _db_max_inflight(struct mosquitto *context)
+{
+	if(context->cold && context->cold->inflight_adaptive){
+		return context->cold->inflight_window;
+	}
+	return _inflight_configured(context);
+}
+
+/* Set up the in-flight window for a context once its listener or bridge is
+ * known. Bridges and listeners can have their own window so that a high
+ * latency link isn't limited to max_inflight_messages per round trip. With
+ * inflight_adaptive the window then grows by one for each window's worth of
+ * acks and is halved when a message has to be retried or the round trip
+ * time jumps, between 1 and inflight_adaptive_max. */
+void mqtt3_db_inflight_init(struct mosquitto *context)
+{
+	struct mosquitto_cold *cold;
+	int window;
+	int limit;
+
+	if(!context->listener || !context->listener->inflight_adaptive){
+		if(context->cold) context->cold->inflight_adaptive = false;
+		return;
+	}
+	cold = mqtt3_context_cold(context);
+	if(!cold) return; /* The configured window it is, then. */
+
+	window = _inflight_configured(context);
+	limit = _mosquitto_get_db()->config->inflight_adaptive_max;
+	if(window <= 0 || window > limit) window = limit;
+	cold->inflight_adaptive = true;
+	cold->inflight_window = window;
+	cold->rtt_start = 0;
+	cold->srtt = 0;
+	cold->inflight_credit = 0;
+}
+
+/* Halve an adaptive window. */
+static void _inflight_cut(struct mosquitto *context)
+{
+	struct mosquitto_cold *cold = context->cold;
+
+	cold->inflight_window /= 2;
+	if(cold->inflight_window < 1) cold->inflight_window = 1;
+	cold->inflight_credit = 0;
+	cold->rtt_start = 0; /* A retried message can't be timed. */
+}
+
+/* Time the round trip of one message at a time. */
+static void _inflight_sent(struct mosquitto *context, uint16_t mid)
+{
+	struct mosquitto_cold *cold = context->cold;
+
+	if(cold->rtt_start) return;
+	cold->rtt_mid = mid;
+	cold->rtt_start = mosquitto_time_ms();
+}
+
+/* The first acknowledgement for an outgoing message, a PUBACK or PUBREC. */
+static void _inflight_acked(struct mosquitto *context, uint16_t mid)
+{
+	struct mosquitto_cold *cold = context->cold;
+	int rtt;
+
+	if(!cold || !cold->rtt_start || cold->rtt_mid != mid) return;
+
+	rtt = (int)(mosquitto_time_ms() - cold->rtt_start);
+	cold->rtt_start = 0;
+	if(cold->srtt && rtt > 2*cold->srtt + 10){
+		/* Messages are queueing up somewhere on the way, back off. */
+		cold->srtt = (7*cold->srtt + rtt)/8;
+		_inflight_cut(context);
+		return;
+	}
+	cold->srtt = cold->srtt ? (7*cold->srtt + rtt)/8 : rtt;
+}
+
+/* A message has left the window. */
+static void _inflight_done(struct mosquitto *context)
+{
+	struct mosquitto_cold *cold = context->cold;
+	int limit;
+
+	cold->inflight_credit++;
+	if(cold->inflight_credit >= cold->inflight_window){
+		cold->inflight_credit = 0;
+		limit = _mosquitto_get_db()->config->inflight_adaptive_max;
+		if(cold->inflight_window < limit) cold->inflight_window++;
+	}
+}
+
+static void _message_store_frames_free(struct mosquitto_msg_store *store)
+{
+	struct mosquitto_msg_frame *cached, *next;
+
+	cached = store->frames;
+	while(cached){
+		next = cached->next;
+		_mosquitto_frame_release(cached->frame);
+		_mosquitto_free(cached);
+		cached = next;
+	}
+	store->frames = NULL;
+}
+
+/* Drop the conflation index entry that points at msg, if there is one. */
+static void _conflate_unindex(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct _mosquitto_conflate *entry;
+
+	if(!msg->indexed) return;
+	HASH_FIND_STR(context->cold->conflate_index, msg->store->msg.topic, entry);
+	if(entry && entry->msg == msg){
+		HASH_DELETE(hh, context->cold->conflate_index, entry);
+		_mosquitto_free(entry);
+	}
+	msg->indexed = false;
+}
+
+/* Point the conflation index entry for the message topic at msg. */
+static int _conflate_index(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct _mosquitto_conflate *entry;
+	const char *topic = msg->store->msg.topic;
+
+	HASH_FIND_STR(context->cold->conflate_index, topic, entry);
+	if(entry){
+		/* The key belongs to the old message store, so re-add the entry
+		 * rather than just changing where it points. */
+		HASH_DELETE(hh, context->cold->conflate_index, entry);
+		entry->msg->indexed = false;
+	}else{
+		entry = _mosquitto_malloc(sizeof(struct _mosquitto_conflate));
+		if(!entry) return MOSQ_ERR_NOMEM;
+	}
+	entry->msg = msg;
+	msg->indexed = true;
+	HASH_ADD_KEYPTR(hh, context->cold->conflate_index, topic, strlen(topic), entry);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Find a message for topic in the context queue that has not been sent yet
+ * and so can be replaced by a newer one. */
+static struct mosquitto_client_msg *_conflate_find(struct mosquitto *context, const char *topic, int qos)
+{
+	struct _mosquitto_conflate *entry;
+	struct mosquitto_client_msg *msg;
+
+	HASH_FIND_STR(context->cold->conflate_index, topic, entry);
+	if(!entry) return NULL;
+
+	msg = entry->msg;
+	if(msg->direction != mosq_md_out || msg->dup || msg->qos != qos) return NULL;
+	switch(msg->state){
+		case mosq_ms_queued:
+		case mosq_ms_publish_qos0:
+		case mosq_ms_publish_qos1:
+		case mosq_ms_publish_qos2:
+			return msg;
+		default:
+			return NULL;
+	}
+}
+
+void mqtt3_db_conflate_clean(struct mosquitto *context)
+{
+	struct _mosquitto_conflate *entry, *tmp;
+
+	if(!context->cold) return;
+	HASH_ITER(hh, context->cold->conflate_index, entry, tmp){
+		HASH_DELETE(hh, context->cold->conflate_index, entry);
+		entry->msg->indexed = false;
+		_mosquitto_free(entry);
+	}
+}
+
+/* Outgoing QoS 1 and 2 messages count against the in-flight window once they
+ * have left the queue. QoS 0 messages are gone as soon as they are written and
+ * incoming ones are limited separately. */
+static bool _message_inflight(struct mosquitto_client_msg *msg)
+{
+	return msg->direction == mosq_md_out && msg->qos > 0 && msg->state != mosq_ms_queued;
+}
+
+/* Unlink *msg from the context message list, where last is the entry before
+ * it, and leave *msg pointing at the next entry. */
+static void _message_remove(struct mosquitto *context, struct mosquitto_client_msg **msg, struct mosquitto_client_msg *last)
+{
+	if(!context || !msg || !(*msg)) return;
+
+	_conflate_unindex(context, *msg);
+#ifdef WITH_BRIDGE
+	mqtt3_bridge_msg_removed(context, *msg);
+#endif
+	mqtt3_db_msg_store_deref(_mosquitto_get_db(), (*msg)->store);
+	if((*msg)->state == mosq_ms_queued){
+		context->cold->msg_queued--;
+	}else if(_message_inflight(*msg)){
+		context->cold->msg_inflight--;
+	}
+	if(context->cold && context->cold->queued_hint == *msg){
+		context->cold->queued_hint = (*msg)->next;
+	}
+	if(last){
+		last->next = (*msg)->next;
+		if(!last->next){
+			context->cold->last_msg = last;
+		}
+	}else{
+		context->msgs = (*msg)->next;
+		if(!context->msgs){
+			context->cold->last_msg = NULL;
+		}
+	}
+	context->cold->msg_count--;
+	if((*msg)->qos > 0){
+		context->cold->msg_count12--;
+	}
+	_mosquitto_free(*msg);
+	if(last){
+		*msg = last->next;
+	}else{
+		*msg = context->msgs;
+	}
+}
+
+/* Send an outgoing QoS 0 message. The PUBLISH is serialised once per mount
+ * point and retain flag and the frame is then shared by every client it is
+ * sent to. */
+static int _message_publish_qos0(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct mosquitto_msg_store *store = msg->store;
+	struct mosquitto_msg_frame *cached;
+	const char *mount_point = NULL;
+	size_t len;
+	int rc;
+
+	if(context->bridge){
+		/* Bridges may remap the topic per connection. */
+		return _mosquitto_send_publish(context, 0, store->msg.topic, store->msg.payloadlen, store->msg.payload, 0, msg->retain, msg->dup);
+	}
+	if(context->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	if(context->listener){
+		mount_point = context->listener->mount_point;
+	}
+	for(cached = store->frames; cached; cached = cached->next){
+		if(cached->mount_point == mount_point && cached->retain == msg->retain) break;
+	}
+	if(!cached){
+		cached = _mosquitto_calloc(1, sizeof(struct mosquitto_msg_frame));
+		if(!cached) return MOSQ_ERR_NOMEM;
+		cached->mount_point = mount_point;
+		cached->retain = msg->retain;
+		cached->topic = store->msg.topic;
+		if(mount_point){
+			len = strlen(mount_point);
+			if(len < strlen(store->msg.topic)){
+				cached->topic += len;
+			}else{
+				/* Invalid topic string. Should never happen, but silently swallow the message anyway. */
+				_mosquitto_free(cached);
+				return MOSQ_ERR_SUCCESS;
+			}
+		}
+		rc = _mosquitto_frame_publish(cached->topic, store->msg.payloadlen, store->msg.payload, msg->retain, &cached->frame);
+		if(rc){
+			_mosquitto_free(cached);
+			return rc;
+		}
+		cached->next = store->frames;
+		store->frames = cached;
+	}
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d0, q0, r%d, m0, '%s', ... (%ld bytes))", context->id, msg->retain, cached->topic, (long)store->msg.payloadlen);
+#ifdef WITH_SYS_TREE
+	g_pub_bytes_sent += store->msg.payloadlen;
+#endif
+	return _mosquitto_send_frame(context, cached->frame);
+}
+
+/* Send an outgoing QoS 1 or 2 message and move it on to waiting for the
+ * acknowledgement. */
+static int _message_publish(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	int rc;
+
+	rc = _mosquitto_send_publish(context, msg->mid, msg->store->msg.topic, msg->store->msg.payloadlen, msg->store->msg.payload, msg->qos, msg->retain, msg->dup);
+	if(rc) return rc;
+
+	if(context->cold->inflight_adaptive && !msg->dup){
+		_inflight_sent(context, msg->mid);
+	}
+	msg->timestamp = mosquitto_time();
+	msg->dup = 1; /* Any retry attempts are a duplicate. */
+	if(msg->qos == 1){
+		msg->state = mosq_ms_wait_for_puback;
+	}else{
+		msg->state = mosq_ms_wait_for_pubrec;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
 
 int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 {
 	int rc = 0;
-	struct _mosquitto_subhier *child;
 
 	if(!config || !db) return MOSQ_ERR_INVAL;
 
@@ -61,45 +384,20 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 	// Initialize the hashtable
 	db->clientid_index_hash = NULL;
 
-	db->subs.next = NULL;
-	db->subs.subs = NULL;
-	db->subs.topic = "";
+	db->retains.parent = NULL;
+	db->retains.children = NULL;
+	db->retains.topic = "";
+	db->retains.retained = NULL;
+	db->retains.pins = 0;
 
-  //新建第一个数据订阅节点
-	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
-	if(!child){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	child->next = NULL;
-	child->topic = _mosquitto_strdup(""); //默认的节点，正常订阅用
-	if(!child->topic){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	child->subs = NULL;
-	child->children = NULL;
-	child->retained = NULL;
-	db->subs.children = child;
-
-  // 创建$SYS系统状态订阅节点
-	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
-	if(!child){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	child->next = NULL;
-	child->topic = _mosquitto_strdup("$SYS");
-	if(!child->topic){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	child->subs = NULL;
-	child->children = NULL;
-	child->retained = NULL;
-	db->subs.children->next = child;
+  //新建订阅树，包括正常订阅用的""节点和$SYS系统状态订阅节点
+	rc = mqtt3_sub_tree_init(db);
+	if(rc) return rc;
 
 	db->unpwd = NULL;
+	db->spool_next_id = 0;
+	db->spool_count = 0;
+	db->hibernated_count = 0;
 
   // 如果之前存储过信息，就把它们都拿出来
 #ifdef WITH_PERSISTENCE
@@ -108,36 +406,17 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
   }
 #endif
 
-	return rc;
-}
-
-static void subhier_clean(struct _mosquitto_subhier *subhier)
-{
-	struct _mosquitto_subhier *next;
-	struct _mosquitto_subleaf *leaf, *nextleaf;
+	/* After the restore, so it knows which spool segments are still wanted. */
+	rc = mqtt3_spool_init(db);
 
-	while(subhier){
-		next = subhier->next;
-		leaf = subhier->subs;
-		while(leaf){
-			nextleaf = leaf->next;
-			_mosquitto_free(leaf);
-			leaf = nextleaf;
-		}
-		if(subhier->retained){
-			subhier->retained->ref_count--;
-		}
-		subhier_clean(subhier->children);
-		if(subhier->topic) _mosquitto_free(subhier->topic);
-
-		_mosquitto_free(subhier);
-		subhier = next;
-	}
+	return rc;
 }
 
 int mqtt3_db_close(struct mosquitto_db *db)
 {
-	subhier_clean(db->subs.children);
+	mqtt3_context_hibernated_clean(db);
+	mqtt3_sub_tree_clean(db);
+	mqtt3_retain_clean(db);
 	mqtt3_db_store_clean(db);
 
 	return MOSQ_ERR_SUCCESS;
@@ -164,86 +443,196 @@ int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned
 			}
 		}
 	}
+	*count += db->hibernated_count;
+	*inactive_count += db->hibernated_count;
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Move queued messages into the in-flight window while it has room, oldest
+ * first. With send, outgoing messages are published and PUBRECs sent straight
+ * away, otherwise that is left to mqtt3_db_message_write(). Starts from the
+ * queued_hint left by the last call rather than walking past everything
+ * already in flight. */
+static int _messages_promote(struct mosquitto *context, bool send)
+{
+	struct mosquitto_client_msg *msg;
+	struct mosquitto_cold *cold = context->cold;
+	int window;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if(!cold || !cold->msg_queued || context->sock == INVALID_SOCKET) return MOSQ_ERR_SUCCESS;
+
+	window = _db_max_inflight(context);
+	if(cold->queued_hint){
+		msg = cold->queued_hint;
+	}else{
+		msg = context->msgs;
+	}
+	while(msg && rc == MOSQ_ERR_SUCCESS){
+		if(msg->state != mosq_ms_queued){
+			msg = msg->next;
+			continue;
+		}
+		if(window > 0){
+			if(msg->direction == mosq_md_out){
+				if(msg->qos > 0 && cold->msg_inflight >= window) break;
+			}else if(cold->msg_count - cold->msg_queued >= window){
+				break;
+			}
+		}
+		cold->msg_queued--;
+		msg->timestamp = mosquitto_time();
+		if(msg->direction == mosq_md_out){
+			switch(msg->qos){
+				case 0:
+					msg->state = mosq_ms_publish_qos0;
+					break;
+				case 1:
+					msg->state = mosq_ms_publish_qos1;
+					break;
+				case 2:
+					msg->state = mosq_ms_publish_qos2;
+					break;
+			}
+			if(msg->qos > 0) cold->msg_inflight++;
+			if(send && msg->qos > 0){
+				rc = _message_publish(context, msg);
+			}
+		}else{
+			/* Only QoS 2 messages are ever queued on the way in. */
+			msg->state = mosq_ms_send_pubrec;
+			if(send){
+				rc = _mosquitto_send_pubrec(context, msg->mid);
+				if(!rc) msg->state = mosq_ms_wait_for_pubrel;
+			}
+		}
+		msg = msg->next;
+	}
+
+	if(cold->msg_queued){
+		cold->queued_hint = msg;
+	}else{
+		cold->queued_hint = NULL;
+	}
+	return rc;
+}
+
 // 删除某个客户端下的某条消息
-// 同时对客户端里面的每条信息状态进行修改
+// 同时把排队的消息补进in-flight窗口
 int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
 {
 	struct mosquitto_client_msg *tail, *last = NULL;
-	int msg_index = 0;
-	bool deleted = false;
+	int queued;
+	bool promoted;
+	bool corked;
+	int rc;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
 	tail = context->msgs;
 	while(tail){
-		msg_index++;
-		if(tail->state == mosq_ms_queued && msg_index <= max_inflight){
-			tail->timestamp = mosquitto_time();
-			if(tail->direction == mosq_md_out){
-				switch(tail->qos){
-					case 0:
-						tail->state = mosq_ms_publish_qos0;
-						break;
-					case 1:
-						tail->state = mosq_ms_publish_qos1;
-						break;
-					case 2:
-						tail->state = mosq_ms_publish_qos2;
-						break;
-				}
-			}else{
-				if(tail->qos == 2){
-          // 这里的基本假设是服务器（即我自己）已经发了一个PUBREC包给客户端了，
-          // 等待客户端的PUBREL包回来。合理吗？
-					tail->state = mosq_ms_wait_for_pubrel;
-				}
-			}
-		}
+		if(tail->mid == mid && tail->direction == dir) break;
+		last = tail;
+		tail = tail->next;
+	}
+	if(!tail) return MOSQ_ERR_SUCCESS;
 
-		if(tail->mid == mid && tail->direction == dir){
-			msg_index--;
-			/* FIXME - it would be nice to be able to remove the stored message here if ref_count==0 */
-			tail->store->ref_count--;
-			if(last){
-				last->next = tail->next;
-			}else{
-				context->msgs = tail->next;
-			}
-			_mosquitto_free(tail);
-			if(last){
-				tail = last->next;
-			}else{
-				tail = context->msgs;
-			}
-			deleted = true;
-		}else{
-			last = tail;
-			tail = tail->next;
-		}
-		if(msg_index > max_inflight && deleted){
-			return MOSQ_ERR_SUCCESS;
+	if(dir == mosq_md_out && context->cold->inflight_adaptive && tail->state != mosq_ms_queued){
+		if(tail->state == mosq_ms_wait_for_puback){
+			_inflight_acked(context, mid);
 		}
+		_inflight_done(context);
+	}
+	_message_remove(context, &tail, last);
+
+	/* Refill the window straight away rather than waiting for the next
+	 * pass of the main loop. */
+	queued = context->cold->msg_queued;
+	corked = context->out_packet_corked;
+	context->out_packet_corked = true;
+	rc = _messages_promote(context, true);
+	context->out_packet_corked = corked;
+	if(rc) return rc;
+	/* Before the refill, which may queue as many again. */
+	promoted = queued != context->cold->msg_queued;
+
+	if(context->cold->spool && context->sock != INVALID_SOCKET){
+		rc = mqtt3_db_spool_refill(_mosquitto_get_db(), context);
+		if(rc) return rc;
+	}
+	if(promoted && !corked){
+		return _mosquitto_packet_write(context);
 	}
-
 	return MOSQ_ERR_SUCCESS;
 }
 
 // 把消息插入到传入的客户端的msg链表里面
-int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored)
+/* Record which client ids this message has been sent to so we can avoid duplicates.
+ * Outgoing messages only.
+ * If retain==true then this is a stale retained message and so should be
+ * sent regardless. FIXME - this does mean retained messages will received
+ * multiple times for overlapping subscriptions, although this is only the
+ * case for SUBSCRIPTION with multiple subs in so is a minor concern.
+ */
+static bool _message_dest_id_find(struct mosquitto_msg_store *stored, const char *id)
 {
+	int i;
 
-	struct mosquitto_client_msg *msg, *tail = NULL;
+	for(i=0; i<stored->dest_id_count; i++){
+		if(!strcmp(stored->dest_ids[i], id)) return true;
+	}
+	return false;
+}
+
+static int _message_dest_id_add(struct mosquitto_msg_store *stored, const char *id)
+{
+	char **dest_ids;
+
+	dest_ids = _mosquitto_realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1));
+	if(!dest_ids) return MOSQ_ERR_NOMEM;
+
+	stored->dest_ids = dest_ids;
+	stored->dest_id_count++;
+	stored->dest_ids[stored->dest_id_count-1] = _mosquitto_strdup(id);
+	if(!stored->dest_ids[stored->dest_id_count-1]){
+		return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Whether an outgoing message for context should go to its spool on disk
+ * rather than being held in memory. Once anything has been spilled,
+ * everything after it follows so that the order is kept. */
+static bool _message_spill(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(db->config->queue_spill_threshold <= 0 || !db->config->queue_spill_location){
+		return false;
+	}
+	if(context->cold->spool && context->cold->spool->count){
+		return true;
+	}
+	if(context->clean_session || context->bridge || context->sock != INVALID_SOCKET){
+		return false;
+	}
+	return context->cold->msg_count >= db->config->queue_spill_threshold;
+}
+
+/* Returns 2 both when the message was dropped and when it is waiting in the
+ * queue or the spool rather than in flight. placed, if not NULL, tells the
+ * two apart: it is set if the client has the message, or already had it. */
+static int _message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, bool spill, bool *placed)
+{
+
+	struct mosquitto_client_msg *msg;
+	struct mosquitto_cold *cold;
 	enum mosquitto_msg_state state = mosq_ms_invalid;
-	int msg_count = 0;
+	int msg_count12;
+	int inflight;
 	int rc = 0;
-	int i;
-	char **dest_ids;
 
 	assert(stored);
+	if(placed) *placed = false;
 	if(!context) return MOSQ_ERR_INVAL;
 
 	/* Check whether we've already sent this message to this client
@@ -255,16 +644,16 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	 * case for SUBSCRIPTION with multiple subs in so is a minor concern.
 	 */
 	if(db->config->allow_duplicate_messages == false
-     && dir == mosq_md_out && retain == false && stored->dest_ids){
-
-		for(i=0; i<stored->dest_id_count; i++){
-			if(!strcmp(stored->dest_ids[i], context->id)){
-				/* We have already sent this message to this client. */
-				return MOSQ_ERR_SUCCESS;
-			}
-		}
+     && dir == mosq_md_out && retain == false && _message_dest_id_find(stored, context->id)){
+		/* We have already sent this message to this client. */
+		if(placed) *placed = true;
+		return MOSQ_ERR_SUCCESS;
 	}
 
+	/* Everything that keeps track of the queue lives here. */
+	cold = mqtt3_context_cold(context);
+	if(!cold) return MOSQ_ERR_NOMEM;
+
 	if(context->sock == INVALID_SOCKET){ //客户端不在线
 		/* Client is not connected only queue messages with QoS>0. */
 		if(qos == 0 && !db->config->queue_qos0_messages){
@@ -278,25 +667,76 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 		}
 	}
 
-  // 统计客户端积累的信息数
-  if(context->msgs){
-		tail = context->msgs;
-		msg_count = 1;
-		while(tail && tail->next){
-			if(tail->qos > 0){
-				msg_count++;
+	if(cold->conflate && dir == mosq_md_out){
+		msg = _conflate_find(context, stored->msg.topic, qos);
+		if(msg){
+			/* Last value per topic: the new message takes the place of the
+			 * one still waiting to be sent, so the queue doesn't grow. */
+			_conflate_unindex(context, msg);
+			mqtt3_db_msg_store_deref(db, msg->store);
+			msg->store = stored;
+			msg->store->ref_count++;
+			msg->retain = retain;
+			msg->timestamp = mosquitto_time();
+			if(placed) *placed = true;
+			if(_conflate_index(context, msg)) return MOSQ_ERR_NOMEM;
+#ifdef WITH_PERSISTENCE
+			if(msg->state == mosq_ms_queued){
+				db->persistence_changes++;
 			}
-			tail = tail->next;
+#endif
+			if(db->config->allow_duplicate_messages == false && retain == false){
+				if(_message_dest_id_add(stored, context->id)) return MOSQ_ERR_NOMEM;
+			}
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+
+	if(spill && dir == mosq_md_out && _message_spill(db, context)){
+		/* Spilled messages don't count against max_queued_messages, the
+		 * backlog is only bounded by the disk. */
+		if(!mqtt3_spool_append(db, &cold->spool, qos, retain, stored->msg.topic, stored->msg.payloadlen, stored->msg.payload)){
+			if(placed) *placed = true;
+#ifdef WITH_PERSISTENCE
+			db->persistence_changes++;
+#endif
+			if(db->config->allow_duplicate_messages == false && retain == false){
+				if(_message_dest_id_add(stored, context->id)) return MOSQ_ERR_NOMEM;
+			}
+			return context->sock == INVALID_SOCKET ? MOSQ_ERR_SUCCESS : 2;
+		}else if(cold->spool && cold->spool->count){
+			/* Can't go in memory ahead of what is already on disk. */
+#ifdef WITH_SYS_TREE
+			g_msgs_dropped++;
+#endif
+			return 2;
 		}
+		/* Nothing spilled yet, carry on with the in-memory queue. */
 	}
 
+  // 统计客户端积累的信息数
+	msg_count12 = cold->msg_count12;
+	inflight = _db_max_inflight(context);
+
   // 对客户端在线的处理
 	if(context->sock != INVALID_SOCKET){
 
     printf ("a message is being processed\n");
 
+		if(dir == mosq_md_out && qos == 0 && db->config->max_buffered_bytes > 0
+				&& (cold->out_deferred || context->out_bytes >= (uint64_t)db->config->max_buffered_bytes)){
+			/* The client isn't keeping up, QoS 0 messages are dropped rather
+			 * than queued behind what is already waiting. */
+#ifdef WITH_SYS_TREE
+			g_msgs_dropped++;
+#endif
+			return 2;
+		}
+
     //连接有效，那么如果总排队消息等没超过限制的话，那么根据qos级别，输入还是输出，设置其对应的state状态
-		if(qos == 0 || max_inflight == 0 || msg_count < max_inflight){
+		if(qos == 0 || inflight == 0
+				|| (cold->msg_queued == 0
+					&& (dir == mosq_md_out ? cold->msg_inflight : cold->msg_count) < inflight)){
 			if(dir == mosq_md_out){
 				switch(qos){
 					case 0:
@@ -320,7 +760,7 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 				}
 
 			}
-		}else if(max_queued == 0 || msg_count-max_inflight < max_queued){
+		}else if(max_queued == 0 || cold->msg_queued < max_queued){
       // qos为1或2，继续排队？
 			state = mosq_ms_queued;
 			rc = 2;
@@ -337,7 +777,7 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 
     // 客户端不在线
     // FIXME 这里会丢信息
-		if(max_queued > 0 && msg_count >= max_queued){ //当前消息数已经大于最大排队消息数，直接drop掉
+		if(max_queued > 0 && msg_count12 >= max_queued){ //当前消息数已经大于最大排队消息数，直接drop掉
 #ifdef WITH_SYS_TREE
 			g_msgs_dropped++;
 #endif
@@ -349,11 +789,12 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	}
 	assert(state != mosq_ms_invalid);
 
-#ifdef WITH_PERSISTENCE
 	if(state == mosq_ms_queued){
+		cold->msg_queued++;
+#ifdef WITH_PERSISTENCE
 		db->persistence_changes++;
-	}
 #endif
+	}
 
   // for debug
   printf("now create a msg struct");
@@ -369,44 +810,54 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	msg->direction = dir;
 	msg->state = state;
 	msg->dup = false;
+	msg->indexed = false;
+	msg->away = false;
 	msg->qos = qos;
 	msg->retain = retain; // 是否是遗留信息
+#ifdef WITH_BRIDGE
+	mqtt3_bridge_msg_added(context, msg);
+#endif
 
   // 然后查到消息的队尾
-	if(tail){
-		tail->next = msg;
+	if(cold->last_msg){
+		cold->last_msg->next = msg;
 	}else{
 		context->msgs = msg;
 	}
+	cold->last_msg = msg;
+	cold->msg_count++;
+	if(placed) *placed = true;
+	if(qos > 0){
+		cold->msg_count12++;
+	}
+	if(_message_inflight(msg)){
+		cold->msg_inflight++;
+	}
+	if(dir == mosq_md_out){
+		db->out_queued += stored->msg.payloadlen;
+	}
+
+	if(cold->conflate && dir == mosq_md_out){
+		if(_conflate_index(context, msg)) return MOSQ_ERR_NOMEM;
+	}
 
   // 记录这个消息曾经发给哪些客户端
   // 重链的时候可能重新发送？？
   if(db->config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
-		/* Record which client ids this message has been sent to so we can avoid duplicates.
-		 * Outgoing messages only.
-		 * If retain==true then this is a stale retained message and so should be
-		 * sent regardless. FIXME - this does mean retained messages will received
-		 * multiple times for overlapping subscriptions, although this is only the
-		 * case for SUBSCRIPTION with multiple subs in so is a minor concern.
-		 */
-		dest_ids = _mosquitto_realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1));
-		if(dest_ids){
-			stored->dest_ids = dest_ids;
-			stored->dest_id_count++;
-			stored->dest_ids[stored->dest_id_count-1] = _mosquitto_strdup(context->id);
-			if(!stored->dest_ids[stored->dest_id_count-1]){
-				return MOSQ_ERR_NOMEM;
-			}
-		}else{
-			return MOSQ_ERR_NOMEM;
-		}
+		if(_message_dest_id_add(stored, context->id)) return MOSQ_ERR_NOMEM;
+	}
+
+	if(dir == mosq_md_out && state != mosq_ms_queued && context->sock != INVALID_SOCKET){
+		/* Ready to go, so have the loop flush it as soon as the socket is
+		 * writable. Everything queued for this client in the meantime goes
+		 * out in the same write. */
+		if(mqtt3_event_write_set(context, true)) return MOSQ_ERR_UNKNOWN;
 	}
 
 #ifdef WITH_BRIDGE
-	msg_count++; /* We've just added a message to the list */
 	if(context->bridge && context->bridge->start_type == bst_lazy
 			&& context->sock == INVALID_SOCKET
-			&& msg_count >= context->bridge->threshold){
+			&& cold->msg_count >= context->bridge->threshold){
 
 		context->bridge->lazy_reconnect = true;
 	}
@@ -415,6 +866,80 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	return rc;
 }
 
+int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored)
+{
+	return _message_insert(db, context, mid, dir, qos, retain, stored, true, NULL);
+}
+
+int mqtt3_db_message_insert_placed(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, bool *placed)
+{
+	return _message_insert(db, context, mid, dir, qos, retain, stored, true, placed);
+}
+
+int mqtt3_db_message_insert_hibernated(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated, int qos, struct mosquitto_msg_store *stored)
+{
+	if(db->config->allow_duplicate_messages == false && _message_dest_id_find(stored, hibernated->id)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(mqtt3_spool_append(db, &hibernated->spool, qos, false, stored->msg.topic, stored->msg.payloadlen, stored->msg.payload)){
+#ifdef WITH_SYS_TREE
+		g_msgs_dropped++;
+#endif
+		return 2;
+	}
+#ifdef WITH_PERSISTENCE
+	db->persistence_changes++;
+#endif
+	if(db->config->allow_duplicate_messages == false){
+		if(_message_dest_id_add(stored, hibernated->id)) return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_db_spool_refill(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto_msg_store *stored;
+	const char *topic;
+	const void *payload;
+	uint32_t payloadlen;
+	bool retain;
+	int qos;
+	int count;
+	int limit;
+	int rc;
+
+	if(!context->cold) return MOSQ_ERR_SUCCESS;
+	limit = db->config->queue_spill_threshold;
+	if(limit <= 0){
+		/* Spilling has since been turned off, drain at the window size. */
+		limit = _db_max_inflight(context);
+		if(limit <= 0) limit = 1;
+	}
+	while(context->cold->spool && context->cold->msg_count < limit){
+		rc = mqtt3_spool_peek(db, context, &qos, &retain, &topic, &payloadlen, &payload);
+		if(rc == MOSQ_ERR_NOT_FOUND) break;
+		if(rc) return MOSQ_ERR_SUCCESS; /* Damaged spool, already logged and dropped. */
+
+		if(mqtt3_db_message_store(db, "", 0, topic, qos, payloadlen, payload, retain, &stored, 0)){
+			return MOSQ_ERR_NOMEM;
+		}
+		count = context->cold->msg_count;
+		rc = _message_insert(db, context, qos > 0 ? _mosquitto_mid_generate(context) : 0,
+				mosq_md_out, qos, retain, stored, false, NULL);
+		mqtt3_db_msg_store_deref(db, stored);
+		if(rc == MOSQ_ERR_NOMEM || rc == MOSQ_ERR_UNKNOWN) return rc;
+		if(rc != MOSQ_ERR_SUCCESS && context->cold->msg_count == count){
+			/* Not taken this time round, leave it on disk. */
+			break;
+		}
+		mqtt3_spool_next(db, context);
+#ifdef WITH_PERSISTENCE
+		db->persistence_changes++;
+#endif
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
 int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mosquitto_msg_state state)
 {
 	struct mosquitto_client_msg *tail;
@@ -422,7 +947,14 @@ int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosqui
 	tail = context->msgs;
 	while(tail){
 		if(tail->mid == mid && tail->direction == dir){
+			if(tail->state == mosq_ms_queued){
+				context->cold->msg_queued--;
+			}else if(tail->state == mosq_ms_wait_for_pubrec && context->cold->inflight_adaptive){
+				_inflight_acked(context, mid);
+			}
+			if(_message_inflight(tail)) context->cold->msg_inflight--;
 			tail->state = state;
+			if(_message_inflight(tail)) context->cold->msg_inflight++;
 			tail->timestamp = mosquitto_time();
 			return MOSQ_ERR_SUCCESS;
 		}
@@ -438,23 +970,94 @@ int mqtt3_db_messages_delete(struct mosquitto *context)
 
 	if(!context) return MOSQ_ERR_INVAL;
 
+	mqtt3_db_conflate_clean(context);
+	if(context->cold){
+		mqtt3_spool_free(_mosquitto_get_db(), &context->cold->spool, true);
+	}
 	tail = context->msgs;
 	while(tail){
-		/* FIXME - it would be nice to be able to remove the stored message here if rec_count==0 */
-		tail->store->ref_count--;
+#ifdef WITH_BRIDGE
+		mqtt3_bridge_msg_removed(context, tail);
+#endif
+		mqtt3_db_msg_store_deref(_mosquitto_get_db(), tail->store);
 		next = tail->next;
 		_mosquitto_free(tail);
 		tail = next;
 	}
 	context->msgs = NULL;
+	if(context->cold){
+		context->cold->last_msg = NULL;
+		context->cold->msg_count = 0;
+		context->cold->msg_count12 = 0;
+		context->cold->msg_queued = 0;
+		context->cold->msg_inflight = 0;
+		context->cold->queued_hint = NULL;
+	}
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifdef WITH_BRIDGE
+int mqtt3_db_messages_failover(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail, *last = NULL;
+	struct mosquitto *dest;
+	uint16_t mid;
+	bool move;
+	bool placed;
+
+	if(!context || !context->bridge) return MOSQ_ERR_INVAL;
+
+	tail = context->msgs;
+	while(tail){
+		/* QoS 2 messages already part way through their handshake have to
+		 * be finished on this connection. Anything else can be sent again on
+		 * another one, a QoS 1 message may be a duplicate. */
+		switch(tail->state){
+			case mosq_ms_queued:
+			case mosq_ms_publish_qos0:
+			case mosq_ms_publish_qos1:
+			case mosq_ms_publish_qos2:
+			case mosq_ms_wait_for_puback:
+				move = (tail->direction == mosq_md_out);
+				break;
+			default:
+				move = false;
+				break;
+		}
+		if(move){
+			dest = mqtt3_bridge_partition(context, tail->store->msg.topic);
+			if(dest != context){
+				if(tail->qos){
+					mid = _mosquitto_mid_generate(dest);
+				}else{
+					mid = 0;
+				}
+				/* A conflated or duplicate insert leaves msg_count alone but
+				 * still means dest has the message now. */
+				mqtt3_db_message_insert_placed(db, dest, mid, mosq_md_out, tail->qos, tail->retain, tail->store, &placed);
+				if(!placed){
+					/* Couldn't be moved, keep it here until we reconnect. */
+					last = tail;
+					tail = tail->next;
+					continue;
+				}
+				_message_remove(context, &tail, last);
+				continue;
+			}
+		}
+		last = tail;
+		tail = tail->next;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
 int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain)
 {
 	struct mosquitto_msg_store *stored;
 	char *source_id;
+	int rc;
 
 	assert(db);
 
@@ -470,7 +1073,9 @@ int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *cont
   // 每个store结构都是以单条消息为核心的一个结构，里面记录了这条消息的主题、发送客户端、其他各种相关的信息
 	if(mqtt3_db_message_store(db, source_id, 0, topic, qos, payloadlen, payload, retain, &stored, 0)) return 1;
 
-	return mqtt3_db_messages_queue(db, source_id, topic, qos, retain, stored);
+	rc = mqtt3_db_messages_queue(db, source_id, topic, qos, retain, stored);
+	mqtt3_db_msg_store_deref(db, stored);
+	return rc;
 }
 
 int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id)
@@ -484,8 +1089,9 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	temp = _mosquitto_malloc(sizeof(struct mosquitto_msg_store));
 	if(!temp) return MOSQ_ERR_NOMEM;
 
-	temp->next = db->msg_store;
-	temp->ref_count = 0;
+	/* The caller holds the first reference and must release it with
+	 * mqtt3_db_msg_store_deref() once the message has been queued. */
+	temp->ref_count = 1;
 
   // 获取发送该消息的客户端id
   // 好像只是bridge才需要关注
@@ -540,8 +1146,14 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	}
 	temp->dest_ids = NULL;
 	temp->dest_id_count = 0;
-	db->msg_store_count++;
+	temp->frames = NULL;
+	temp->prev = NULL;
+	temp->next = db->msg_store;
+	if(db->msg_store){
+		db->msg_store->prev = temp;
+	}
 	db->msg_store = temp;
+	db->msg_store_count++;
 	(*stored) = temp;
 
 	if(!store_id){
@@ -549,10 +1161,67 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	}else{
 		temp->db_id = store_id;
 	}
+#ifdef WITH_PERSISTENCE
+	HASH_ADD(hh, db->msg_store_index, db_id, sizeof(dbid_t), temp);
+#endif
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+static void _message_store_free(struct mosquitto_db *db, struct mosquitto_msg_store *store)
+{
+	int i;
+
+	if(store->prev){
+		store->prev->next = store->next;
+	}else{
+		db->msg_store = store->next;
+	}
+	if(store->next){
+		store->next->prev = store->prev;
+	}
+#ifdef WITH_PERSISTENCE
+	HASH_DELETE(hh, db->msg_store_index, store);
+#endif
+	db->msg_store_count--;
+
+	if(store->source_id) _mosquitto_free(store->source_id);
+	if(store->dest_ids){
+		for(i=0; i<store->dest_id_count; i++){
+			if(store->dest_ids[i]) _mosquitto_free(store->dest_ids[i]);
+		}
+		_mosquitto_free(store->dest_ids);
+	}
+	if(store->msg.topic) _mosquitto_free(store->msg.topic);
+	if(store->msg.payload) _mosquitto_free(store->msg.payload);
+	/* Packets still being written hold their own reference to the frame. */
+	_message_store_frames_free(store);
+	_mosquitto_free(store);
+}
+
+/* Drop a reference to a stored message, freeing it when nothing refers to it
+ * any more. */
+void mqtt3_db_msg_store_deref(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	assert(db);
+	assert(stored);
+
+	stored->ref_count--;
+	if(stored->ref_count <= 0){
+		_message_store_free(db, stored);
+	}
+}
+
+#ifdef WITH_PERSISTENCE
+struct mosquitto_msg_store *mqtt3_db_msg_store_lookup(struct mosquitto_db *db, dbid_t db_id)
+{
+	struct mosquitto_msg_store *stored;
+
+	HASH_FIND(hh, db->msg_store_index, &db_id, sizeof(dbid_t), stored);
+	return stored;
+}
+#endif
+
 int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored)
 {
 	struct mosquitto_client_msg *tail;
@@ -579,7 +1248,6 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 {
 	struct mosquitto_client_msg *msg;
 	struct mosquitto_client_msg *prev = NULL;
-	int count;
 
 	msg = context->msgs;
 	while(msg){
@@ -607,16 +1275,8 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 			if(msg->qos != 2){
 				/* Anything <QoS 2 can be completely retried by the client at
 				 * no harm. */
-				msg->store->ref_count--;
-				if(prev){
-					prev->next = msg->next;
-					_mosquitto_free(msg);
-					msg = prev;
-				}else{
-					context->msgs = msg->next;
-					_mosquitto_free(msg);
-					msg = context->msgs;
-				}
+				_message_remove(context, &msg, prev);
+				continue;
 			}else{
 
 				/* Message state can be preserved here because it should match
@@ -626,7 +1286,7 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 			}
 		}
 		prev = msg;
-		if(msg) msg = msg->next;
+		msg = msg->next;
 	}
 
 	/* Messages received when the client was disconnected are put
@@ -638,27 +1298,10 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 
   // 剩下的这些msgs处理很显然是针对out方向的信息
   // 或者入方向的信息，且qos为2，而且已经入队的
-	if(context->msgs){
-		count = 0;
-		msg = context->msgs;
-		while(msg && (max_inflight == 0 || count < max_inflight)){
-			if(msg->state == mosq_ms_queued){
-				switch(msg->qos){
-					case 0:
-						msg->state = mosq_ms_publish_qos0;
-						break;
-					case 1:
-						msg->state = mosq_ms_publish_qos1;
-						break;
-					case 2:
-						msg->state = mosq_ms_publish_qos2;
-						break;
-				}
-			}
-			msg = msg->next;
-			count++;
-		}
+	if(context->cold){
+		context->cold->queued_hint = NULL;
 	}
+	_messages_promote(context, false);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -671,6 +1314,7 @@ int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout
 	enum mosquitto_msg_state new_state = mosq_ms_invalid;
 	struct mosquitto *context;
 	struct mosquitto_client_msg *msg;
+	bool retried;
 
   // 重试时间
 	threshold = mosquitto_time() - timeout;
@@ -679,6 +1323,7 @@ int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout
 		context = db->contexts[i];
 		if(!context) continue;
 
+		retried = false;
 		msg = context->msgs;
 		while(msg){
 			if(msg->timestamp < threshold && msg->state != mosq_ms_queued){ //这里是不是bug呢？未超时就改变状态？
@@ -702,10 +1347,15 @@ int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout
 					msg->timestamp = mosquitto_time();
 					msg->state = new_state;
 					msg->dup = true;
+					retried = true;
 				}
 			}
 			msg = msg->next;
 		}
+		if(retried && context->cold->inflight_adaptive && context->sock != INVALID_SOCKET){
+			/* Once per pass however many messages timed out. */
+			_inflight_cut(context);
+		}
 	}
 
 	return MOSQ_ERR_SUCCESS;
@@ -718,149 +1368,79 @@ int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context,
 	int retain;
 	char *topic;
 	char *source_id;
-	int msg_index = 0;
-	bool deleted = false;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
 	tail = context->msgs;
 	while(tail){
-		msg_index++;
-		if(tail->state == mosq_ms_queued && msg_index <= max_inflight){
-			tail->timestamp = mosquitto_time();
-			if(tail->direction == mosq_md_out){
-				switch(tail->qos){
-					case 0:
-						tail->state = mosq_ms_publish_qos0;
-						break;
-					case 1:
-						tail->state = mosq_ms_publish_qos1;
-						break;
-					case 2:
-						tail->state = mosq_ms_publish_qos2;
-						break;
-				}
-			}else{
-				if(tail->qos == 2){
-					_mosquitto_send_pubrec(context, tail->mid);
-					tail->state = mosq_ms_wait_for_pubrel;
-				}
-			}
-		}
-		if(tail->mid == mid && tail->direction == dir){
-			qos = tail->store->msg.qos;
-			topic = tail->store->msg.topic;
-			retain = tail->retain;
-			source_id = tail->store->source_id;
-
-			/* topic==NULL should be a QoS 2 message that was
-			 * denied/dropped and is being processed so the client doesn't
-			 * keep resending it. That means we don't send it to other
-			 * clients. */
-			if(!topic || !mqtt3_db_messages_queue(db, source_id, topic, qos, retain, tail->store)){
-				tail->store->ref_count--;
-				if(last){
-					last->next = tail->next;
-				}else{
-					context->msgs = tail->next;
-				}
-				_mosquitto_free(tail);
-				if(last){
-					tail = last->next;
-				}else{
-					tail = context->msgs;
-				}
-				deleted = true;
-			}else{
-				return 1;
-			}
-		}else{
-			last = tail;
-			tail = tail->next;
-		}
-		if(msg_index > max_inflight && deleted){
-			return MOSQ_ERR_SUCCESS;
-		}
+		if(tail->mid == mid && tail->direction == dir) break;
+		last = tail;
+		tail = tail->next;
 	}
-	if(deleted){
-		return MOSQ_ERR_SUCCESS;
-	}else{
+	if(!tail) return 1;
+
+	qos = tail->store->msg.qos;
+	topic = tail->store->msg.topic;
+	retain = tail->retain;
+	source_id = tail->store->source_id;
+
+	/* topic==NULL should be a QoS 2 message that was
+	 * denied/dropped and is being processed so the client doesn't
+	 * keep resending it. That means we don't send it to other
+	 * clients. */
+	if(topic && mqtt3_db_messages_queue(db, source_id, topic, qos, retain, tail->store)){
 		return 1;
 	}
+	_message_remove(context, &tail, last);
+
+	return _messages_promote(context, true);
 }
 
-int mqtt3_db_message_write(struct mosquitto *context)
+static int _message_write_queued(struct mosquitto *context)
 {
 	int rc;
 	struct mosquitto_client_msg *tail, *last = NULL;
 	uint16_t mid;
-	int retries;
-	int retain;
-	const char *topic;
-	int qos;
-	uint32_t payloadlen;
-	const void *payload;
 	int msg_count = 0;
+	int inflight;
+	int max_buffered = _mosquitto_get_db()->config->max_buffered_bytes;
+	bool deferred = false;
 
-	if(!context || context->sock == -1
-			|| (context->state == mosq_cs_connected && !context->id)){
-		return MOSQ_ERR_INVAL;
-	}
-
+	inflight = _db_max_inflight(context);
 	tail = context->msgs;
 	while(tail){
 		if(tail->direction == mosq_md_in){
 			msg_count++;
 		}
+		if(max_buffered > 0 && context->out_bytes >= (uint64_t)max_buffered
+				&& (tail->state == mosq_ms_publish_qos0
+					|| tail->state == mosq_ms_publish_qos1
+					|| tail->state == mosq_ms_publish_qos2)){
+			/* Enough is already waiting on the socket. Leave the message as
+			 * it is until some of that has been sent, handshake packets can
+			 * still go out. */
+			deferred = true;
+			last = tail;
+			tail = tail->next;
+			continue;
+		}
 		if(tail->state != mosq_ms_queued){
 			mid = tail->mid;
-			retries = tail->dup;
-			retain = tail->retain;
-			topic = tail->store->msg.topic;
-			qos = tail->qos;
-			payloadlen = tail->store->msg.payloadlen;
-			payload = tail->store->msg.payload;
 
 			switch(tail->state){
 				case mosq_ms_publish_qos0:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+					rc = _message_publish_qos0(context, tail);
 					if(!rc){
-						if(last){
-							last->next = tail->next;
-							tail->store->ref_count--;
-							_mosquitto_free(tail);
-							tail = last->next;
-						}else{
-							context->msgs = tail->next;
-							tail->store->ref_count--;
-							_mosquitto_free(tail);
-							tail = context->msgs;
-						}
+						_message_remove(context, &tail, last);
 					}else{
 						return rc;
 					}
 					break;
 
 				case mosq_ms_publish_qos1:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
-					if(!rc){
-						tail->timestamp = mosquitto_time();
-						tail->dup = 1; /* Any retry attempts are a duplicate. */
-						tail->state = mosq_ms_wait_for_puback;
-					}else{
-						return rc;
-					}
-					last = tail;
-					tail = tail->next;
-					break;
-
 				case mosq_ms_publish_qos2:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
-					if(!rc){
-						tail->timestamp = mosquitto_time();
-						tail->dup = 1; /* Any retry attempts are a duplicate. */
-						tail->state = mosq_ms_wait_for_pubrec;
-					}else{
+					rc = _message_publish(context, tail);
+					if(rc){
 						return rc;
 					}
 					last = tail;
@@ -907,9 +1487,10 @@ int mqtt3_db_message_write(struct mosquitto *context)
 			}
 		}else{
 			/* state == mosq_ms_queued */
-			if(tail->direction == mosq_md_in && (max_inflight == 0 || msg_count < max_inflight)){
+			if(tail->direction == mosq_md_in && (inflight == 0 || msg_count < inflight)){
 				if(tail->qos == 2){
 					tail->state = mosq_ms_send_pubrec;
+					context->cold->msg_queued--;
 				}
 			}else{
 				last = tail;
@@ -917,43 +1498,48 @@ int mqtt3_db_message_write(struct mosquitto *context)
 			}
 		}
 	}
+	if(context->cold) context->cold->out_deferred = deferred;
+	mqtt3_out_bytes_update(context, 0);
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+int mqtt3_db_message_write(struct mosquitto *context)
+{
+	int rc;
+	bool corked;
+
+	if(!context || context->sock == -1
+			|| (context->state == mosq_cs_connected && !context->id)){
+		return MOSQ_ERR_INVAL;
+	}
+
+	/* Queue up everything that is ready to go and then flush it in one go,
+	 * rather than making a write() call for every message. */
+	if(context->cold && context->cold->spool){
+		rc = mqtt3_db_spool_refill(_mosquitto_get_db(), context);
+		if(rc) return rc;
+	}
+
+	corked = context->out_packet_corked;
+	context->out_packet_corked = true;
+	rc = _message_write_queued(context);
+	context->out_packet_corked = corked;
+	if(rc || corked){
+		return rc;
+	}
+
+	return _mosquitto_packet_write(context);
+}
+
+/* Free every stored message regardless of its reference count. Only used on
+ * shutdown, once the contexts and retained messages have been freed. */
 void mqtt3_db_store_clean(struct mosquitto_db *db)
 {
-	/* FIXME - this may not be necessary if checks are made when messages are removed. */
-	struct mosquitto_msg_store *tail, *last = NULL;
-	int i;
 	assert(db);
 
-	tail = db->msg_store;
-	while(tail){
-		if(tail->ref_count == 0){
-			if(tail->source_id) _mosquitto_free(tail->source_id);
-			if(tail->dest_ids){
-				for(i=0; i<tail->dest_id_count; i++){
-					if(tail->dest_ids[i]) _mosquitto_free(tail->dest_ids[i]);
-				}
-				_mosquitto_free(tail->dest_ids);
-			}
-			if(tail->msg.topic) _mosquitto_free(tail->msg.topic);
-			if(tail->msg.payload) _mosquitto_free(tail->msg.payload);
-			if(last){
-				last->next = tail->next;
-				_mosquitto_free(tail);
-				tail = last->next;
-			}else{
-				db->msg_store = tail->next;
-				_mosquitto_free(tail);
-				tail = db->msg_store;
-			}
-			db->msg_store_count--;
-		}else{
-			last = tail;
-			tail = tail->next;
-		}
+	while(db->msg_store){
+		_message_store_free(db, db->msg_store);
 	}
 }
 
@@ -64,6 +64,8 @@ extern int g_clients_expired;
 
 /* static void loop_handle_errors(struct mosquitto_db *db, struct kevent *); */
 static void do_disconnect(struct mosquitto_db *db, int fd);
+static void _hibernated_expire(struct mosquitto_db *db, time_t now);
+static void _rate_tick(int fd, short n, void *arg);
 
 int push_update_db_context(int fd, short n,struct mosquitto_funcs_data *arg);
 
@@ -72,6 +74,8 @@ int
 mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock_count, int listener_max, struct event_base *base)
 {
   struct event *ev;
+  struct event *accept_ev = NULL;
+  struct event *rate_ev = NULL;
   pthread_t tid;
   int ret;
 
@@ -96,6 +100,24 @@ mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock_cou
       }
       /* Add event. */
       event_add(ev, NULL);
+      accept_ev = ev;
+    }
+
+  /* Rate limited clients are resumed more often than the main timer. */
+  for(int i = 0; i < db->config->listener_count; ++i)
+    {
+      if(db->config->listeners[i].rate_limited){
+        ev = event_new(base, -1, EV_PERSIST, _rate_tick, db);
+        if(!ev){
+          _mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+          return MOSQ_ERR_NOMEM;
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        evtimer_add(ev, &tv);
+        rate_ev = ev;
+        break;
+      }
     }
 
   ev = event_new(base, -1, EV_PERSIST, push_update_db_context, &funcs_data);
@@ -110,10 +132,38 @@ mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock_cou
 
   event_base_dispatch(base);
 
+  /* Stopped by SIGINT or SIGTERM. */
+  event_free(ev);
+  if(rate_ev) event_free(rate_ev);
+  if(accept_ev) event_free(accept_ev);
+
   return MOSQ_ERR_SUCCESS;
 }
 
 
+static void _rate_tick(int fd, short n, void *arg)
+{
+  mqtt3_rate_resume(arg);
+}
+
+/* persistent_client_expiration for hibernated clients, which aren't in
+ * db->contexts. */
+static void _hibernated_expire(struct mosquitto_db *db, time_t now)
+{
+  struct _clientid_index_hash *cih, *tmp;
+
+  HASH_ITER(hh, db->clientid_index_hash, cih, tmp){
+    if(cih->hibernated
+       && now > cih->hibernated->disconnect_t+db->config->persistent_client_expiration){
+      _mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Expiring persistent client %s due to timeout.", cih->hibernated->id);
+#ifdef WITH_SYS_TREE
+      g_clients_expired++;
+#endif
+      mqtt3_context_hibernated_expire(db, cih->hibernated);
+    }
+  }
+}
+
 // TODO 拆分这里的逻辑
 int
 push_update_db_context(int fd, short n, struct mosquitto_funcs_data *arg)
@@ -126,11 +176,15 @@ push_update_db_context(int fd, short n, struct mosquitto_funcs_data *arg)
   time_t now;
   struct mosquitto_db *db = arg->db;
   struct event_base * base = arg->base;
-  struct event *ev;
 
   time_t start_time = mosquitto_time();
 	time_t last_backup = mosquitto_time();
-	time_t last_store_clean = mosquitto_time();
+
+  /* SIGINT or SIGTERM, let mosquitto_main_loop() return. */
+  if(!run){
+    event_base_loopbreak(base);
+    return MOSQ_ERR_SUCCESS;
+  }
 
 #ifdef WITH_SYS_TREE
   // 更新sys信息，把这些信息都插入到特定的某些系统主题下，开放给订阅者
@@ -170,12 +224,28 @@ push_update_db_context(int fd, short n, struct mosquitto_funcs_data *arg)
         }
 
         // 发送堆积的消息，并清除超时的连接
-        /* Local bridges never time out in this fashion. */
-        if(!(db->contexts[i]->keepalive)
+        if(db->config->max_buffered_bytes > 0 && db->config->buffered_bytes_timeout > 0
+           && db->contexts[i]->cold
+           && db->contexts[i]->cold->out_over_t
+           && now - db->contexts[i]->cold->out_over_t > db->config->buffered_bytes_timeout){
+          if(db->config->connection_messages == true){
+            _mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s has exceeded max_buffered_bytes for too long, disconnecting.", db->contexts[i]->id);
+          }
+          mqtt3_context_disconnect(db, db->contexts[i]);
+        /* Local bridges never time out in this fashion. Paused publishers
+         * aren't being read from, so can't be judged on keepalive. */
+        }else if(!(db->contexts[i]->keepalive)
            || db->contexts[i]->bridge
+           || db->contexts[i]->read_paused
+           || db->contexts[i]->rate_paused
            || now - db->contexts[i]->last_msg_in < (time_t)(db->contexts[i]->keepalive)*3/2){
           //先尝试把堆积在每个context下面的信息发送出去
-          if(mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS){
+          rc = MOSQ_ERR_SUCCESS;
+          if(db->contexts[i]->cold && db->contexts[i]->cold->retain_cursors){
+            /* Picks up retained delivery for clients that reconnected part way through. */
+            rc = mqtt3_retain_deliver(db, db->contexts[i]);
+          }
+          if(rc == MOSQ_ERR_SUCCESS && mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS){
             // silence is god.
           }else{ //尝试发送失败，连接出问题了
             mqtt3_context_disconnect(db, db->contexts[i]);
@@ -225,21 +295,9 @@ push_update_db_context(int fd, short n, struct mosquitto_funcs_data *arg)
             // bst --> bridge start type, restart_t ==  30s
             if(db->contexts[i]->bridge->start_type == bst_automatic && now > db->contexts[i]->bridge->restart_t){
               db->contexts[i]->bridge->restart_t = 0;
+              /* The read event is registered by the connect itself. */
               rc = mqtt3_bridge_connect(db, db->contexts[i], base);
-              if(rc == MOSQ_ERR_SUCCESS){
-
-                /* Create event. */
-                arg->context = db->contexts[i];
-                ev = event_new(base, db->contexts[i]->sock, EV_READ|EV_PERSIST, handle_reads_writes, arg);
-                if(!ev){
-                  /* TODO error handle in Libevent */
-                  _mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-                  return MOSQ_ERR_NOMEM;
-                }
-                /* Add event. */
-                event_add(ev, NULL);
-
-              }else{
+              if(rc != MOSQ_ERR_SUCCESS){
                 /* Retry later. */
                 db->contexts[i]->bridge->restart_t = now+db->contexts[i]->bridge->restart_timeout;
 
@@ -265,7 +323,7 @@ push_update_db_context(int fd, short n, struct mosquitto_funcs_data *arg)
              * persistent_client_expiration seconds ago. If so,
              * expire it and clean up.
              */
-            if(now > db->contexts[i]->disconnect_t+db->config->persistent_client_expiration){
+            if(now > mqtt3_context_disconnect_t(db->contexts[i])+db->config->persistent_client_expiration){
               _mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Expiring persistent client %s due to timeout.", db->contexts[i]->id);
 #ifdef WITH_SYS_TREE
               g_clients_expired++;
@@ -275,39 +333,53 @@ push_update_db_context(int fd, short n, struct mosquitto_funcs_data *arg)
               db->contexts[i] = NULL;
             }
           }
+          // 长时间离线的持久会话，压缩成mosquitto_hibernated，省内存
+          if(db->contexts[i]
+             && db->config->session_hibernate_after > 0
+             && db->contexts[i]->clean_session == false
+             && db->contexts[i]->is_bridge == false
+             && db->contexts[i]->id
+             && !db->contexts[i]->msgs
+             && !(db->contexts[i]->cold && db->contexts[i]->cold->retain_cursors)
+             && now > mqtt3_context_disconnect_t(db->contexts[i])+db->config->session_hibernate_after){
+            mqtt3_context_hibernate(db, db->contexts[i]);
+          }
         }
       }
     }
   }// end of for loop
 
+  if(db->hibernated_count && db->config->persistent_client_expiration > 0){
+    _hibernated_expire(db, mosquitto_time());
+  }
+
   // 检测每个客户端的msgs链表里面每个msg的超时情况，改变它们响应的状态码
   mqtt3_db_message_timeout_check(db, db->config->retry_interval);
 
+#ifdef WITH_TLS
+  mqtt3_tls_session_update(db, mosquitto_time());
+#endif
+
   /* 一些定时的备份任务*/
 #ifdef WITH_PERSISTENCE
   if(db->config->persistence && db->config->autosave_interval){
     if(db->config->autosave_on_changes){
       if(db->persistence_changes > db->config->autosave_interval){
-        mqtt3_db_backup(db, false, false);
+        mqtt3_db_backup(db, false);
         db->persistence_changes = 0;
       }
     }else{
       if(last_backup + db->config->autosave_interval < mosquitto_time()){
-        mqtt3_db_backup(db, false, false);
+        mqtt3_db_backup(db, false);
         last_backup = mosquitto_time();
       }
     }
   }
 #endif
 
-  if(!db->config->store_clean_interval || last_store_clean + db->config->store_clean_interval < mosquitto_time()){
-    mqtt3_db_store_clean(db);
-    last_store_clean = mosquitto_time();
-  }
-
 #ifdef WITH_PERSISTENCE
   if(flag_db_backup){
-    mqtt3_db_backup(db, false, false);
+    mqtt3_db_backup(db, false);
     flag_db_backup = false;
   }
 #endif
@@ -373,11 +445,224 @@ static void do_disconnect(struct mosquitto_db *db, int fd)
 /* } */
 
 
+/* Hand the socket event of one context over to another. Used when a client
+ * reconnects and takes over the context of its existing session. */
+int mqtt3_event_move(struct mosquitto *from, struct mosquitto *to)
+{
+  struct event *event = from->event;
+  struct mosquitto_cold *cold;
+  short events;
+
+  if(!event) return MOSQ_ERR_SUCCESS;
+
+  events = event_get_events(event);
+  from->event = NULL;
+  if(from->cold && from->cold->write_pending){
+    from->cold->write_pending = false;
+    cold = mqtt3_context_cold(to);
+    if(cold){
+      cold->write_pending = true;
+    }else{
+      /* Whatever is waiting is written when the next packet is queued. */
+      events &= ~EV_WRITE;
+    }
+  }else if(to->cold){
+    to->cold->write_pending = false;
+  }
+  to->read_paused = from->read_paused;
+  from->read_paused = false;
+  to->rate_paused = from->rate_paused;
+  from->rate_paused = false;
+  event_del(event);
+  if(event_assign(event, event_get_base(event), event_get_fd(event), events, handle_reads_writes, to)){
+    /* Neither context owns the event any more. */
+    event_free(event);
+    to->event = NULL;
+    return MOSQ_ERR_UNKNOWN;
+  }
+  to->event = event;
+  if(event_add(event, NULL)){
+    return MOSQ_ERR_UNKNOWN;
+  }
+
+  return MOSQ_ERR_SUCCESS;
+}
+
+/* Re-register the socket event of a context with the interest implied by
+ * write_pending, read_paused and rate_paused. */
+static int _event_update(struct mosquitto *context)
+{
+  struct event *event = context->event;
+  short events = EV_PERSIST;
+
+  if(!context->read_paused && !context->rate_paused) events |= EV_READ;
+  if(context->cold && context->cold->write_pending) events |= EV_WRITE;
+
+  event_del(event);
+  if(!(events & (EV_READ|EV_WRITE))){
+    return MOSQ_ERR_SUCCESS;
+  }
+  if(event_assign(event, event_get_base(event), event_get_fd(event), events, handle_reads_writes, context)){
+    return MOSQ_ERR_UNKNOWN;
+  }
+  if(event_add(event, NULL)){
+    return MOSQ_ERR_UNKNOWN;
+  }
+
+  return MOSQ_ERR_SUCCESS;
+}
+
+/* Add or remove EV_WRITE interest for a context. Interest is only kept for
+ * as long as the context has output waiting, so that idle clients don't
+ * wake the loop up. */
+int mqtt3_event_write_set(struct mosquitto *context, bool want)
+{
+  struct mosquitto_cold *cold;
+
+  if(!context->event) return MOSQ_ERR_SUCCESS;
+  if(!want && !context->cold) return MOSQ_ERR_SUCCESS;
+
+  cold = mqtt3_context_cold(context);
+  if(!cold) return MOSQ_ERR_NOMEM;
+  if(cold->write_pending == want) return MOSQ_ERR_SUCCESS;
+
+  cold->write_pending = want;
+  return _event_update(context);
+}
+
+/* Add or remove EV_READ interest for a context. Reading from a publisher is
+ * stopped while the broker holds too many unsent bytes. */
+int mqtt3_event_read_set(struct mosquitto *context, bool want)
+{
+  if(context->read_paused == !want) return MOSQ_ERR_SUCCESS;
+
+  context->read_paused = !want;
+  if(!context->event) return MOSQ_ERR_SUCCESS;
+  return _event_update(context);
+}
+
+/* Add or remove EV_READ interest for a context that is over, or back under,
+ * its rate limits. Kept apart from read_paused so that the two don't resume
+ * each other's clients. */
+int mqtt3_event_rate_set(struct mosquitto *context, bool want)
+{
+  if(context->rate_paused == !want) return MOSQ_ERR_SUCCESS;
+
+  context->rate_paused = !want;
+  if(!context->event) return MOSQ_ERR_SUCCESS;
+  return _event_update(context);
+}
+
+/* Start reading from every paused publisher again. */
+static void _out_bytes_resume(struct mosquitto_db *db)
+{
+  struct mosquitto *context;
+  int i;
+
+  for(i=0; i<db->context_count; i++){
+    context = db->contexts[i];
+    if(!context) continue;
+    if(context->read_paused){
+      mqtt3_event_read_set(context, true);
+    }
+    if(context->cold) context->cold->over_added = 0;
+  }
+  db->reads_paused = false;
+  db->over_added = 0;
+  db->over_publishers = 0;
+}
+
+/* Account for bytes added to (delta > 0) or sent/dropped from (delta < 0)
+ * the outgoing packet queue of a context. A delta of 0 just re-checks the
+ * per client budget. */
+void mqtt3_out_bytes_update(struct mosquitto *context, int64_t delta)
+{
+  struct mosquitto_db *db = _mosquitto_get_db();
+  int max = db->config->max_buffered_bytes;
+  int total_max = db->config->max_total_buffered_bytes;
+  struct mosquitto_cold *cold;
+
+  context->out_bytes += delta;
+  db->out_bytes += delta;
+
+  if(max > 0){
+    /* Messages held back in the queue count as over budget as well, the
+     * socket itself may be what is full. */
+    if(context->out_bytes >= (uint64_t)max || (context->cold && context->cold->out_deferred)){
+      cold = mqtt3_context_cold(context);
+      if(cold && !cold->out_over_t) cold->out_over_t = mosquitto_time();
+    }else if(context->cold){
+      context->cold->out_over_t = 0;
+    }
+  }
+
+  /* Low watermark is half the budget, so publishers aren't flapped on and
+   * off around the limit. */
+  if(delta < 0 && (db->reads_paused || db->over_publishers)
+      && (total_max <= 0 || db->out_bytes <= (uint64_t)total_max/2)){
+    _out_bytes_resume(db);
+  }
+}
+
+/* Called after a publisher's message has been handled, out_queued_before is
+ * db->out_queued from before it was. While the total is over budget, only a
+ * publisher whose message was actually queued for someone is paused, and
+ * only if it has queued at least its share of what was queued since going
+ * over, so the heaviest publishers are the ones held back. */
+void mqtt3_out_bytes_check(struct mosquitto_db *db, struct mosquitto *context, uint64_t out_queued_before)
+{
+  int total_max = db->config->max_total_buffered_bytes;
+  struct mosquitto_cold *cold;
+  uint64_t added;
+
+  if(total_max <= 0 || db->out_bytes <= (uint64_t)total_max) return;
+  if(db->out_queued == out_queued_before || context->read_paused) return;
+  added = db->out_queued - out_queued_before;
+
+  cold = mqtt3_context_cold(context);
+  if(!cold) return;
+  if(!cold->over_added) db->over_publishers++;
+  cold->over_added += added;
+  db->over_added += added;
+
+  if(cold->over_added * (uint64_t)db->over_publishers < db->over_added) return;
+
+  _mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Output buffers over budget, pausing reads from %s.", context->id);
+  mqtt3_event_read_set(context, false);
+  db->reads_paused = true;
+}
+
+/* The socket is writable: send what is waiting, top up retained delivery
+ * and drop write interest once there is nothing left. */
+static int _loop_flush(struct mosquitto_db *db, struct mosquitto *context)
+{
+  struct mosquitto_cold *cold;
+  int rc;
+
+  rc = mqtt3_db_message_write(context);
+  if(rc) return rc;
+
+  cold = context->cold;
+  if(context->current_out_packet || context->out_packet
+      || (cold && (cold->ctrl_packet || cold->out_deferred))){
+    /* Still backed up, wait for the next EV_WRITE. */
+    return MOSQ_ERR_SUCCESS;
+  }
+  rc = mqtt3_event_write_set(context, false);
+  if(rc) return rc;
+
+  if(cold && cold->retain_cursors){
+    /* Registers write interest again if there is more to come. */
+    rc = mqtt3_retain_deliver(db, context);
+  }
+  return rc;
+}
+
 // 算法复杂度O(n)
 void handle_reads_writes(int fd, short ev, void *arg)
 {//mosquitto_main_loop调用这里来处理客户端连接的读写事件
-  struct mosquitto_db *db = ((struct mosquitto_funcs_data *)arg)->db;
-  struct mosquitto *context = ((struct mosquitto_funcs_data *)arg)->context;
+  struct mosquitto_db *db = _mosquitto_get_db();
+  struct mosquitto *context = arg;
 
   if(context && context->sock == fd){
 
@@ -389,7 +674,7 @@ void handle_reads_writes(int fd, short ev, void *arg)
 #else
       if(ev & EV_WRITE){
 #endif
-        if(_mosquitto_packet_write(context)){
+        if(_loop_flush(db, context)){
           if(db->config->connection_messages == true){
             if(context->state != mosq_cs_disconnecting){
               _mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Socket write error on client %s, disconnecting.", context->id);
@@ -423,6 +708,12 @@ void handle_reads_writes(int fd, short ev, void *arg)
           }
           /* Read error or other that means we should disconnect */
           mqtt3_context_disconnect(db, context);
+        }else if(context->cold && context->cold->retain_cursors && context->sock != INVALID_SOCKET){
+          /* An acknowledgement may have made room for more retained messages. */
+          if(mqtt3_event_write_set(context, true)){
+            /* Retained delivery would never be picked up again. */
+            mqtt3_context_disconnect(db, context);
+          }
         }
 #ifdef WITH_TLS
       }
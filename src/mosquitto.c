@@ -134,15 +134,16 @@ void handle_sighup(int signal)
 }
 #endif
 
-/* Signal handler for SIGINT and SIGTERM - just stop gracefully. */
+/* Signal handler for SIGINT and SIGTERM - just stop gracefully. The main
+ * loop notices on its next tick and returns, so that the database is saved
+ * on the way out. */
 void handle_sigint(int signal)
 {
   switch(signal) {
   case SIGTERM:
   /* case SIGHUP: */
   case SIGINT:
-    exit(0);
-    //FIXME better backup db
+    run = 0;
     break;
   default:
     syslog(LOG_WARNING, "Unhandled signal (%d) %s", strsignal(signal));
@@ -345,7 +346,7 @@ int main(int argc, char *argv[])
 
 #ifdef WITH_PERSISTENCE
 	if(config.persistence){
-		mqtt3_db_backup(&int_db, true, true);
+		mqtt3_db_backup(&int_db, true);
 	}
 #endif
 
@@ -379,6 +380,7 @@ int main(int argc, char *argv[])
 
 	_mosquitto_net_cleanup();
 	mqtt3_config_cleanup(int_db.config);
+	event_base_free(base);
 
   //结束
 	return rc;
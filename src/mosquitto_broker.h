@@ -54,12 +54,57 @@ POSSIBILITY OF SUCH DAMAGE.
 
 typedef uint64_t dbid_t;
 
+/* A rate_limit_* setting, per second. 0 for no limit. */
+struct mqtt3_rate_limit{
+	int messages;
+	int bytes;
+};
+
+/* Tokens left in a rate limit bucket, in thousandths. */
+struct mosquitto_bucket{
+	int64_t messages;
+	int64_t bytes;
+	uint64_t refill_ms; /* 0 until first used */
+};
+
+/* A rate_limit_user or rate_limit_client bucket, shared by the clients of a
+ * listener that have the same username or client id. It outlives its last
+ * client until it has refilled, so reconnecting doesn't reset it. */
+struct mosquitto_shared_bucket{
+	char *key; /* username or client id */
+	struct _mqtt3_listener *listener;
+	struct mosquitto_bucket bucket;
+	int ref_count;
+	UT_hash_handle hh;
+};
+
+#ifdef WITH_TLS
+/* A session ticket key, laid out as a record of tls_ticket_key_file. */
+#define MOSQ_TICKET_KEY_LEN 80
+struct mosquitto_ticket_key{
+	unsigned char name[16];
+	unsigned char hmac_key[32];
+	unsigned char aes_key[32];
+};
+#endif
+
 struct _mqtt3_listener {
 	int fd;
 	char *host;
 	uint16_t port;
 	int max_connections;
 	char *mount_point;
+	bool conflate_messages;
+	int inflight_window; /* -1 to use max_inflight_messages */
+	bool inflight_adaptive;
+	struct mqtt3_rate_limit rate_listener;
+	struct mqtt3_rate_limit rate_user;
+	struct mqtt3_rate_limit rate_client;
+	bool rate_limited; /* any of the rate limits are set */
+	struct mosquitto_bucket bucket; /* rate_listener */
+	struct mosquitto_shared_bucket *user_buckets; /* rate_user, by username */
+	struct mosquitto_shared_bucket *client_buckets; /* rate_client, by client id */
+	bool buckets_released; /* some buckets have no clients left and are refilling */
 	int *socks;
   int sock_count; //???
   int client_count; ///????
@@ -76,10 +121,23 @@ struct _mqtt3_listener {
 	char *crlfile;
 	bool use_identity_as_username;
 	char *tls_version;
+	int tls_session_cache_size; /* 0 to disable the session id cache */
+	int tls_session_timeout;
+	bool tls_session_tickets;
+	char *tls_ticket_key_file;
+	int tls_ticket_key_rotate;
+	struct mosquitto_ticket_key *ticket_keys; /* newest first, it issues tickets */
+	int ticket_key_count;
+	time_t ticket_key_t; /* generated keys: last rotated, key file: its mtime */
 #endif
 
 };
 
+enum mosquitto_share_policy{
+	sp_round_robin = 0,
+	sp_least_loaded = 1
+};
+
 struct mqtt3_config {
     // 配置文件
 	char *config_file;
@@ -103,8 +161,18 @@ struct mqtt3_config {
 	bool queue_qos0_messages;
 	char *clientid_prefixes;
 	int message_size_limit;
+	int retained_batch_size;
+	int match_cache_size;
+	int max_buffered_bytes;
+	int max_total_buffered_bytes;
+	int buffered_bytes_timeout;
+	int queue_spill_threshold;
+	char *queue_spill_location;
+	int queue_spill_segment_size;
+	int session_hibernate_after;
+	int inflight_adaptive_max;
+	enum mosquitto_share_policy shared_subscription_policy;
 	int retry_interval;
-	int store_clean_interval;
 	int sys_interval;
 
     //权限认证相关
@@ -147,30 +215,196 @@ struct mqtt3_config {
 
 };
 
+#define MOSQ_SUBLEAF_BRIDGE 0x01
+#define MOSQ_SUBLEAF_HIBERNATED 0x02
+
+/* A shared subscription group, $share/<name>/<filter>, on one node. Each
+ * message goes to just one of the group's members. */
+struct _mosquitto_subshare {
+	char *name;
+	int member_count;
+	int next; /* index in hier->subs to start looking for the next member */
+	UT_hash_handle hh;
+};
+
+/* A subscription. These are packed into an array on their node so fan-out is
+ * a linear scan, with what delivery checks for every recipient kept inline. */
 struct _mosquitto_subleaf {
-	struct _mosquitto_subleaf *prev;
-	struct _mosquitto_subleaf *next;
-	struct mosquitto *context;
-	int qos;
+	union{
+		struct mosquitto *context;
+		struct mosquitto_hibernated *hibernated; /* if MOSQ_SUBLEAF_HIBERNATED */
+	};
+	struct _mosquitto_subshare *share; /* NULL unless part of a shared subscription */
+	int ref; /* index of this subscription in context->cold->subs */
+	uint8_t qos;
+	uint8_t flags;
+};
+
+/* The other half of a subscription, kept in context->cold->subs. Removing an
+ * entry from either array moves the last one into its place, so each side
+ * records where its partner is and is updated when it moves. */
+struct _mosquitto_subref {
+	struct _mosquitto_subhier *hier;
+	int leaf; /* index of the subscription in hier->subs */
+};
+
+/* The part of a client that most clients never need, see struct mosquitto.
+ * Allocated by mqtt3_context_cold() the first time it is used and kept until
+ * the context is freed. A context with any messages or subscriptions always
+ * has one. */
+struct mosquitto_cold{
+	/* Control packets that have to overtake queued publishes, see
+	 * _mosquitto_packet_queue(). */
+	struct _mosquitto_packet *ctrl_packet;
+	struct _mosquitto_packet *ctrl_packet_last;
+	struct mosquitto_client_msg *last_msg;
+	int msg_count;
+	int msg_count12;
+	int msg_queued; /* messages waiting for room in the in-flight window */
+	int msg_inflight; /* outgoing QoS 1 and 2 messages not waiting in the queue */
+	bool write_pending; /* EV_WRITE interest is registered on event */
+	bool out_deferred; /* publishes held back by max_buffered_bytes */
+	bool conflate; /* queued messages are last value per topic */
+	bool inflight_adaptive; /* inflight_window follows the acks */
+	struct _mosquitto_subref *subs; /* this client's subscriptions */
+	int sub_count;
+	int sub_max;
+	struct mosquitto_retain_cursor *retain_cursors;
+	struct _mosquitto_conflate *conflate_index; /* topic -> undelivered message */
+	struct mosquitto_spool *spool; /* messages spilled to disk, oldest first */
+	time_t disconnect_t; /* persistent clients */
+	time_t ping_t; /* bridges, when the unanswered PINGREQ was sent */
+	char *topic_buf; /* reused for building mounted topics */
+	int topic_buf_len;
+	uint64_t out_bytes_reported; /* last value published in $SYS */
+	time_t out_over_t; /* when out_bytes went over max_buffered_bytes */
+	uint64_t over_added; /* payload bytes this publisher queued while over max_total_buffered_bytes */
+	struct mosquitto_client_msg *queued_hint; /* at or before the first queued message */
+	/* Adaptive in-flight window, see mqtt3_db_inflight_init(). */
+	int inflight_window; /* messages allowed in flight */
+	uint64_t rtt_start; /* ms, when the message being timed was sent, 0 if none */
+	uint16_t rtt_mid;
+	int srtt; /* smoothed PUBACK/PUBREC round trip in ms, 0 until measured */
+	int inflight_credit; /* acks counted towards the next increase */
+	struct mosquitto_shared_bucket *rate_client; /* rate_limit_client */
+	struct mosquitto_shared_bucket *rate_user; /* rate_limit_user */
 };
 
+/* A persistent client that has been disconnected for longer than
+ * session_hibernate_after, packed into a single allocation in place of its
+ * struct mosquitto. Its subscriptions stay in the tree, with the leaves
+ * pointing here instead. subs, id and username point into the same
+ * allocation. */
+struct mosquitto_hibernated{
+	char *id;
+	char *username;
+	struct mosquitto_spool *spool;
+	struct _mosquitto_subref *subs;
+	int sub_count;
+	uint16_t last_mid;
+	time_t disconnect_t;
+};
+
+/* A node of the subscription tree. Chains of nodes with no subscriptions and
+ * a single child are collapsed, so the edge leading to a node can span several
+ * topic levels. Children are hashed on the first level of their edge. */
 struct _mosquitto_subhier {
+	struct _mosquitto_subhier *parent;
 	struct _mosquitto_subhier *children;
-	struct _mosquitto_subhier *next;
 	struct _mosquitto_subleaf *subs;
+	int sub_count;
+	int sub_max;
+	struct _mosquitto_subshare *shares;
+	char **levels; /* edge label, a + or literal level each; # is never merged */
+	int level_count;
+	int subs_below; /* subscriptions on this node and all nodes below it */
+	int plus_below; /* subscriptions below that are reached through a + */
+	int hash_below; /* # subscriptions below */
+	UT_hash_handle hh;
+};
+
+/* The result of mqtt3_sub_match() for one topic, kept so that a topic that is
+ * published to often doesn't walk the tree every time. It is only valid while
+ * generation is the same as db->sub_generation. */
+struct _mosquitto_match_cache {
+	char *topic;
+	struct _mosquitto_subhier **matches;
+	int match_count;
+	unsigned int generation;
+	UT_hash_handle hh;
+};
+
+/* A node of the retained message index. This is kept apart from the
+ * subscription tree and children are hashed on their topic level, so a
+ * lookup only ever visits the levels that can match. */
+struct _mosquitto_retainhier {
+	struct _mosquitto_retainhier *parent;
+	struct _mosquitto_retainhier *children;
 	char *topic;
 	struct mosquitto_msg_store *retained;
+	int pins; /* delivery cursors positioned on this node */
+	UT_hash_handle hh;
+};
+
+struct _mosquitto_retain_frame{
+	struct _mosquitto_retainhier *node; /* node whose children are being walked */
+	struct _mosquitto_retainhier *last; /* last child visited */
+	int level;
+};
+
+/* Retained messages still to be delivered for one subscription. */
+struct mosquitto_retain_cursor{
+	struct mosquitto_retain_cursor *next;
+	char *sub;
+	char *buf;
+	char **levels; /* sub split into levels, pointing into buf */
+	int level_count;
+	int qos;
+	bool started;
+	struct _mosquitto_retainhier *retry; /* pinned, its message was dropped */
+	int retry_level;
+	struct _mosquitto_retain_frame *stack;
+	int stack_len;
+	int stack_max;
+};
+
+/* A QoS 0 PUBLISH frame cached on a stored message, one per mount point. */
+struct mosquitto_msg_frame{
+	struct mosquitto_msg_frame *next;
+	const char *mount_point;
+	const char *topic; /* msg.topic with mount_point removed */
+	bool retain;
+	struct _mosquitto_frame *frame;
+};
+
+/* Position of a client's spilled messages within its segment files. */
+struct mosquitto_spool{
+	uint32_t id;
+	uint32_t read_seq;
+	uint32_t read_pos;
+	uint32_t write_seq;
+	uint32_t write_pos;
+	uint32_t count;
+	uint8_t *read_map;
+	size_t read_len;
+	uint8_t *write_map;
+	size_t write_len;
 };
 
 struct mosquitto_msg_store{
 	struct mosquitto_msg_store *next;
+	struct mosquitto_msg_store *prev;
 	dbid_t db_id;
-	int ref_count;
+	int ref_count; /* freed as soon as this drops to 0 */
 	char *source_id;
 	char **dest_ids;
 	int dest_id_count;
 	uint16_t source_mid;
 	struct mosquitto_message msg;
+	struct mosquitto_msg_frame *frames;
+#ifdef WITH_PERSISTENCE
+	UT_hash_handle hh; /* db->msg_store_index, keyed on db_id */
+#endif
 };
 
 struct mosquitto_client_msg{
@@ -183,6 +417,15 @@ struct mosquitto_client_msg{
 	enum mosquitto_msg_direction direction;
 	enum mosquitto_msg_state state;
 	bool dup;
+	bool indexed; /* pointed to by the context conflate_index */
+	bool away; /* counted in the away_count of its home bridge partition */
+};
+
+/* Entry of the per client conflation index. The key is the topic of the
+ * message store the entry currently points at. */
+struct _mosquitto_conflate{
+	struct mosquitto_client_msg *msg;
+	UT_hash_handle hh;
 };
 
 struct _mosquitto_unpwd{
@@ -222,17 +465,27 @@ struct _mosquitto_auth_plugin{
 	int (*psk_key_get)(void *user_data, const char *hint, const char *identity, char *key, int max_key_len);
 };
 
+/* Keyed on the client id, which is only kept in hh.key so that an idle
+ * client costs no more than it has to. */
 struct _clientid_index_hash{
-	/* this is the key */
-	char *id;
 	/* this is the index where the client ID exists in the db->contexts array */
 	int db_context_index;
+	/* or, if the client is hibernated, db_context_index is -1 and this is it */
+	struct mosquitto_hibernated *hibernated;
 	UT_hash_handle hh;
 };
 
 struct mosquitto_db{
 	dbid_t last_db_id;
 	struct _mosquitto_subhier subs;
+	struct _mosquitto_subhier **sub_matches; /* result of mqtt3_sub_match() */
+	int sub_match_count;
+	int sub_match_max;
+	unsigned int sub_generation; /* bumped whenever a subscription is added or removed */
+	struct _mosquitto_match_cache *match_cache; /* least recently used first */
+	unsigned long match_cache_hits;
+	unsigned long match_cache_misses;
+	struct _mosquitto_retainhier retains;
 	struct _mosquitto_unpwd *unpwd;
 	struct _mosquitto_acl_user *acl_list;
 	struct _mosquitto_acl *acl_patterns;
@@ -241,12 +494,24 @@ struct mosquitto_db{
 	struct _clientid_index_hash *clientid_index_hash;
 	int context_count;
 	struct mosquitto_msg_store *msg_store;
+#ifdef WITH_PERSISTENCE
+	struct mosquitto_msg_store *msg_store_index;
+#endif
 	int msg_store_count;
 	struct mqtt3_config *config;
 	int persistence_changes;
 	struct _mosquitto_auth_plugin auth_plugin;
 	int subscription_count;
 	int retained_count;
+	uint64_t out_bytes; /* sum of out_bytes over all contexts */
+	bool reads_paused; /* some publishers may have EV_READ dropped */
+	uint64_t over_added; /* payload bytes all publishers queued while over budget */
+	int over_publishers; /* publishers with a non-zero cold->over_added */
+	uint64_t out_queued; /* payload bytes ever queued for clients */
+	bool rates_paused; /* some clients are over a rate limit */
+	uint32_t spool_next_id;
+	unsigned long spool_count; /* messages held in queue spools */
+	int hibernated_count;
 };
 
 enum mqtt3_bridge_direction{
@@ -270,8 +535,12 @@ struct _mqtt3_bridge_topic{
 	char *remote_prefix;
 	char *local_topic; /* topic prefixed with local_prefix */
 	char *remote_topic; /* topic prefixed with remote_prefix */
+	int local_prefix_len;
+	int remote_prefix_len;
 };
 
+struct _mqtt3_bridge_remap_node;
+
 struct bridge_address{
 	char *address;
 	int port;
@@ -302,6 +571,18 @@ struct _mqtt3_bridge{
 	bool lazy_reconnect;
 	bool try_private;
 	bool try_private_accepted;
+	int max_inflight_messages; /* -1 means use the global max_inflight_messages */
+	struct _mqtt3_bridge_remap_node *remap_out; /* compiled local_topic patterns */
+	struct _mqtt3_bridge_remap_node *remap_in; /* compiled remote_topic patterns */
+	char *remap_out_buf; /* reused for remapped topics */
+	int remap_out_buf_len;
+	char *remap_in_buf;
+	int remap_in_buf_len;
+	int connection_count; /* number of parallel connections to the remote broker */
+	int partition; /* index of this connection within partitions */
+	struct _mqtt3_bridge **partitions; /* shared by all connections of one bridge */
+	int away_count; /* messages for this partition's topics queued on another connection */
+	struct mosquitto *context;
 #ifdef WITH_TLS
 	char *tls_cafile;
 	char *tls_capath;
@@ -360,6 +641,12 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener);
 int _mosquitto_socket_get_address(int sock, char *buf, int len);
 /* Libevent */
 void handle_reads_writes(int fd, short ev, void *arg);
+int mqtt3_event_move(struct mosquitto *from, struct mosquitto *to);
+int mqtt3_event_write_set(struct mosquitto *context, bool want);
+int mqtt3_event_read_set(struct mosquitto *context, bool want);
+int mqtt3_event_rate_set(struct mosquitto *context, bool want);
+void mqtt3_out_bytes_update(struct mosquitto *context, int64_t delta);
+void mqtt3_out_bytes_check(struct mosquitto_db *db, struct mosquitto *context, uint64_t out_queued_before);
 void mosquitto_read_cb(struct bufferevent *bev, void *arg);
 void mosquitto_error_cb(struct bufferevent *bev, short event, void *arg);
 void mosquitto_write_cb(struct bufferevent *bev, void *arg);
@@ -381,27 +668,43 @@ int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db);
 int mqtt3_db_close(struct mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
-int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown);
+int mqtt3_db_backup(struct mosquitto_db *db, bool shutdown);
 int mqtt3_db_restore(struct mosquitto_db *db);
 #endif
 int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned int *inactive_count);
 void mqtt3_db_limits_set(int inflight, int queued);
+void mqtt3_db_inflight_init(struct mosquitto *context);
 /* Return the number of in-flight messages in count. */
 int mqtt3_db_message_count(int *count);
 int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
 int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored);
+/* As mqtt3_db_message_insert(), also saying whether the client got the message
+ * rather than it being dropped. */
+int mqtt3_db_message_insert_placed(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, bool *placed);
 int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
 int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mosquitto_msg_state state);
 int mqtt3_db_message_write(struct mosquitto *context);
 int mqtt3_db_messages_delete(struct mosquitto *context);
+void mqtt3_db_conflate_clean(struct mosquitto *context);
+/* Bring spilled messages back into memory while context has room for them. */
+int mqtt3_db_spool_refill(struct mosquitto_db *db, struct mosquitto *context);
+/* Queue a message for a hibernated client straight into its spool. */
+int mqtt3_db_message_insert_hibernated(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated, int qos, struct mosquitto_msg_store *stored);
+#ifdef WITH_BRIDGE
+/* Move a disconnected bridge connection's unacknowledged outgoing messages onto its connected partitions. */
+int mqtt3_db_messages_failover(struct mosquitto_db *db, struct mosquitto *context);
+#endif
 int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain);
 int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
 int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id);
 int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored);
+void mqtt3_db_msg_store_deref(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+#ifdef WITH_PERSISTENCE
+struct mosquitto_msg_store *mqtt3_db_msg_store_lookup(struct mosquitto_db *db, dbid_t db_id);
+#endif
 /* Check all messages waiting on a client reply and resend if timeout has been exceeded. */
 int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout);
 int mqtt3_db_message_reconnect_reset(struct mosquitto *context);
-int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
 void mqtt3_db_store_clean(struct mosquitto_db *db);
 void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_time);
 void mqtt3_db_vacuum(void);
@@ -409,11 +712,67 @@ void mqtt3_db_vacuum(void);
 /* ============================================================
  * Subscription functions
  * ============================================================ */
+int mqtt3_sub_tree_init(struct mosquitto_db *db);
+void mqtt3_sub_tree_clean(struct mosquitto_db *db);
+int mqtt3_sub_topic_tokenise(const char *topic, char **buf, char ***levels, int *level_count);
+bool mqtt3_sub_share_split(const char *sub, const char **group, int *group_len, const char **filter);
 int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root);
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root);
-int mqtt3_sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *root, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
+int mqtt3_sub_match(struct mosquitto_db *db, const char *topic);
+int mqtt3_sub_deliver(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
+int mqtt3_sub_deliver_direct(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, uint32_t payloadlen, const void *payload);
 void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level);
 int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root);
+void mqtt3_subs_clean_hibernated(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated);
+
+/* ============================================================
+ * Retained message functions
+ * ============================================================ */
+/* Set or, for a zero length payload, clear the retained message for topic. */
+int mqtt3_retain_store(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored);
+/* Start delivering the retained messages matching sub to context. */
+int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
+/* Queue the next batch of pending retained messages for context. */
+int mqtt3_retain_deliver(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_retain_cancel(struct mosquitto *context, const char *sub);
+void mqtt3_retain_cursors_free(struct mosquitto *context);
+int mqtt3_retain_foreach(struct mosquitto_db *db, int (*callback)(struct mosquitto_db *, struct mosquitto_msg_store *, void *), void *userdata);
+void mqtt3_retain_clean(struct mosquitto_db *db);
+
+/* ============================================================
+ * Queue spool functions
+ * ============================================================ */
+int mqtt3_spool_init(struct mosquitto_db *db);
+int mqtt3_spool_append(struct mosquitto_db *db, struct mosquitto_spool **spool, int qos, bool retain, const char *topic, uint32_t payloadlen, const void *payload);
+int mqtt3_spool_peek(struct mosquitto_db *db, struct mosquitto *context, int *qos, bool *retain, const char **topic, uint32_t *payloadlen, const void **payload);
+void mqtt3_spool_next(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_spool_free(struct mosquitto_db *db, struct mosquitto_spool **spoolp, bool remove_files);
+void mqtt3_spool_release(struct mosquitto_spool *spool);
+int mqtt3_spool_sync(struct mosquitto_spool *spool);
+int mqtt3_spool_restore(struct mosquitto_db *db, struct mosquitto *context, const struct mosquitto_spool *saved);
+
+/* ============================================================
+ * Rate limit functions
+ * ============================================================ */
+/* Charge a packet read from context to its buckets, pausing reads from it if
+ * it is over a limit. */
+void mqtt3_rate_charge(struct mosquitto_db *db, struct mosquitto *context, uint32_t bytes, bool publish);
+/* Start reading again from paused clients whose buckets have refilled, and
+ * free refilled buckets that no client is using. */
+void mqtt3_rate_resume(struct mosquitto_db *db);
+void mqtt3_rate_release(struct mosquitto *context);
+void mqtt3_rate_cleanup(struct _mqtt3_listener *listener);
+
+/* ============================================================
+ * TLS session functions
+ * ============================================================ */
+#ifdef WITH_TLS
+/* Set up session resumption on a listener's new ssl_ctx. */
+int mqtt3_tls_session_init(struct _mqtt3_listener *listener);
+/* Rotate generated ticket keys and reload changed key files. */
+void mqtt3_tls_session_update(struct mosquitto_db *db, time_t now);
+void mqtt3_tls_session_cleanup(struct _mqtt3_listener *listener);
+#endif
 
 /* ============================================================
  * Context functions
@@ -421,6 +780,17 @@ int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context,
 struct mosquitto *mqtt3_context_init(int sock);
 void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free);
 void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_context_acl_set(struct mosquitto_db *db, struct mosquitto *context);
+struct mosquitto_cold *mqtt3_context_cold(struct mosquitto *context);
+/* When a persistent client was disconnected, 0 if it never was. */
+time_t mqtt3_context_disconnect_t(struct mosquitto *context);
+/* Pack an idle disconnected persistent client away, freeing context. */
+int mqtt3_context_hibernate(struct mosquitto_db *db, struct mosquitto *context);
+/* Unpack a hibernated client into a full, still disconnected, context. */
+struct mosquitto *mqtt3_context_wake(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated);
+/* Drop a hibernated client for good, as for an expired session. */
+void mqtt3_context_hibernated_expire(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated);
+void mqtt3_context_hibernated_clean(struct mosquitto_db *db);
 
 /* ============================================================
  * Logging functions
@@ -436,6 +806,13 @@ int _mosquitto_log_printf(struct mosquitto *mosq, int level, const char *fmt, ..
 int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge, struct event_base *base);
 int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context, struct event_base *base);
 void mqtt3_bridge_packet_cleanup(struct mosquitto *context);
+int mqtt3_bridge_remap_compile(struct _mqtt3_bridge *bridge);
+void mqtt3_bridge_remap_cleanup(struct _mqtt3_bridge *bridge);
+int mqtt3_bridge_remap_outgoing(struct mosquitto *context, const char *topic, const char **mapped);
+int mqtt3_bridge_remap_incoming(struct mosquitto *context, const char *topic, const char **mapped);
+struct mosquitto *mqtt3_bridge_partition(struct mosquitto *context, const char *topic);
+void mqtt3_bridge_msg_added(struct mosquitto *context, struct mosquitto_client_msg *msg);
+void mqtt3_bridge_msg_removed(struct mosquitto *context, struct mosquitto_client_msg *msg);
 #endif
 
 /* ============================================================
@@ -448,6 +825,7 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload);
 int mosquitto_security_apply(struct mosquitto_db *db);
 int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+int mosquitto_acl_check_hibernated(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated, const char *topic, int access);
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password);
 int mosquitto_psk_key_get(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len);
 
@@ -101,7 +101,12 @@ int output_new_password(FILE *fptr, const char *username, const char *password)
 	unsigned char hash[EVP_MAX_MD_SIZE];
 	unsigned int hash_len;
 	const EVP_MD *digest;
-	EVP_MD_CTX context;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_MD_CTX context_s;
+	EVP_MD_CTX *context = &context_s;
+#else
+	EVP_MD_CTX *context;
+#endif
 	char *pass_salt;
 	int pass_salt_len;
 
@@ -135,11 +140,25 @@ int output_new_password(FILE *fptr, const char *username, const char *password)
 	}
 	memcpy(pass_salt, password, strlen(password));
 	memcpy(pass_salt+strlen(password), salt, SALT_LEN);
-	EVP_MD_CTX_init(&context);
-	EVP_DigestInit_ex(&context, digest, NULL);
-	EVP_DigestUpdate(&context, pass_salt, pass_salt_len);
-	EVP_DigestFinal_ex(&context, hash, &hash_len);
-	EVP_MD_CTX_cleanup(&context);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_MD_CTX_init(context);
+#else
+	context = EVP_MD_CTX_new();
+	if(!context){
+		free(pass_salt);
+		if(salt64) free(salt64);
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+#endif
+	EVP_DigestInit_ex(context, digest, NULL);
+	EVP_DigestUpdate(context, pass_salt, pass_salt_len);
+	EVP_DigestFinal_ex(context, hash, &hash_len);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_MD_CTX_cleanup(context);
+#else
+	EVP_MD_CTX_free(context);
+#endif
 	free(pass_salt);
 
 	rc = base64_encode(hash, hash_len, &hash64);
@@ -219,8 +219,7 @@ int mqtt3_socket_accept(int listensock, short ev, struct mosquitto_funcs_data *a
 		// If we got here then the context's DB index is "i" regardless of how we got here
 		new_context->db_index = i;
 
-  args->context = new_context;
-  event = event_new(base, new_sock, EV_READ|EV_PERSIST, handle_reads_writes, args);
+  event = event_new(base, new_sock, EV_READ|EV_PERSIST, handle_reads_writes, new_context);
   if (!event)
     {
       // can not accept more events
@@ -477,6 +476,10 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 				}
 				X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
 			}
+			if(mqtt3_tls_session_init(listener)){
+				COMPAT_CLOSE(sock);
+				return 1;
+			}
 
 #  ifdef REAL_WITH_TLS_PSK
 		}else if(listener->psk_hint){
@@ -522,6 +525,10 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 					return 1;
 				}
 			}
+			if(mqtt3_tls_session_init(listener)){
+				COMPAT_CLOSE(sock);
+				return 1;
+			}
 #  endif /* REAL_WITH_TLS_PSK */
 		}
 #endif /* WITH_TLS */
@@ -159,6 +159,50 @@ error:
 }
 
 
+/* Only the position of the spool is saved, the segments themselves are
+ * already on disk. */
+static int mqtt3_db_client_spool_write(struct mosquitto_db *db, FILE *db_fptr, const char *id, struct mosquitto_spool *spool)
+{
+	uint32_t length;
+	uint32_t i32temp;
+	uint16_t i16temp, slen;
+
+	assert(db);
+	assert(db_fptr);
+	assert(id);
+	assert(spool);
+
+	if(mqtt3_spool_sync(spool)) return 1;
+
+	slen = strlen(id);
+	length = htonl(sizeof(uint16_t) + slen + 6*sizeof(uint32_t));
+
+	i16temp = htons(DB_CHUNK_CLIENT_SPOOL);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, id, slen);
+	i32temp = htonl(spool->id);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(spool->read_seq);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(spool->read_pos);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(spool->write_seq);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(spool->write_pos);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(spool->count);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
 static int mqtt3_db_message_store_write(struct mosquitto_db *db, FILE *db_fptr)
 {
 	uint32_t length;
@@ -238,12 +282,37 @@ error:
 	return 1;
 }
 
+static int _db_client_chunk_write(FILE *db_fptr, const char *id, uint16_t last_mid, time_t disconnect_t)
+{
+	uint16_t i16temp, slen;
+	uint32_t length;
+
+	length = htonl(2+strlen(id) + sizeof(uint16_t) + sizeof(time_t));
+
+	i16temp = htons(DB_CHUNK_CLIENT);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	slen = strlen(id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, id, slen);
+	i16temp = htons(last_mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &disconnect_t, sizeof(time_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
 static int mqtt3_db_client_write(struct mosquitto_db *db, FILE *db_fptr)
 {
 	int i;
 	struct mosquitto *context;
-	uint16_t i16temp, slen;
-	uint32_t length;
+	struct _clientid_index_hash *cih, *tmp;
+	struct mosquitto_hibernated *hibernated;
 
 	assert(db);
 	assert(db_fptr);
@@ -251,90 +320,91 @@ static int mqtt3_db_client_write(struct mosquitto_db *db, FILE *db_fptr)
 	for(i=0; i<db->context_count; i++){
 		context = db->contexts[i];
 		if(context && context->clean_session == false){
-			length = htonl(2+strlen(context->id) + sizeof(uint16_t) + sizeof(time_t));
-
-			i16temp = htons(DB_CHUNK_CLIENT);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			slen = strlen(context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, context->id, slen);
-			i16temp = htons(context->last_mid);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &(context->disconnect_t), sizeof(time_t));
-
+			if(_db_client_chunk_write(db_fptr, context->id, context->last_mid, mqtt3_context_disconnect_t(context))) return 1;
 			if(mqtt3_db_client_messages_write(db, db_fptr, context)) return 1;
+			if(context->cold && context->cold->spool
+					&& mqtt3_db_client_spool_write(db, db_fptr, context->id, context->cold->spool)) return 1;
 		}
 	}
 
+	/* Hibernated sessions are always persistent and have no in-memory
+	 * messages. */
+	HASH_ITER(hh, db->clientid_index_hash, cih, tmp){
+		hibernated = cih->hibernated;
+		if(!hibernated) continue;
+		if(_db_client_chunk_write(db_fptr, hibernated->id, hibernated->last_mid, hibernated->disconnect_t)) return 1;
+		if(hibernated->spool && mqtt3_db_client_spool_write(db, db_fptr, hibernated->id, hibernated->spool)) return 1;
+	}
+
 	return MOSQ_ERR_SUCCESS;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	return 1;
 }
 
 static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic)
 {
-	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subhier *subhier, *tmp;
 	struct _mosquitto_subleaf *sub;
+	const char *id;
 	char *thistopic;
 	uint32_t length;
 	uint16_t i16temp;
-	dbid_t i64temp;
-	size_t slen;
+	size_t slen, pos, share_len;
+	int i;
 
-	slen = strlen(topic) + strlen(node->topic) + 2;
+	/* The edge leading to node can cover several levels. */
+	slen = strlen(topic) + 1;
+	for(i=0; i<node->level_count; i++){
+		slen += strlen(node->levels[i]) + 1;
+	}
 	thistopic = _mosquitto_malloc(sizeof(char)*slen);
 	if(!thistopic) return MOSQ_ERR_NOMEM;
-	if(strlen(topic)){
-		snprintf(thistopic, slen, "%s/%s", topic, node->topic);
-	}else{
-		snprintf(thistopic, slen, "%s", node->topic);
+	pos = snprintf(thistopic, slen, "%s", topic);
+	for(i=0; i<node->level_count; i++){
+		if(pos){
+			pos += snprintf(&thistopic[pos], slen-pos, "/%s", node->levels[i]);
+		}else{
+			pos += snprintf(&thistopic[pos], slen-pos, "%s", node->levels[i]);
+		}
 	}
 
-	sub = node->subs;
-	while(sub){
-		if(sub->context->clean_session == false){
-			length = htonl(2+strlen(sub->context->id) + 2+strlen(thistopic) + sizeof(uint8_t));
+	for(i=0; i<node->sub_count; i++){
+		sub = &node->subs[i];
+		if(sub->flags & MOSQ_SUBLEAF_HIBERNATED){
+			id = sub->hibernated->id;
+		}else if(sub->context->clean_session == false){
+			id = sub->context->id;
+		}else{
+			id = NULL;
+		}
+		if(id){
+			/* Shared subscriptions are saved as $share/<group>/<topic>. */
+			share_len = sub->share ? strlen("$share/") + strlen(sub->share->name) + 1 : 0;
+			length = htonl(2+strlen(id) + 2+share_len+strlen(thistopic) + sizeof(uint8_t));
 
 			i16temp = htons(DB_CHUNK_SUB);
 			write_e(db_fptr, &i16temp, sizeof(uint16_t));
 			write_e(db_fptr, &length, sizeof(uint32_t));
 
-			slen = strlen(sub->context->id);
+			slen = strlen(id);
 			i16temp = htons(slen);
 			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, sub->context->id, slen);
+			write_e(db_fptr, id, slen);
 
 			slen = strlen(thistopic);
-			i16temp = htons(slen);
+			i16temp = htons(share_len + slen);
 			write_e(db_fptr, &i16temp, sizeof(uint16_t));
+			if(sub->share){
+				write_e(db_fptr, "$share/", strlen("$share/"));
+				write_e(db_fptr, sub->share->name, strlen(sub->share->name));
+				write_e(db_fptr, "/", 1);
+			}
 			write_e(db_fptr, thistopic, slen);
 
 			write_e(db_fptr, &sub->qos, sizeof(uint8_t));
 		}
-		sub = sub->next;
 	}
-	if(node->retained){
-		if(strncmp(node->retained->msg.topic, "$SYS", 4)){
-			/* Don't save $SYS messages. */
-			length = htonl(sizeof(dbid_t));
-
-			i16temp = htons(DB_CHUNK_RETAIN);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
 
-			i64temp = node->retained->db_id;
-			write_e(db_fptr, &i64temp, sizeof(dbid_t));
-		}
-	}
-
-	subhier = node->children;
-	while(subhier){
+	HASH_ITER(hh, node->children, subhier, tmp){
 		_db_subs_retain_write(db, db_fptr, subhier, thistopic);
-		subhier = subhier->next;
 	}
 	_mosquitto_free(thistopic);
 	return MOSQ_ERR_SUCCESS;
@@ -343,20 +413,44 @@ error:
 	return 1;
 }
 
+static int _db_retain_write(struct mosquitto_db *db, struct mosquitto_msg_store *stored, void *userdata)
+{
+	FILE *db_fptr = userdata;
+	uint32_t length;
+	uint16_t i16temp;
+	dbid_t i64temp;
+
+	if(!strncmp(stored->msg.topic, "$SYS", 4)){
+		/* Don't save $SYS messages. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	length = htonl(sizeof(dbid_t));
+
+	i16temp = htons(DB_CHUNK_RETAIN);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i64temp = stored->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
 static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr)
 {
-	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subhier *subhier, *tmp;
 
-	subhier = db->subs.children;
-	while(subhier){
+	HASH_ITER(hh, db->subs.children, subhier, tmp){
 		_db_subs_retain_write(db, db_fptr, subhier, "");
-		subhier = subhier->next;
 	}
 
-	return MOSQ_ERR_SUCCESS;
+	return mqtt3_retain_foreach(db, _db_retain_write, db_fptr);
 }
 
-int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
+int mqtt3_db_backup(struct mosquitto_db *db, bool shutdown)
 {
 	int rc = 0;
 	FILE *db_fptr = NULL;
@@ -372,9 +466,6 @@ int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
 
 	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
-	if(cleanup){
-		mqtt3_db_store_clean(db);
-	}
 
 	len = strlen(db->config->persistence_filepath)+5;
 	outfile = _mosquitto_calloc(len+1, 1);
@@ -434,9 +525,10 @@ error:
 
 static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
 {
-	struct mosquitto_client_msg *cmsg, *tail;
+	struct mosquitto_client_msg *cmsg;
 	struct mosquitto_msg_store *store;
 	struct mosquitto *context;
+	struct mosquitto_cold *cold;
 
 	cmsg = _mosquitto_calloc(1, sizeof(struct mosquitto_client_msg));
 	if(!cmsg){
@@ -452,14 +544,10 @@ static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id
 	cmsg->state = state;
 	cmsg->dup = dup;
 
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			cmsg->store = store;
-			cmsg->store->ref_count++;
-			break;
-		}
-		store = store->next;
+	store = mqtt3_db_msg_store_lookup(db, store_id);
+	if(store){
+		cmsg->store = store;
+		cmsg->store->ref_count++;
 	}
 	if(!cmsg->store){
 		_mosquitto_free(cmsg);
@@ -472,15 +560,28 @@ static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
 		return 1;
 	}
-	if(context->msgs){
-		tail = context->msgs;
-		while(tail->next){
-			tail = tail->next;
-		}
-		tail->next = cmsg;
+	cold = mqtt3_context_cold(context);
+	if(!cold){
+		mqtt3_db_msg_store_deref(db, cmsg->store);
+		_mosquitto_free(cmsg);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	if(cold->last_msg){
+		cold->last_msg->next = cmsg;
 	}else{
 		context->msgs = cmsg;
 	}
+	cold->last_msg = cmsg;
+	cold->msg_count++;
+	if(cmsg->qos > 0){
+		cold->msg_count12++;
+	}
+	if(cmsg->state == mosq_ms_queued){
+		cold->msg_queued++;
+	}else if(cmsg->direction == mosq_md_out && cmsg->qos > 0){
+		cold->msg_inflight++;
+	}
 	cmsg->next = NULL;
 
 	return MOSQ_ERR_SUCCESS;
@@ -492,6 +593,7 @@ static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 	char *client_id = NULL;
 	int rc = 0;
 	struct mosquitto *context;
+	struct mosquitto_cold *cold;
 	time_t disconnect_t;
 	struct _clientid_index_hash *new_cih;
 
@@ -520,8 +622,8 @@ static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 	}
 
 	context = _db_find_or_add_context(db, client_id, last_mid);
-	if(context){
-		context->disconnect_t = disconnect_t;
+	if(context && (cold = mqtt3_context_cold(context))){
+		cold->disconnect_t = disconnect_t;
 	}else{
 		rc = 1;
 	}
@@ -534,8 +636,8 @@ static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		new_cih->id = context->id;
 		new_cih->db_context_index = context->db_index;
+		new_cih->hibernated = NULL;
 		HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
 	}
 	return rc;
@@ -546,6 +648,62 @@ error:
 	return 1;
 }
 
+static int _db_client_spool_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+	struct mosquitto_spool saved;
+	struct _clientid_index_hash *find_cih;
+	uint32_t i32temp;
+	uint16_t i16temp, slen;
+	char *client_id = NULL;
+	int rc = 0;
+
+	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	if(!slen){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+		fclose(db_fptr);
+		return 1;
+	}
+	client_id = _mosquitto_calloc(slen+1, sizeof(char));
+	if(!client_id){
+		fclose(db_fptr);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	read_e(db_fptr, client_id, slen);
+
+	memset(&saved, 0, sizeof(struct mosquitto_spool));
+	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	saved.id = ntohl(i32temp);
+	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	saved.read_seq = ntohl(i32temp);
+	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	saved.read_pos = ntohl(i32temp);
+	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	saved.write_seq = ntohl(i32temp);
+	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	saved.write_pos = ntohl(i32temp);
+	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	saved.count = ntohl(i32temp);
+
+	if(db->config->queue_spill_threshold <= 0 || !db->config->queue_spill_location){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Client %s has %u messages spilled to disk but queue spilling is not configured, discarding them.",
+				client_id, saved.count);
+	}else{
+		HASH_FIND_STR(db->clientid_index_hash, client_id, find_cih);
+		if(find_cih){
+			rc = mqtt3_spool_restore(db, db->contexts[find_cih->db_context_index], &saved);
+		}
+	}
+	_mosquitto_free(client_id);
+	return rc;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	fclose(db_fptr);
+	if(client_id) _mosquitto_free(client_id);
+	return 1;
+}
+
 static int _db_client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 {
 	dbid_t i64temp, store_id;
@@ -690,13 +848,9 @@ static int _db_retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 		return 1;
 	}
 	store_id = i64temp;
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
-			break;
-		}
-		store = store->next;
+	store = mqtt3_db_msg_store_lookup(db, store_id);
+	if(store){
+		mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
 	}
 	return MOSQ_ERR_SUCCESS;
 }
@@ -759,6 +913,21 @@ error:
 	return 1;
 }
 
+/* Each restored message starts with the reference that mqtt3_db_message_store()
+ * gives its creator. Drop those now that the client and retained chunks have
+ * taken their own, which frees anything nothing refers to any more. */
+static void _db_restore_release(struct mosquitto_db *db)
+{
+	struct mosquitto_msg_store *store, *next;
+
+	store = db->msg_store;
+	while(store){
+		next = store->next;
+		mqtt3_db_msg_store_deref(db, store);
+		store = next;
+	}
+}
+
 int mqtt3_db_restore(struct mosquitto_db *db)
 {
 	FILE *fptr;
@@ -836,6 +1005,10 @@ int mqtt3_db_restore(struct mosquitto_db *db)
 					if(_db_client_chunk_restore(db, fptr)) return 1;
 					break;
 
+				case DB_CHUNK_CLIENT_SPOOL:
+					if(_db_client_spool_chunk_restore(db, fptr)) return 1;
+					break;
+
 				default:
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
 					fseek(fptr, length, SEEK_CUR);
@@ -849,6 +1022,7 @@ int mqtt3_db_restore(struct mosquitto_db *db)
 	}
 
 	fclose(fptr);
+	_db_restore_release(db);
 
 	return rc;
 error:
@@ -0,0 +1,308 @@
+/*
+Copyright (c) 2009-2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Token bucket limits on how fast the broker reads from clients, set per
+ * listener with rate_limit_listener, rate_limit_user and rate_limit_client.
+ *
+ * Each packet is charged to the buckets of its client once it has been
+ * handled: one message for a PUBLISH, and its length in bytes for any packet.
+ * A client that takes one of its buckets to zero or below isn't read from
+ * again until all of them have refilled, so its messages wait in the socket
+ * rather than being dropped and everyone else keeps being served. Buckets
+ * refill continuously and hold at most one second's worth of tokens. They
+ * are refilled when charged and, for paused clients, from a timer in the main
+ * loop.
+ *
+ * User and client buckets are looked up by username and client id, so a
+ * client that disconnects and comes straight back gets the bucket it left.
+ * Once a bucket has no clients it is kept until it has refilled, at which
+ * point a new one would be no different.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <time_mosq.h>
+
+#ifdef WITH_SYS_TREE
+extern unsigned long g_clients_throttled;
+#endif
+
+static bool _rate_set(const struct mqtt3_rate_limit *limit)
+{
+	return limit->messages > 0 || limit->bytes > 0;
+}
+
+/* Tokens are in thousandths, so a rate per second times the milliseconds
+ * elapsed is exactly what to add. */
+static void _bucket_refill(struct mosquitto_bucket *bucket, const struct mqtt3_rate_limit *limit, uint64_t now)
+{
+	uint64_t elapsed;
+
+	if(!bucket->refill_ms){
+		bucket->messages = (int64_t)limit->messages*1000;
+		bucket->bytes = (int64_t)limit->bytes*1000;
+		bucket->refill_ms = now;
+		return;
+	}
+	elapsed = now - bucket->refill_ms;
+	if(!elapsed) return;
+	if(elapsed > 1000) elapsed = 1000;
+	bucket->refill_ms = now;
+
+	bucket->messages += (int64_t)limit->messages*elapsed;
+	if(bucket->messages > (int64_t)limit->messages*1000){
+		bucket->messages = (int64_t)limit->messages*1000;
+	}
+	bucket->bytes += (int64_t)limit->bytes*elapsed;
+	if(bucket->bytes > (int64_t)limit->bytes*1000){
+		bucket->bytes = (int64_t)limit->bytes*1000;
+	}
+}
+
+static bool _bucket_empty(const struct mosquitto_bucket *bucket, const struct mqtt3_rate_limit *limit)
+{
+	return (limit->messages > 0 && bucket->messages <= 0)
+		|| (limit->bytes > 0 && bucket->bytes <= 0);
+}
+
+/* Returns true if the bucket is now empty. */
+static bool _bucket_charge(struct mosquitto_bucket *bucket, const struct mqtt3_rate_limit *limit, uint64_t now, int messages, uint32_t bytes)
+{
+	_bucket_refill(bucket, limit, now);
+	if(limit->messages > 0) bucket->messages -= (int64_t)messages*1000;
+	if(limit->bytes > 0) bucket->bytes -= (int64_t)bytes*1000;
+	return _bucket_empty(bucket, limit);
+}
+
+static bool _bucket_full(const struct mosquitto_bucket *bucket, const struct mqtt3_rate_limit *limit)
+{
+	return bucket->messages >= (int64_t)limit->messages*1000
+		&& bucket->bytes >= (int64_t)limit->bytes*1000;
+}
+
+static struct mosquitto_shared_bucket *_shared_bucket_get(struct mosquitto_shared_bucket **buckets, struct _mqtt3_listener *listener, const char *key)
+{
+	struct mosquitto_shared_bucket *shared;
+
+	HASH_FIND_STR(*buckets, key, shared);
+	if(!shared){
+		shared = _mosquitto_calloc(1, sizeof(struct mosquitto_shared_bucket));
+		if(!shared) return NULL;
+		shared->key = _mosquitto_strdup(key);
+		if(!shared->key){
+			_mosquitto_free(shared);
+			return NULL;
+		}
+		shared->listener = listener;
+		HASH_ADD_KEYPTR(hh, *buckets, shared->key, strlen(shared->key), shared);
+	}
+	shared->ref_count++;
+	return shared;
+}
+
+static void _shared_bucket_free(struct mosquitto_shared_bucket **buckets, struct mosquitto_shared_bucket *shared)
+{
+	HASH_DEL(*buckets, shared);
+	_mosquitto_free(shared->key);
+	_mosquitto_free(shared);
+}
+
+/* Drop a client's share of a bucket. The last client to leave frees it only
+ * if it is full, otherwise it is left for mqtt3_rate_resume() to free once it
+ * has refilled. */
+static void _shared_bucket_put(struct mosquitto_shared_bucket **buckets, struct mosquitto_shared_bucket *shared, const struct mqtt3_rate_limit *limit, uint64_t now)
+{
+	shared->ref_count--;
+	if(shared->ref_count > 0) return;
+
+	_bucket_refill(&shared->bucket, limit, now);
+	if(_bucket_full(&shared->bucket, limit)){
+		_shared_bucket_free(buckets, shared);
+	}else{
+		shared->listener->buckets_released = true;
+	}
+}
+
+/* Free the buckets without clients that have refilled. Returns true if any
+ * are still refilling. */
+static bool _shared_buckets_sweep(struct mosquitto_shared_bucket **buckets, const struct mqtt3_rate_limit *limit, uint64_t now)
+{
+	struct mosquitto_shared_bucket *shared, *tmp;
+	bool released = false;
+
+	HASH_ITER(hh, *buckets, shared, tmp){
+		if(shared->ref_count > 0) continue;
+
+		_bucket_refill(&shared->bucket, limit, now);
+		if(_bucket_full(&shared->bucket, limit)){
+			_shared_bucket_free(buckets, shared);
+		}else{
+			released = true;
+		}
+	}
+	return released;
+}
+
+/* Whether any bucket context draws on is still empty. */
+static bool _rate_over(struct mosquitto *context, uint64_t now)
+{
+	struct _mqtt3_listener *listener = context->listener;
+	struct mosquitto_cold *cold = context->cold;
+	bool over = false;
+
+	if(!listener) return false;
+
+	if(_rate_set(&listener->rate_listener)){
+		_bucket_refill(&listener->bucket, &listener->rate_listener, now);
+		over |= _bucket_empty(&listener->bucket, &listener->rate_listener);
+	}
+	if(cold && cold->rate_user){
+		_bucket_refill(&cold->rate_user->bucket, &listener->rate_user, now);
+		over |= _bucket_empty(&cold->rate_user->bucket, &listener->rate_user);
+	}
+	if(cold && cold->rate_client){
+		_bucket_refill(&cold->rate_client->bucket, &listener->rate_client, now);
+		over |= _bucket_empty(&cold->rate_client->bucket, &listener->rate_client);
+	}
+	return over;
+}
+
+void mqtt3_rate_charge(struct mosquitto_db *db, struct mosquitto *context, uint32_t bytes, bool publish)
+{
+	struct _mqtt3_listener *listener = context->listener;
+	struct mosquitto_cold *cold;
+	uint64_t now = mosquitto_time_ms();
+	int messages = publish ? 1 : 0;
+	bool over = false;
+
+	if(!listener || !listener->rate_limited) return;
+
+	if(_rate_set(&listener->rate_listener)){
+		over |= _bucket_charge(&listener->bucket, &listener->rate_listener, now, messages, bytes);
+	}
+	if(_rate_set(&listener->rate_user) && context->username){
+		cold = mqtt3_context_cold(context);
+		if(!cold) return;
+		if(!cold->rate_user){
+			cold->rate_user = _shared_bucket_get(&listener->user_buckets, listener, context->username);
+			if(!cold->rate_user) return;
+		}
+		over |= _bucket_charge(&cold->rate_user->bucket, &listener->rate_user, now, messages, bytes);
+	}
+	if(_rate_set(&listener->rate_client) && context->id){
+		cold = mqtt3_context_cold(context);
+		if(!cold) return;
+		if(!cold->rate_client){
+			cold->rate_client = _shared_bucket_get(&listener->client_buckets, listener, context->id);
+			if(!cold->rate_client) return;
+		}
+		over |= _bucket_charge(&cold->rate_client->bucket, &listener->rate_client, now, messages, bytes);
+	}
+
+	if(over && !context->rate_paused){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Client %s is over its rate limit, pausing reads.", context->id);
+		mqtt3_event_rate_set(context, false);
+		db->rates_paused = true;
+#ifdef WITH_SYS_TREE
+		g_clients_throttled++;
+#endif
+	}
+}
+
+void mqtt3_rate_resume(struct mosquitto_db *db)
+{
+	struct _mqtt3_listener *listener;
+	struct mosquitto *context;
+	uint64_t now = mosquitto_time_ms();
+	bool paused = false;
+	bool released;
+	int i;
+
+	for(i=0; i<db->config->listener_count; i++){
+		listener = &db->config->listeners[i];
+		if(!listener->buckets_released) continue;
+
+		released = _shared_buckets_sweep(&listener->user_buckets, &listener->rate_user, now);
+		released |= _shared_buckets_sweep(&listener->client_buckets, &listener->rate_client, now);
+		listener->buckets_released = released;
+	}
+
+	if(!db->rates_paused) return;
+
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context || !context->rate_paused) continue;
+
+		if(context->sock == INVALID_SOCKET || !_rate_over(context, now)){
+			mqtt3_event_rate_set(context, true);
+		}else{
+			paused = true;
+		}
+	}
+	db->rates_paused = paused;
+}
+
+/* Drop context's share of its username and client id buckets, when it
+ * disconnects. */
+void mqtt3_rate_release(struct mosquitto *context)
+{
+	struct mosquitto_cold *cold = context->cold;
+	struct _mqtt3_listener *listener;
+	uint64_t now;
+
+	if(!cold || (!cold->rate_user && !cold->rate_client)) return;
+
+	now = mosquitto_time_ms();
+	if(cold->rate_user){
+		listener = cold->rate_user->listener;
+		_shared_bucket_put(&listener->user_buckets, cold->rate_user, &listener->rate_user, now);
+		cold->rate_user = NULL;
+	}
+	if(cold->rate_client){
+		listener = cold->rate_client->listener;
+		_shared_bucket_put(&listener->client_buckets, cold->rate_client, &listener->rate_client, now);
+		cold->rate_client = NULL;
+	}
+}
+
+void mqtt3_rate_cleanup(struct _mqtt3_listener *listener)
+{
+	struct mosquitto_shared_bucket *shared, *tmp;
+
+	HASH_ITER(hh, listener->user_buckets, shared, tmp){
+		_shared_bucket_free(&listener->user_buckets, shared);
+	}
+	HASH_ITER(hh, listener->client_buckets, shared, tmp){
+		_shared_bucket_free(&listener->client_buckets, shared);
+	}
+}
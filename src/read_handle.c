@@ -90,7 +90,9 @@ int mqtt3_packet_handle(struct mosquitto_db *db, struct mosquitto *context)
 int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char *topic;
-	void *payload = NULL;
+	uint16_t slen;
+	uint32_t topic_len;
+	const void *payload = NULL;
 	uint32_t payloadlen;
 	uint8_t dup, qos, retain;
 	uint16_t mid = 0;
@@ -99,83 +101,42 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	int res = 0;
 	struct mosquitto_msg_store *stored = NULL;
 	int len;
+	int mount_len;
 	char *topic_mount;
-	char *topic_temp;
-	int i;
-	struct _mqtt3_bridge_topic *cur_topic;
-	bool match;
+	struct mosquitto_cold *cold;
+	const char *pub_topic; /* topic after any bridge remapping and mounting */
+	uint64_t out_queued = db->out_queued; /* to see what this message queued */
 
 	dup = (header & 0x08)>>3;
 	qos = (header & 0x06)>>1;
 	retain = (header & 0x01);
 
-	if(_mosquitto_read_string(&context->in_packet, &topic)) return 1;
-	if(strlen(topic) == 0){
+	/* The topic is borrowed from the packet, it is copied only if the
+	 * message ends up being stored. */
+	if(_mosquitto_read_string_borrow(&context->in_packet, &topic, &slen)) return 1;
+	topic_len = slen;
+	/* Checks for wildcards, NULs and bad UTF-8 and collapses repeated
+	 * slashes, all in one pass. */
+	if(_mosquitto_pub_topic_check(topic, &topic_len) || topic_len == 0){
 		/* Invalid publish topic, disconnect client. */
-		_mosquitto_free(topic);
-		return 1;
-	}
-	if(_mosquitto_fix_sub_topic(&topic)){
-		_mosquitto_free(topic);
-		return 1;
-	}
-	if(!strlen(topic)){
-		_mosquitto_free(topic);
 		return 1;
 	}
 
+	pub_topic = topic;
+#ifdef WITH_BRIDGE
 	if(context->bridge && context->bridge->topics && context->bridge->topic_remapping){
-		for(i=0; i<context->bridge->topic_count; i++){
-			cur_topic = &context->bridge->topics[i];
-			if(cur_topic->remote_prefix || cur_topic->local_prefix){
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->remote_topic, topic, &match);
-				if(rc){
-					_mosquitto_free(topic);
-					return rc;
-				}
-				if(match){
-					if(cur_topic->remote_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->remote_prefix, topic, strlen(cur_topic->remote_prefix))){
-							topic_temp = _mosquitto_strdup(topic+strlen(cur_topic->remote_prefix));
-							if(!topic_temp){
-								_mosquitto_free(topic);
-								return MOSQ_ERR_NOMEM;
-							}
-							_mosquitto_free(topic);
-							topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->local_prefix){
-						/* This prefix needs adding. */
-						len = strlen(topic) + strlen(cur_topic->local_prefix)+1;
-						topic_temp = _mosquitto_calloc(len+1, sizeof(char));
-						if(!topic_temp){
-							_mosquitto_free(topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->local_prefix, topic);
-						_mosquitto_free(topic);
-						topic = topic_temp;
-					}
-					break;
-				}
-			}
-		}
+		rc = mqtt3_bridge_remap_incoming(context, topic, &pub_topic);
+		if(rc) return rc;
 	}
+#endif
 
-	if(_mosquitto_topic_wildcard_len_check(topic) != MOSQ_ERR_SUCCESS){
-		/* Invalid publish topic, just swallow it. */
-		_mosquitto_free(topic);
+	if(pub_topic != topic && _mosquitto_topic_wildcard_len_check(pub_topic) != MOSQ_ERR_SUCCESS){
+		/* Remapped topic is invalid, just swallow it. */
 		return 1;
 	}
 
 	if(qos > 0){
 		if(_mosquitto_read_uint16(&context->in_packet, &mid)){
-			_mosquitto_free(topic);
 			return 1;
 		}
 	}
@@ -185,56 +146,75 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	g_pub_bytes_received += payloadlen;
 #endif
 	if(context->listener && context->listener->mount_point){
-		len = strlen(context->listener->mount_point) + strlen(topic) + 1;
-		topic_mount = _mosquitto_calloc(len, sizeof(char));
-		if(!topic_mount){
-			_mosquitto_free(topic);
+		/* Build the mounted topic in the context's scratch buffer, which is
+		 * kept for the next PUBLISH. */
+		mount_len = strlen(context->listener->mount_point);
+		len = mount_len + (pub_topic == topic ? topic_len : strlen(pub_topic)) + 1;
+		cold = mqtt3_context_cold(context);
+		if(!cold){
 			return MOSQ_ERR_NOMEM;
 		}
-		snprintf(topic_mount, len, "%s%s", context->listener->mount_point, topic);
-		_mosquitto_free(topic);
-		topic = topic_mount;
+		if(len > cold->topic_buf_len){
+			topic_mount = _mosquitto_realloc(cold->topic_buf, len);
+			if(!topic_mount){
+				return MOSQ_ERR_NOMEM;
+			}
+			cold->topic_buf = topic_mount;
+			cold->topic_buf_len = len;
+		}
+		memcpy(cold->topic_buf, context->listener->mount_point, mount_len);
+		memcpy(&cold->topic_buf[mount_len], pub_topic, len - mount_len);
+		pub_topic = cold->topic_buf;
 	}
 
   // 分配空间，写buffer
 	if(payloadlen){
 		if(db->config->message_size_limit && payloadlen > db->config->message_size_limit){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped too large PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped too large PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, pub_topic, (long)payloadlen);
 			goto process_bad_message;
 		}
-		payload = _mosquitto_calloc(payloadlen+1, sizeof(uint8_t));
-		if(!payload){
-			_mosquitto_free(topic);
-			return 1;
-		}
-		if(_mosquitto_read_bytes(&context->in_packet, payload, payloadlen)){
-			_mosquitto_free(topic);
-			_mosquitto_free(payload);
-			return 1;
-		}
+		/* The payload is used straight from the packet, a copy is only made
+		 * if the message ends up being stored. */
+		payload = &context->in_packet.payload[context->in_packet.pos];
+		context->in_packet.pos += payloadlen;
 	}
 
 	/* Check for topic access */
-	rc = mosquitto_acl_check(db, context, topic, MOSQ_ACL_WRITE);
+	rc = mosquitto_acl_check(db, context, pub_topic, MOSQ_ACL_WRITE);
 	if(rc == MOSQ_ERR_ACL_DENIED){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, pub_topic, (long)payloadlen);
 		goto process_bad_message;
 	}else if(rc != MOSQ_ERR_SUCCESS){
-		_mosquitto_free(topic);
-		if(payload) _mosquitto_free(payload);
 		return rc;
 	}
 
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, pub_topic, (long)payloadlen);
+	if(qos < 2 && !retain){
+		/* Find the subscribers before storing anything, a message that
+		 * nobody is going to receive can be dropped here. */
+		if(mqtt3_sub_match(db, pub_topic)){
+			return 1;
+		}
+		if(db->sub_match_count == 0){
+			res = MOSQ_ERR_SUCCESS;
+		}else{
+			res = mqtt3_sub_deliver_direct(db, context->id, pub_topic, qos, payloadlen, payload);
+		}
+		if(res != -1){
+			if(res) rc = 1;
+			if(qos == 1 && _mosquitto_send_puback(context, mid)) rc = 1;
+			mqtt3_out_bytes_check(db, context, out_queued);
+			return rc;
+		}
+		res = 0;
+	}
   // TODO 对qos>0的情况再看下
 	if(qos > 0){
 		mqtt3_db_message_store_find(context, mid, &stored);
 	}
 	if(!stored){
 		dup = 0;
-		if(mqtt3_db_message_store(db, context->id, mid, topic, qos, payloadlen, payload, retain, &stored, 0)){
-			_mosquitto_free(topic);
-			if(payload) _mosquitto_free(payload);
+		if(mqtt3_db_message_store(db, context->id, mid, pub_topic, qos, payloadlen, payload, retain, &stored, 0)){
 			return 1;
 		}
 	}else{
@@ -242,11 +222,14 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	}
 	switch(qos){
 		case 0:
-			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
-			break;
 		case 1:
-			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
-			if(_mosquitto_send_puback(context, mid)) rc = 1;
+			if(retain){
+				if(mqtt3_db_messages_queue(db, context->id, pub_topic, qos, retain, stored)) rc = 1;
+			}else{
+				/* Already matched above. */
+				if(mqtt3_sub_deliver(db, context->id, pub_topic, qos, retain, stored)) rc = 1;
+			}
+			if(qos == 1 && _mosquitto_send_puback(context, mid)) rc = 1;
 			break;
 		case 2:
 			if(!dup){
@@ -263,13 +246,15 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 			}
 			break;
 	}
-	_mosquitto_free(topic);
-	if(payload) _mosquitto_free(payload);
+	if(!dup){
+		/* Release the reference taken when the message was stored, the
+		 * queues now hold their own. */
+		mqtt3_db_msg_store_deref(db, stored);
+	}
+	mqtt3_out_bytes_check(db, context, out_queued);
 
 	return rc;
 process_bad_message:
-	_mosquitto_free(topic);
-	if(payload) _mosquitto_free(payload);
 	switch(qos){
 		case 0:
 			return MOSQ_ERR_SUCCESS;
@@ -282,6 +267,7 @@ process_bad_message:
 					return 1;
 				}
 				res = mqtt3_db_message_insert(db, context, mid, mosq_md_in, qos, false, stored);
+				mqtt3_db_msg_store_deref(db, stored);
 			}else{
 				res = 0;
 			}
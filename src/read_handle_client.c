@@ -94,8 +94,12 @@ int mqtt3_handle_connack(struct mosquitto_db *db, struct mosquitto *context)
 				}// end of bridge notifications
 
         // broker之间的订阅处理机制，画个图可能好理解点
+				/* Extra connections of a multi-connection bridge only carry
+				 * outgoing messages, so don't subscribe to anything remotely
+				 * on them or incoming messages would arrive more than once. */
 				for(i=0; i<context->bridge->topic_count; i++){
-					if(context->bridge->topics[i].direction == bd_in || context->bridge->topics[i].direction == bd_both){
+					if(context->bridge->partition == 0
+							&& (context->bridge->topics[i].direction == bd_in || context->bridge->topics[i].direction == bd_both)){
 						if(_mosquitto_send_subscribe(context, NULL, false, context->bridge->topics[i].remote_topic, context->bridge->topics[i].qos)){
 							return 1;
 						}
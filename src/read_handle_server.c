@@ -49,7 +49,8 @@ extern unsigned int g_connection_count;
 // 存在优化的空间
 int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 {
-	char *protocol_name = NULL;
+	const char *protocol_name;
+	uint16_t protocol_name_len;
 	uint8_t protocol_version;
 	uint8_t connect_flags;
 	char *client_id = NULL;
@@ -61,7 +62,6 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	char *username = NULL, *password = NULL;
 	int i;
 	int rc;
-	struct _mosquitto_acl_user *acl_tail;
 	int slen;
 #ifdef WITH_TLS
 	X509 *client_cert;
@@ -70,6 +70,8 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 #endif
 	struct _clientid_index_hash *find_cih;
 	struct _clientid_index_hash *new_cih;
+	struct mosquitto_cold *cold;
+	uint32_t taken_over_len = 0;
 
 #ifdef WITH_SYS_TREE
 	g_connection_count++;
@@ -82,24 +84,18 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 
   // 下面是对connect包逐个字节的校验合法性
-	if(_mosquitto_read_string(&context->in_packet, &protocol_name)){
+	if(_mosquitto_read_string_view(&context->in_packet, &protocol_name, &protocol_name_len)){
 		mqtt3_context_disconnect(db, context);
 		return 1;
 	}
-	if(!protocol_name){
-		mqtt3_context_disconnect(db, context);
-		return 3;
-	}
-	if(strcmp(protocol_name, PROTOCOL_NAME)){
+	if(protocol_name_len != strlen(PROTOCOL_NAME) || memcmp(protocol_name, PROTOCOL_NAME, protocol_name_len)){
 		if(db->config->connection_messages == true){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid protocol \"%s\" in CONNECT from %s.",
-					protocol_name, context->address);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid protocol \"%.*s\" in CONNECT from %s.",
+					protocol_name_len, protocol_name, context->address);
 		}
-		_mosquitto_free(protocol_name);
 		mqtt3_context_disconnect(db, context);
 		return MOSQ_ERR_PROTOCOL;
 	}
-	_mosquitto_free(protocol_name);
 
 	if(_mosquitto_read_byte(&context->in_packet, &protocol_version)){
 		mqtt3_context_disconnect(db, context);
@@ -267,7 +263,11 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 				goto handle_connect_error;
 			}
 			name_entry = X509_NAME_get_entry(name, i);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
 			context->username = _mosquitto_strdup((char *)ASN1_STRING_data(name_entry->value));
+#else
+			context->username = _mosquitto_strdup((const char *)ASN1_STRING_get0_data(X509_NAME_ENTRY_get_data(name_entry)));
+#endif
 			if(!context->username){
 				rc = MOSQ_ERR_SUCCESS;
 				goto handle_connect_error;
@@ -303,8 +303,16 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 #endif
 
+	mqtt3_db_inflight_init(context);
+
 	/* Find if this client already has an entry. This must be done *after* any security checks. */
 	HASH_FIND_STR(db->clientid_index_hash, client_id, find_cih);
+	if(find_cih && find_cih->hibernated && !mqtt3_context_wake(db, find_cih->hibernated)){
+		_mosquitto_send_connack(context, CONNACK_REFUSED_SERVER_UNAVAILABLE);
+		mqtt3_context_disconnect(db, context);
+		rc = MOSQ_ERR_NOMEM;
+		goto handle_connect_error;
+	}
 	if(find_cih){
 		i = find_cih->db_context_index;
 		/* Found a matching client */
@@ -322,11 +330,12 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		db->contexts[i]->state = mosq_cs_connected;
 		db->contexts[i]->address = _mosquitto_strdup(context->address);
 		db->contexts[i]->sock = context->sock;
+		mqtt3_event_move(context, db->contexts[i]);
 		db->contexts[i]->listener = context->listener;
+		mqtt3_db_inflight_init(db->contexts[i]);
 		db->contexts[i]->last_msg_in = mosquitto_time();
 		db->contexts[i]->last_msg_out = mosquitto_time();
 		db->contexts[i]->keepalive = context->keepalive;
-		db->contexts[i]->pollfd_index = context->pollfd_index;
 #ifdef WITH_TLS
 		db->contexts[i]->ssl = context->ssl;
 #endif
@@ -338,6 +347,7 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		context->ssl = NULL;
 #endif
 		context->state = mosq_cs_disconnecting;
+		taken_over_len = 1 + context->in_packet.remaining_count + context->in_packet.remaining_length;
 		context = db->contexts[i];
 		if(context->msgs){
 			mqtt3_db_message_reconnect_reset(context); //把积压的消息状态改变
@@ -349,7 +359,25 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	context->id = client_id;
 	client_id = NULL;
 	context->clean_session = clean_session;
-	context->ping_t = 0;
+	if(context->listener && context->listener->conflate_messages){
+		cold = mqtt3_context_cold(context);
+		if(!cold){
+			mqtt3_context_disconnect(db, context);
+			rc = MOSQ_ERR_NOMEM;
+			goto handle_connect_error;
+		}
+		cold->conflate = true;
+	}else if(context->cold){
+		context->cold->conflate = false;
+	}
+	if(context->cold && context->cold->spool){
+		/* Start reading back the messages spilled while offline. */
+		rc = mqtt3_db_spool_refill(db, context);
+		if(rc){
+			mqtt3_context_disconnect(db, context);
+			goto handle_connect_error;
+		}
+	}
 
 	// Add the client ID to the DB hash table here
 	new_cih = _mosquitto_malloc(sizeof(struct _clientid_index_hash));
@@ -359,8 +387,8 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		rc = MOSQ_ERR_NOMEM;
 		goto handle_connect_error;
 	}
-	new_cih->id = context->id;
 	new_cih->db_context_index = context->db_index;
+	new_cih->hibernated = NULL;
 	HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
 
 #ifdef WITH_PERSISTENCE
@@ -368,26 +396,7 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		db->persistence_changes++;
 	}
 #endif
-	/* Associate user with its ACL, assuming we have ACLs loaded. */
-	if(db->acl_list){
-		acl_tail = db->acl_list;
-		while(acl_tail){
-			if(context->username){
-				if(acl_tail->username && !strcmp(context->username, acl_tail->username)){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}else{
-				if(acl_tail->username == NULL){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}
-			acl_tail = acl_tail->next;
-		}
-	}else{
-		context->acl_list = NULL;
-	}
+	mqtt3_context_acl_set(db, context);
 
 	if(will_struct){
 		if(mosquitto_acl_check(db, context, will_topic, MOSQ_ACL_WRITE) != MOSQ_ERR_SUCCESS){
@@ -413,6 +422,13 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New client connected from %s as %s (c%d, k%d).", context->address, context->id, context->clean_session, context->keepalive);
 	}
 
+	if(taken_over_len){
+		/* The caller charges the CONNECT to the context it was read on,
+		 * which no longer has the socket. Charge it here instead, so that a
+		 * client coming back in debt to its rate limit isn't read from. */
+		mqtt3_rate_charge(db, context, taken_over_len, false);
+	}
+
 	context->state = mosq_cs_connected;
 	return _mosquitto_send_connack(context, CONNACK_ACCEPTED);
 
@@ -447,89 +463,85 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 	int rc2;
 	uint16_t mid;
 	char *sub;
+	uint16_t slen;
 	uint8_t qos;
-	uint8_t *payload = NULL, *tmp_payload;
+	uint8_t *payload;
 	uint32_t payloadlen = 0;
 	int len;
 	char *sub_mount;
+	bool shared;
+	const char *group, *filter;
+	int group_len;
 
 	if(!context) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received SUBSCRIBE from %s", context->id);
-	/* FIXME - plenty of potential for memory leaks here */
 
 	if(_mosquitto_read_uint16(&context->in_packet, &mid)) return 1;
 
+	/* The granted QoS of each topic is written back over the start of the
+	 * packet, which has already been read by then: every topic takes at
+	 * least three bytes and its QoS only one. The topics themselves are
+	 * borrowed from the packet, so nothing is allocated here unless the
+	 * listener has a mount point. */
+	payload = &context->in_packet.payload[context->in_packet.pos];
+
 	while(context->in_packet.pos < context->in_packet.remaining_length){
-		sub = NULL;
-		if(_mosquitto_read_string(&context->in_packet, &sub)){
-			if(payload) _mosquitto_free(payload);
+		if(_mosquitto_read_string_borrow(&context->in_packet, &sub, &slen)){
 			return 1;
 		}
-
-		if(sub){
-			if(_mosquitto_read_byte(&context->in_packet, &qos)){
-				_mosquitto_free(sub);
-				if(payload) _mosquitto_free(payload);
-				return 1;
-			}
-			if(qos > 2){
-				_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid QoS in subscription command from %s, disconnecting.",
-					context->address);
-				_mosquitto_free(sub);
-				if(payload) _mosquitto_free(payload);
-				return 1;
-			}
-			if(_mosquitto_fix_sub_topic(&sub)){
-				_mosquitto_free(sub);
-				if(payload) _mosquitto_free(payload);
-				return 1;
-			}
-			if(!strlen(sub)){
-				_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Empty subscription string from %s, disconnecting.",
-					context->address);
-				_mosquitto_free(sub);
-				if(payload) _mosquitto_free(payload);
-				return 1;
-			}
-			if(context->listener && context->listener->mount_point){
-				len = strlen(context->listener->mount_point) + strlen(sub) + 1;
-				sub_mount = _mosquitto_calloc(len, sizeof(char));
-				if(!sub_mount){
-					_mosquitto_free(sub);
-					if(payload) _mosquitto_free(payload);
-					return MOSQ_ERR_NOMEM;
-				}
-				snprintf(sub_mount, len, "%s%s", context->listener->mount_point, sub);
-				_mosquitto_free(sub);
-				sub = sub_mount;
-
-			}
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s (QoS %d)", sub, qos);
-
-			rc2 = mqtt3_sub_add(db, context, sub, qos, &db->subs);
-			if(rc2 == MOSQ_ERR_SUCCESS){
-				if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
-			}else if(rc2 != -1){
-				rc = rc2;
+		if(_mosquitto_read_byte(&context->in_packet, &qos)){
+			return 1;
+		}
+		if(qos > 2){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid QoS in subscription command from %s, disconnecting.",
+				context->address);
+			return 1;
+		}
+		_mosquitto_fix_sub_topic(&sub);
+		if(!strlen(sub)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Empty subscription string from %s, disconnecting.",
+				context->address);
+			return 1;
+		}
+		shared = mqtt3_sub_share_split(sub, &group, &group_len, &filter);
+		sub_mount = NULL;
+		if(context->listener && context->listener->mount_point){
+			len = strlen(context->listener->mount_point) + strlen(sub) + 1;
+			sub_mount = _mosquitto_calloc(len, sizeof(char));
+			if(!sub_mount){
+				return MOSQ_ERR_NOMEM;
 			}
-			_mosquitto_log_printf(NULL, MOSQ_LOG_SUBSCRIBE, "%s %d %s", context->id, qos, sub);
-			_mosquitto_free(sub);
-
-			tmp_payload = _mosquitto_realloc(payload, payloadlen + 1);
-			if(tmp_payload){
-				payload = tmp_payload;
-				payload[payloadlen] = qos;
-				payloadlen++;
+			if(shared){
+				/* The mount point goes in front of the filter. */
+				snprintf(sub_mount, len, "$share/%.*s/%s%s", group_len, group, context->listener->mount_point, filter);
 			}else{
-				if(payload) _mosquitto_free(payload);
-
-				return MOSQ_ERR_NOMEM;
+				snprintf(sub_mount, len, "%s%s", context->listener->mount_point, sub);
 			}
+			sub = sub_mount;
+		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s (QoS %d)", sub, qos);
+
+		rc2 = mqtt3_sub_add(db, context, sub, qos, &db->subs);
+		if(rc2 == MOSQ_ERR_SUCCESS){
+			/* Retained messages aren't sent to shared subscriptions,
+			 * every member of the group would get its own copy. */
+			if(!shared && mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
+		}else if(rc2 != -1){
+			rc = rc2;
 		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_SUBSCRIBE, "%s %d %s", context->id, qos, sub);
+		if(sub_mount) _mosquitto_free(sub_mount);
+
+		payload[payloadlen] = qos;
+		payloadlen++;
 	}
 
 	if(_mosquitto_send_suback(context, mid, payloadlen, payload)) rc = 1;
-	_mosquitto_free(payload);
+
+	/* Retained messages go out after the SUBACK, a batch at a time. */
+	if(context->cold && context->cold->retain_cursors){
+		if(mqtt3_retain_deliver(db, context)) rc = 1;
+	}
 
 #ifdef WITH_PERSISTENCE
 	db->persistence_changes++;
@@ -542,6 +554,7 @@ int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 {
 	uint16_t mid;
 	char *sub;
+	uint16_t slen;
 
 	if(!context) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received UNSUBSCRIBE from %s", context->id);
@@ -549,17 +562,14 @@ int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 	if(_mosquitto_read_uint16(&context->in_packet, &mid)) return 1;
 
 	while(context->in_packet.pos < context->in_packet.remaining_length){
-		sub = NULL;
-		if(_mosquitto_read_string(&context->in_packet, &sub)){
+		if(_mosquitto_read_string_borrow(&context->in_packet, &sub, &slen)){
 			return 1;
 		}
 
-		if(sub){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
-			mqtt3_sub_remove(db, context, sub, &db->subs);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_UNSUBSCRIBE, "%s %s", context->id, sub);
-			_mosquitto_free(sub);
-		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
+		mqtt3_sub_remove(db, context, sub, &db->subs);
+		mqtt3_retain_cancel(context, sub);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_UNSUBSCRIBE, "%s %s", context->id, sub);
 	}
 #ifdef WITH_PERSISTENCE
 	db->persistence_changes++;
@@ -0,0 +1,485 @@
+/*
+Copyright (c) 2010-2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Retained messages are indexed in their own topic tree, db->retains, rather
+ * than hanging off the subscription tree. Only nodes on the path to a
+ * retained message exist: a node is pruned as soon as it holds neither a
+ * message nor children, so walking the subtree under a wildcard costs time in
+ * proportion to the number of matching messages.
+ *
+ * Delivery for a new subscription is done through a cursor that remembers
+ * where the walk got to. Each pass queues at most retained_batch_size
+ * messages for the client and then yields to the event loop until the socket
+ * is writable again, so a subscription matching millions of retained messages
+ * is streamed out at the pace the client reads them instead of stalling the
+ * broker. Nodes that a cursor is positioned on are pinned so that they are
+ * not pruned under it.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <util_mosq.h>
+
+static void _retain_prune(struct _mosquitto_retainhier *node)
+{
+	struct _mosquitto_retainhier *parent;
+
+	while(node->parent && !node->retained && !node->children && !node->pins){
+		parent = node->parent;
+		HASH_DELETE(hh, parent->children, node);
+		_mosquitto_free(node->topic);
+		_mosquitto_free(node);
+		node = parent;
+	}
+}
+
+static void _retain_unpin(struct _mosquitto_retainhier *node)
+{
+	node->pins--;
+	_retain_prune(node);
+}
+
+int mqtt3_retain_store(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_retainhier *node, *child;
+	struct mosquitto_msg_store *old;
+	char *buf;
+	char **levels;
+	int level_count;
+	int i;
+
+	assert(db);
+	assert(topic);
+	assert(stored);
+
+#ifdef WITH_PERSISTENCE
+	if(strncmp(topic, "$SYS", 4)){
+		/* Retained messages count as a persistence change, but only if
+		 * they aren't for $SYS. */
+		db->persistence_changes++;
+	}
+#endif
+
+	if(mqtt3_sub_topic_tokenise(topic, &buf, &levels, &level_count)) return MOSQ_ERR_NOMEM;
+
+	node = &db->retains;
+	for(i=0; i<level_count && node; i++){
+		HASH_FIND_STR(node->children, levels[i], child);
+		if(!child && stored->msg.payloadlen){
+			child = _mosquitto_calloc(1, sizeof(struct _mosquitto_retainhier));
+			if(!child){
+				_retain_prune(node);
+				_mosquitto_free(levels);
+				_mosquitto_free(buf);
+				return MOSQ_ERR_NOMEM;
+			}
+			child->topic = _mosquitto_strdup(levels[i]);
+			if(!child->topic){
+				_mosquitto_free(child);
+				_retain_prune(node);
+				_mosquitto_free(levels);
+				_mosquitto_free(buf);
+				return MOSQ_ERR_NOMEM;
+			}
+			child->parent = node;
+			HASH_ADD_KEYPTR(hh, node->children, child->topic, strlen(child->topic), child);
+		}
+		node = child;
+	}
+	_mosquitto_free(levels);
+	_mosquitto_free(buf);
+
+	/* Nothing to clear, or not a valid topic. */
+	if(!node || node == &db->retains) return MOSQ_ERR_SUCCESS;
+
+	old = node->retained;
+	if(stored->msg.payloadlen){
+		node->retained = stored;
+		node->retained->ref_count++;
+		db->retained_count++;
+	}else{
+		node->retained = NULL;
+	}
+	if(old){
+		mqtt3_db_msg_store_deref(db, old);
+		db->retained_count--;
+	}
+	if(!node->retained){
+		_retain_prune(node);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Queue a retained message for the client. Increments count if it was
+ * queued and returns 2 if it was dropped because the client has no room. */
+static int _retain_process(struct mosquitto_db *db, struct mosquitto_msg_store *retained, struct mosquitto *context, int sub_qos, int *count)
+{
+	int rc = 0;
+	int qos;
+	uint16_t mid;
+	bool placed;
+
+	rc = mosquitto_acl_check(db, context, retained->msg.topic, MOSQ_ACL_READ);
+	if(rc == MOSQ_ERR_ACL_DENIED){
+		return MOSQ_ERR_SUCCESS;
+	}else if(rc != MOSQ_ERR_SUCCESS){
+		return rc;
+	}
+
+	qos = retained->msg.qos;
+
+	if(qos > sub_qos) qos = sub_qos;
+	if(qos > 0){
+		mid = _mosquitto_mid_generate(context);
+	}else{
+		mid = 0;
+	}
+	rc = mqtt3_db_message_insert_placed(db, context, mid, mosq_md_out, qos, true, retained, &placed);
+	if(placed) (*count)++;
+	if(rc == 2 && placed) return MOSQ_ERR_SUCCESS;
+	return rc;
+}
+
+static int _retain_cursor_push(struct mosquitto_retain_cursor *cursor, struct _mosquitto_retainhier *node, int level)
+{
+	struct _mosquitto_retain_frame *stack;
+	int stack_max;
+
+	if(cursor->stack_len == cursor->stack_max){
+		stack_max = cursor->stack_max ? cursor->stack_max*2 : 8;
+		stack = _mosquitto_realloc(cursor->stack, sizeof(struct _mosquitto_retain_frame)*stack_max);
+		if(!stack) return MOSQ_ERR_NOMEM;
+		cursor->stack = stack;
+		cursor->stack_max = stack_max;
+	}
+	cursor->stack[cursor->stack_len].node = node;
+	cursor->stack[cursor->stack_len].last = NULL;
+	cursor->stack[cursor->stack_len].level = level;
+	cursor->stack_len++;
+	node->pins++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* node matches the first level levels of the subscription. Deliver its
+ * message if that is the whole subscription, follow plain levels straight
+ * down and leave a frame on the stack where a wildcard needs the children
+ * walking. Returns 2 if a message was dropped, visiting node again later
+ * picks up from there. */
+static int _retain_cursor_visit(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_retain_cursor *cursor, struct _mosquitto_retainhier *node, int level, int *count)
+{
+	struct _mosquitto_retainhier *child;
+	const char *token;
+	int rc;
+
+	while(level < cursor->level_count){
+		token = cursor->levels[level];
+		if(!strcmp(token, "#")){
+			/* "foo/#" also matches "foo" itself. */
+			if(node->parent && node->retained){
+				rc = _retain_process(db, node->retained, context, cursor->qos, count);
+				if(rc) return rc;
+			}
+			if(!node->children) return MOSQ_ERR_SUCCESS;
+			return _retain_cursor_push(cursor, node, level);
+		}else if(!strcmp(token, "+")){
+			if(!node->children) return MOSQ_ERR_SUCCESS;
+			return _retain_cursor_push(cursor, node, level+1);
+		}
+		HASH_FIND_STR(node->children, token, child);
+		if(!child) return MOSQ_ERR_SUCCESS;
+		node = child;
+		level++;
+	}
+
+	if(node->retained){
+		return _retain_process(db, node->retained, context, cursor->qos, count);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Visit node, and if a message is dropped leave the cursor to visit it again
+ * next time round. */
+static int _retain_cursor_try(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_retain_cursor *cursor, struct _mosquitto_retainhier *node, int level, int *count)
+{
+	int rc;
+
+	rc = _retain_cursor_visit(db, context, cursor, node, level, count);
+	if(rc == 2){
+		node->pins++;
+		cursor->retry = node;
+		cursor->retry_level = level;
+	}
+	return rc;
+}
+
+/* Deliver up to budget messages, or all of them if budget is 0. Returns 2 if
+ * the client ran out of room. The cursor is finished when its stack is empty
+ * and it has nothing to retry. */
+static int _retain_cursor_run(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_retain_cursor *cursor, int budget)
+{
+	struct _mosquitto_retain_frame *frame;
+	struct _mosquitto_retainhier *child;
+	int count = 0;
+	int rc;
+
+	if(!cursor->started){
+		cursor->started = true;
+		rc = _retain_cursor_try(db, context, cursor, &db->retains, 0, &count);
+		if(rc) return rc;
+	}
+	if(cursor->retry){
+		child = cursor->retry;
+		cursor->retry = NULL;
+		rc = _retain_cursor_try(db, context, cursor, child, cursor->retry_level, &count);
+		_retain_unpin(child);
+		if(rc) return rc;
+	}
+
+	while(cursor->stack_len && (budget <= 0 || count < budget)){
+		frame = &cursor->stack[cursor->stack_len-1];
+		if(frame->last){
+			child = frame->last->hh.next;
+		}else{
+			child = frame->node->children;
+		}
+		if(!child){
+			cursor->stack_len--;
+			if(frame->last) _retain_unpin(frame->last);
+			_retain_unpin(frame->node);
+			continue;
+		}
+
+		child->pins++;
+		if(frame->last) _retain_unpin(frame->last);
+		frame->last = child;
+
+		if(!frame->node->parent && !strcmp(child->topic, "$SYS")){
+			/* Wildcards at the top level don't match $SYS. */
+			continue;
+		}
+		/* This may grow the stack, so frame isn't valid after it. */
+		rc = _retain_cursor_try(db, context, cursor, child, frame->level, &count);
+		if(rc) return rc;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _retain_cursor_free(struct mosquitto_retain_cursor *cursor)
+{
+	struct _mosquitto_retain_frame *frame;
+
+	while(cursor->stack_len){
+		frame = &cursor->stack[cursor->stack_len-1];
+		cursor->stack_len--;
+		if(frame->last) _retain_unpin(frame->last);
+		_retain_unpin(frame->node);
+	}
+	if(cursor->retry) _retain_unpin(cursor->retry);
+	if(cursor->stack) _mosquitto_free(cursor->stack);
+	if(cursor->levels) _mosquitto_free(cursor->levels);
+	if(cursor->buf) _mosquitto_free(cursor->buf);
+	if(cursor->sub) _mosquitto_free(cursor->sub);
+	_mosquitto_free(cursor);
+}
+
+int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos)
+{
+	struct mosquitto_retain_cursor *cursor, *tail;
+	struct mosquitto_cold *cold;
+
+	assert(db);
+	assert(context);
+	assert(sub);
+
+	cold = mqtt3_context_cold(context);
+	if(!cold) return MOSQ_ERR_NOMEM;
+	cursor = _mosquitto_calloc(1, sizeof(struct mosquitto_retain_cursor));
+	if(!cursor) return MOSQ_ERR_NOMEM;
+	cursor->qos = sub_qos;
+	cursor->sub = _mosquitto_strdup(sub);
+	if(!cursor->sub
+			|| mqtt3_sub_topic_tokenise(sub, &cursor->buf, &cursor->levels, &cursor->level_count)){
+
+		_retain_cursor_free(cursor);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	/* Cursors are worked through in the order the subscriptions arrived. */
+	if(cold->retain_cursors){
+		tail = cold->retain_cursors;
+		while(tail->next) tail = tail->next;
+		tail->next = cursor;
+	}else{
+		cold->retain_cursors = cursor;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_retain_deliver(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto_cold *cold = context->cold;
+	struct mosquitto_retain_cursor *cursor;
+	int batch;
+	int budget = 0;
+	int rc;
+
+	assert(db);
+	assert(context);
+
+	if(context->sock == INVALID_SOCKET || !cold) return MOSQ_ERR_SUCCESS;
+
+	batch = db->config->retained_batch_size;
+	while(cold->retain_cursors){
+		if(batch > 0){
+			/* Only top the client up to batch outstanding messages and wait
+			 * for the socket to drain, so that delivery goes at the pace of
+			 * the client. */
+			budget = batch - cold->msg_count;
+			if(budget <= 0 || context->current_out_packet || context->out_packet){
+				/* Picked up again once the client acknowledges something
+				 * or its socket drains. */
+				return MOSQ_ERR_SUCCESS;
+			}
+		}
+
+		cursor = cold->retain_cursors;
+		rc = _retain_cursor_run(db, context, cursor, budget);
+		if(rc == 2){
+			/* The client's queue is full. Send what there is and carry on
+			 * once it acknowledges something or its socket drains. */
+			return mqtt3_db_message_write(context);
+		}
+		if(rc) return rc;
+		if(!cursor->stack_len && !cursor->retry){
+			cold->retain_cursors = cursor->next;
+			_retain_cursor_free(cursor);
+		}
+
+		rc = mqtt3_db_message_write(context);
+		if(rc) return rc;
+
+		if(batch > 0 && cold->retain_cursors){
+			/* Let everybody else have a go before the next batch, which is
+			 * sent when the loop next finds the socket writable. */
+			return mqtt3_event_write_set(context, true);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Stop delivering retained messages for a subscription that has gone away. */
+void mqtt3_retain_cancel(struct mosquitto *context, const char *sub)
+{
+	struct mosquitto_retain_cursor *cursor, *last = NULL;
+
+	if(!context->cold) return;
+	cursor = context->cold->retain_cursors;
+	while(cursor){
+		if(!strcmp(cursor->sub, sub)){
+			if(last){
+				last->next = cursor->next;
+			}else{
+				context->cold->retain_cursors = cursor->next;
+			}
+			_retain_cursor_free(cursor);
+			cursor = last ? last->next : context->cold->retain_cursors;
+		}else{
+			last = cursor;
+			cursor = cursor->next;
+		}
+	}
+}
+
+void mqtt3_retain_cursors_free(struct mosquitto *context)
+{
+	struct mosquitto_retain_cursor *cursor;
+
+	if(!context->cold) return;
+	while(context->cold->retain_cursors){
+		cursor = context->cold->retain_cursors;
+		context->cold->retain_cursors = cursor->next;
+		_retain_cursor_free(cursor);
+	}
+}
+
+static int _retain_foreach(struct mosquitto_db *db, struct _mosquitto_retainhier *node, int (*callback)(struct mosquitto_db *, struct mosquitto_msg_store *, void *), void *userdata)
+{
+	struct _mosquitto_retainhier *child;
+	int rc;
+
+	if(node->retained){
+		rc = callback(db, node->retained, userdata);
+		if(rc) return rc;
+	}
+	for(child=node->children; child; child=child->hh.next){
+		rc = _retain_foreach(db, child, callback, userdata);
+		if(rc) return rc;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Call callback for every retained message, stopping if it returns non-zero. */
+int mqtt3_retain_foreach(struct mosquitto_db *db, int (*callback)(struct mosquitto_db *, struct mosquitto_msg_store *, void *), void *userdata)
+{
+	assert(db);
+	assert(callback);
+
+	return _retain_foreach(db, &db->retains, callback, userdata);
+}
+
+static void _retain_clean(struct mosquitto_db *db, struct _mosquitto_retainhier *node)
+{
+	struct _mosquitto_retainhier *child, *tmp;
+
+	HASH_ITER(hh, node->children, child, tmp){
+		HASH_DELETE(hh, node->children, child);
+		_retain_clean(db, child);
+		_mosquitto_free(child->topic);
+		_mosquitto_free(child);
+	}
+	if(node->retained){
+		mqtt3_db_msg_store_deref(db, node->retained);
+		node->retained = NULL;
+	}
+}
+
+void mqtt3_retain_clean(struct mosquitto_db *db)
+{
+	_retain_clean(db, &db->retains);
+	db->retained_count = 0;
+}
@@ -214,6 +214,19 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	}
 }
 
+/* As mosquitto_acl_check() for a client that is hibernated. Returns -1 if
+ * the answer depends on more than the client id and username, in which case
+ * the client has to be woken up first. */
+int mosquitto_acl_check_hibernated(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated, const char *topic, int access)
+{
+	if(!db->auth_plugin.lib){
+		if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
+		return -1;
+	}else{
+		return db->auth_plugin.acl_check(db->auth_plugin.user_data, hibernated->id, hibernated->username, topic, access);
+	}
+}
+
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password)
 {
 	if(!db->auth_plugin.lib){
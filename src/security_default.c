@@ -921,7 +921,12 @@ int mosquitto_psk_key_get_default(struct mosquitto_db *db, const char *hint, con
 int _pw_digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len)
 {
 	const EVP_MD *digest;
-	EVP_MD_CTX context;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_MD_CTX context_s;
+	EVP_MD_CTX *context = &context_s;
+#else
+	EVP_MD_CTX *context;
+#endif
 	char *pass_salt;
 	int pass_salt_len;
 
@@ -939,12 +944,24 @@ int _pw_digest(const char *password, const unsigned char *salt, unsigned int sal
 	}
 	memcpy(pass_salt, password, strlen(password));
 	memcpy(pass_salt+strlen(password), salt, salt_len);
-	EVP_MD_CTX_init(&context);
-	EVP_DigestInit_ex(&context, digest, NULL);
-	EVP_DigestUpdate(&context, pass_salt, pass_salt_len);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_MD_CTX_init(context);
+#else
+	context = EVP_MD_CTX_new();
+	if(!context){
+		_mosquitto_free(pass_salt);
+		return 1;
+	}
+#endif
+	EVP_DigestInit_ex(context, digest, NULL);
+	EVP_DigestUpdate(context, pass_salt, pass_salt_len);
 	/* hash is assumed to be EVP_MAX_MD_SIZE bytes long. */
-	EVP_DigestFinal_ex(&context, hash, hash_len);
-	EVP_MD_CTX_cleanup(&context);
+	EVP_DigestFinal_ex(context, hash, hash_len);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_MD_CTX_cleanup(context);
+#else
+	EVP_MD_CTX_free(context);
+#endif
 	_mosquitto_free(pass_salt);
 
 	return MOSQ_ERR_SUCCESS;
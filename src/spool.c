@@ -0,0 +1,515 @@
+/*
+Copyright (c) 2009-2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Messages queued for a persistent client beyond queue_spill_threshold are
+ * kept on disk rather than in memory. Each client that has spilled owns a
+ * spool: a chain of segment files
+ *
+ *   <queue_spill_location>/<spool id>.<segment>.spool
+ *
+ * that are appended to at the tail and consumed from the head. Segments are
+ * allocated on disk at their full size and mapped, so appending is a
+ * memcpy(). A segment is unlinked as soon as everything in it has been read
+ * back.
+ *
+ * Each record is a 12 byte header followed by the topic, including its
+ * terminating NUL, and then the payload:
+ *
+ *   uint32 length of the whole record
+ *   uint8  qos
+ *   uint8  retain
+ *   uint16 topic length
+ *   uint32 payload length
+ *
+ * all in network byte order. A zero length marks the end of a segment.
+ *
+ * Nothing in a spool is rewritten by mqtt3_db_backup(), the persistent
+ * database only records where each spool starts and ends.
+ */
+
+#include <config.h>
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+
+#define SPOOL_HEADER_LEN 12
+
+static char *_spool_path(struct mosquitto_db *db, uint32_t id, uint32_t seq)
+{
+	const char *location = db->config->queue_spill_location;
+	const char *sep;
+	char *path;
+	int len;
+
+	len = strlen(location);
+	sep = (len && location[len-1] == '/') ? "" : "/";
+	len += 32;
+	path = _mosquitto_malloc(len);
+	if(!path) return NULL;
+	snprintf(path, len, "%s%s%u.%u.spool", location, sep, id, seq);
+	return path;
+}
+
+static void _spool_unlink(struct mosquitto_db *db, uint32_t id, uint32_t seq)
+{
+	char *path;
+
+	path = _spool_path(db, id, seq);
+	if(!path) return;
+	unlink(path);
+	_mosquitto_free(path);
+}
+
+/* Map segment seq of spool. If size is non-zero the segment is created (or
+ * emptied) at that size, otherwise an existing segment is mapped as it is. */
+static uint8_t *_spool_map(struct mosquitto_db *db, struct mosquitto_spool *spool, uint32_t seq, size_t size, size_t *len)
+{
+	struct stat st;
+	uint8_t *map;
+	char *path;
+	int fd;
+	int rc;
+
+	path = _spool_path(db, spool->id, seq);
+	if(!path) return NULL;
+	if(size){
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	}else{
+		fd = open(path, O_RDWR);
+	}
+	if(fd < 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open queue spool %s: %s.", path, strerror(errno));
+		_mosquitto_free(path);
+		return NULL;
+	}
+	if(size){
+		/* The blocks have to be allocated now rather than when the map is
+		 * first written to, or a full disk shows up as SIGBUS in the middle
+		 * of mqtt3_spool_append() instead of as an error here. */
+		rc = posix_fallocate(fd, 0, size);
+		if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to size queue spool %s: %s.", path, strerror(rc));
+			close(fd);
+			unlink(path);
+			_mosquitto_free(path);
+			return NULL;
+		}
+	}else{
+		if(fstat(fd, &st) || st.st_size < SPOOL_HEADER_LEN){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Queue spool %s is damaged.", path);
+			close(fd);
+			_mosquitto_free(path);
+			return NULL;
+		}
+		size = st.st_size;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to map queue spool %s: %s.", path, strerror(errno));
+		_mosquitto_free(path);
+		return NULL;
+	}
+	_mosquitto_free(path);
+	*len = size;
+	return map;
+}
+
+/* Tell the kernel that seq is about to be read from start to finish, so
+ * that it is brought in from disk ahead of the reader. */
+static void _spool_prefetch(struct mosquitto_db *db, struct mosquitto_spool *spool, uint32_t seq)
+{
+	char *path;
+	int fd;
+
+	path = _spool_path(db, spool->id, seq);
+	if(!path) return;
+	fd = open(path, O_RDONLY);
+	if(fd >= 0){
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+		close(fd);
+	}
+	_mosquitto_free(path);
+}
+
+static void _spool_read_unmap(struct mosquitto_spool *spool)
+{
+	if(spool->read_map){
+		munmap(spool->read_map, spool->read_len);
+		spool->read_map = NULL;
+		spool->read_len = 0;
+	}
+}
+
+static void _spool_write_unmap(struct mosquitto_spool *spool)
+{
+	if(spool->write_map){
+		/* Mark the end of what was written, in case the segment was
+		 * partly filled before the broker last restarted. */
+		if(spool->write_pos + sizeof(uint32_t) <= spool->write_len){
+			memset(spool->write_map + spool->write_pos, 0, sizeof(uint32_t));
+		}
+		munmap(spool->write_map, spool->write_len);
+		spool->write_map = NULL;
+		spool->write_len = 0;
+	}
+}
+
+/* Append a message to *spoolp, creating the spool if there isn't one. */
+int mqtt3_spool_append(struct mosquitto_db *db, struct mosquitto_spool **spoolp, int qos, bool retain, const char *topic, uint32_t payloadlen, const void *payload)
+{
+	struct mosquitto_spool *spool;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	uint16_t topiclen;
+	size_t reclen;
+	size_t size;
+	uint8_t *ptr;
+
+	assert(db);
+	assert(spoolp);
+	assert(topic);
+
+	if(strlen(topic) >= UINT16_MAX) return MOSQ_ERR_INVAL;
+	topiclen = strlen(topic) + 1;
+	reclen = SPOOL_HEADER_LEN + topiclen + payloadlen;
+
+	if(!*spoolp){
+		spool = _mosquitto_calloc(1, sizeof(struct mosquitto_spool));
+		if(!spool) return MOSQ_ERR_NOMEM;
+		spool->id = db->spool_next_id++;
+		*spoolp = spool;
+	}
+	spool = *spoolp;
+
+	if(spool->write_map && spool->write_pos + reclen > spool->write_len){
+		/* Segment full, start the next one. */
+		_spool_write_unmap(spool);
+		spool->write_seq++;
+		spool->write_pos = 0;
+	}
+	if(!spool->write_map){
+		if(spool->write_pos == 0){
+			size = db->config->queue_spill_segment_size;
+			if(size < reclen) size = reclen;
+			spool->write_map = _spool_map(db, spool, spool->write_seq, size, &spool->write_len);
+		}else{
+			spool->write_map = _spool_map(db, spool, spool->write_seq, 0, &spool->write_len);
+			if(spool->write_map && spool->write_pos + reclen > spool->write_len){
+				_spool_write_unmap(spool);
+				spool->write_seq++;
+				spool->write_pos = 0;
+				size = db->config->queue_spill_segment_size;
+				if(size < reclen) size = reclen;
+				spool->write_map = _spool_map(db, spool, spool->write_seq, size, &spool->write_len);
+			}
+		}
+		if(!spool->write_map) return MOSQ_ERR_UNKNOWN;
+	}
+
+	ptr = spool->write_map + spool->write_pos;
+	i32temp = htonl(reclen);
+	memcpy(ptr, &i32temp, sizeof(uint32_t));
+	ptr[4] = qos;
+	ptr[5] = retain;
+	i16temp = htons(topiclen);
+	memcpy(ptr+6, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(payloadlen);
+	memcpy(ptr+8, &i32temp, sizeof(uint32_t));
+	memcpy(ptr+SPOOL_HEADER_LEN, topic, topiclen);
+	if(payloadlen){
+		memcpy(ptr+SPOOL_HEADER_LEN+topiclen, payload, payloadlen);
+	}
+	spool->write_pos += reclen;
+	spool->count++;
+	db->spool_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Return the oldest message in the spool without consuming it. topic and
+ * payload point into the mapped segment and are only valid until the next
+ * call into the spool. Returns MOSQ_ERR_NOT_FOUND if the spool is empty. */
+int mqtt3_spool_peek(struct mosquitto_db *db, struct mosquitto *context, int *qos, bool *retain, const char **topic, uint32_t *payloadlen, const void **payload)
+{
+	struct mosquitto_spool *spool = context->cold ? context->cold->spool : NULL;
+	uint32_t reclen;
+	uint32_t i32temp;
+	uint16_t i16temp;
+	uint16_t topiclen;
+	uint8_t *ptr;
+
+	if(!spool || !spool->count) return MOSQ_ERR_NOT_FOUND;
+
+	while(1){
+		if(!spool->read_map){
+			spool->read_map = _spool_map(db, spool, spool->read_seq, 0, &spool->read_len);
+			if(!spool->read_map) goto error;
+#ifdef MADV_SEQUENTIAL
+			madvise(spool->read_map, spool->read_len, MADV_SEQUENTIAL);
+			madvise(spool->read_map, spool->read_len, MADV_WILLNEED);
+#endif
+			if(spool->read_seq != spool->write_seq){
+				_spool_prefetch(db, spool, spool->read_seq+1);
+			}
+		}
+		if(spool->read_seq == spool->write_seq && spool->read_pos >= spool->write_pos){
+			goto error;
+		}
+		reclen = 0;
+		if(spool->read_pos + sizeof(uint32_t) <= spool->read_len){
+			memcpy(&i32temp, spool->read_map + spool->read_pos, sizeof(uint32_t));
+			reclen = ntohl(i32temp);
+		}
+		if(reclen){
+			break;
+		}
+		if(spool->read_seq == spool->write_seq) goto error;
+
+		/* End of this segment, it has all been delivered. */
+		_spool_read_unmap(spool);
+		_spool_unlink(db, spool->id, spool->read_seq);
+		spool->read_seq++;
+		spool->read_pos = 0;
+	}
+
+	ptr = spool->read_map + spool->read_pos;
+	memcpy(&i16temp, ptr+6, sizeof(uint16_t));
+	topiclen = ntohs(i16temp);
+	memcpy(&i32temp, ptr+8, sizeof(uint32_t));
+	*payloadlen = ntohl(i32temp);
+	if(reclen < SPOOL_HEADER_LEN || reclen > spool->read_len - spool->read_pos
+			|| topiclen == 0 || ptr[4] > 2
+			|| (uint64_t)SPOOL_HEADER_LEN + topiclen + *payloadlen != reclen
+			|| ptr[SPOOL_HEADER_LEN+topiclen-1] != '\0'){
+		goto error;
+	}
+	*qos = ptr[4];
+	*retain = ptr[5];
+	*topic = (const char *)ptr+SPOOL_HEADER_LEN;
+	*payload = ptr+SPOOL_HEADER_LEN+topiclen;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Queue spool for client %s is damaged, %u messages lost.",
+			context->id, spool->count);
+	mqtt3_spool_free(db, &context->cold->spool, true);
+	return MOSQ_ERR_UNKNOWN;
+}
+
+/* Consume the message returned by the last mqtt3_spool_peek(). */
+void mqtt3_spool_next(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto_spool *spool = context->cold->spool;
+	uint32_t i32temp;
+
+	assert(spool && spool->read_map);
+
+	memcpy(&i32temp, spool->read_map + spool->read_pos, sizeof(uint32_t));
+	spool->read_pos += ntohl(i32temp);
+	spool->count--;
+	db->spool_count--;
+
+	if(spool->count == 0){
+		/* Back to an in-memory queue, the next spill starts afresh. */
+		mqtt3_spool_free(db, &context->cold->spool, true);
+	}
+}
+
+/* Drop *spoolp. The segment files are only removed if remove_files is set,
+ * so that a spool can be picked up again by mqtt3_spool_restore() after a
+ * restart. */
+void mqtt3_spool_free(struct mosquitto_db *db, struct mosquitto_spool **spoolp, bool remove_files)
+{
+	struct mosquitto_spool *spool = *spoolp;
+	uint32_t seq;
+
+	if(!spool) return;
+
+	_spool_read_unmap(spool);
+	_spool_write_unmap(spool);
+	if(remove_files){
+		for(seq=spool->read_seq; seq!=spool->write_seq+1; seq++){
+			_spool_unlink(db, spool->id, seq);
+		}
+	}
+	db->spool_count -= spool->count;
+	_mosquitto_free(spool);
+	*spoolp = NULL;
+}
+
+/* Unmap the segments of a spool that isn't going to be read for a while.
+ * They are mapped again when next needed. */
+void mqtt3_spool_release(struct mosquitto_spool *spool)
+{
+	if(!spool) return;
+	_spool_read_unmap(spool);
+	_spool_write_unmap(spool);
+}
+
+/* Flush appended messages to disk ahead of the persistent database being
+ * written. Only the segment being written to can have changed. */
+int mqtt3_spool_sync(struct mosquitto_spool *spool)
+{
+	if(!spool || !spool->write_map) return MOSQ_ERR_SUCCESS;
+	if(msync(spool->write_map, spool->write_len, MS_ASYNC)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to sync queue spool %u: %s.", spool->id, strerror(errno));
+		return MOSQ_ERR_UNKNOWN;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Reattach a spool recorded in the persistent database to context. The
+ * segments are mapped when they are next needed. */
+int mqtt3_spool_restore(struct mosquitto_db *db, struct mosquitto *context, const struct mosquitto_spool *saved)
+{
+	struct mosquitto_cold *cold;
+	struct mosquitto_spool *spool;
+
+	cold = mqtt3_context_cold(context);
+	if(!cold) return MOSQ_ERR_NOMEM;
+	if(cold->spool) mqtt3_spool_free(db, &cold->spool, false);
+
+	spool = _mosquitto_calloc(1, sizeof(struct mosquitto_spool));
+	if(!spool) return MOSQ_ERR_NOMEM;
+	spool->id = saved->id;
+	spool->read_seq = saved->read_seq;
+	spool->read_pos = saved->read_pos;
+	spool->write_seq = saved->write_seq;
+	spool->write_pos = saved->write_pos;
+	spool->count = saved->count;
+	cold->spool = spool;
+	db->spool_count += spool->count;
+	if(spool->id >= db->spool_next_id){
+		db->spool_next_id = spool->id+1;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _spool_cmp(const void *a, const void *b)
+{
+	uint32_t ia = (*(const struct mosquitto_spool **)a)->id;
+	uint32_t ib = (*(const struct mosquitto_spool **)b)->id;
+
+	return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+/* Called once the persistent database has been restored. Removes any
+ * segment that doesn't belong to a restored spool, such as those left by a
+ * broker that was running without persistence. */
+int mqtt3_spool_init(struct mosquitto_db *db)
+{
+	struct mosquitto_spool **spools = NULL;
+	struct mosquitto_spool key, *keyp, **found;
+	struct dirent *de;
+	DIR *dir;
+	uint32_t id, seq;
+	int spool_count = 0;
+	int i, n;
+	char *path;
+	bool stale;
+
+	if(db->config->queue_spill_threshold <= 0 || !db->config->queue_spill_location){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	dir = opendir(db->config->queue_spill_location);
+	if(!dir){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open queue_spill_location %s: %s.",
+				db->config->queue_spill_location, strerror(errno));
+		return 1;
+	}
+
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i] && db->contexts[i]->cold && db->contexts[i]->cold->spool){
+			spool_count++;
+		}
+	}
+	if(spool_count){
+		spools = _mosquitto_malloc(sizeof(struct mosquitto_spool *)*spool_count);
+		if(!spools){
+			closedir(dir);
+			return MOSQ_ERR_NOMEM;
+		}
+		spool_count = 0;
+		for(i=0; i<db->context_count; i++){
+			if(db->contexts[i] && db->contexts[i]->cold && db->contexts[i]->cold->spool){
+				spools[spool_count++] = db->contexts[i]->cold->spool;
+			}
+		}
+		qsort(spools, spool_count, sizeof(struct mosquitto_spool *), _spool_cmp);
+	}
+
+	while((de = readdir(dir)) != NULL){
+		n = 0;
+		if(sscanf(de->d_name, "%u.%u.spool%n", &id, &seq, &n) != 2 || de->d_name[n] != '\0' || n == 0){
+			continue;
+		}
+		key.id = id;
+		keyp = &key;
+		found = NULL;
+		if(spools){
+			found = bsearch(&keyp, spools, spool_count, sizeof(struct mosquitto_spool *), _spool_cmp);
+		}
+		if(found){
+			/* Segments before the read position have been delivered. */
+			stale = (int32_t)(seq - (*found)->read_seq) < 0 || (int32_t)(seq - (*found)->write_seq) > 0;
+		}else{
+			stale = true;
+		}
+		if(stale){
+			path = _spool_path(db, id, seq);
+			if(path){
+				unlink(path);
+				_mosquitto_free(path);
+			}
+		}else if(id >= db->spool_next_id){
+			db->spool_next_id = id+1;
+		}
+	}
+	closedir(dir);
+	if(spools) _mosquitto_free(spools);
+
+	return MOSQ_ERR_SUCCESS;
+}
@@ -59,16 +59,17 @@ POSSIBILITY OF SUCH DAMAGE.
  */
 
 // mosquitto订阅信息结构的具体实现
-// 每一个[]符号为一个struct _mosquitto_subhier结构，有children指向同级别的其他branch（即图中的本行）
-// subs指针则指向订阅的客户端（也是链表结构），topic结构代表内容
-// 假设我们有如下订阅： /a/b/c/f /a/b/d ，则内部的订阅树会生成如下结构
-/* [ /a ] -> [ ] -> [ ] -> .. */
+// 每一个[]符号为一个struct _mosquitto_subhier结构，children是以边的第一层话题为key的hash表
+// subs数组保存订阅在该节点上的客户端，levels是从父节点到该节点的边，可以跨越多层话题
+// 只有一个子节点又没有订阅者的节点会被合并掉，# 总是单独成一个节点
+// 假设我们有如下订阅： /a/b/c/f /a/b/d a/# ，则内部的订阅树会生成如下结构
+/* [ "" ] */
  /*   \ */
- /*   [ /b ]->[ ]->.. */
- /*     \ */
- /*     [ /c ]->[ /d ]->... */
- /*        \ */
- /*       [ /f ]->... */
+ /*   [ / a b ]-------[ a ] */
+ /*     \               \ */
+ /*     [ c f ]->[ d ]  [ # ] */
+// 每个节点还记录了下面的订阅数(subs_below)，经过+的订阅数(plus_below)和#订阅数(hash_below)，
+// 匹配的时候用来跳过不可能匹配的子树
 
 #include <config.h>
 
@@ -78,693 +79,1169 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <send_mosq.h>
 #include <util_mosq.h>
 
-struct _sub_token {
-	struct _sub_token *next;
-	char *topic;
-};
+/* The QoS a message published at qos is sent to leaf's client with. */
+static int _subs_leaf_qos(struct mosquitto_db *db, struct _mosquitto_subleaf *leaf, int qos)
+{
+	if(db->config->upgrade_outgoing_qos || qos > leaf->qos){
+		return leaf->qos;
+	}
+	return qos;
+}
 
-static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
-{//如果retain那么挂入当前节点的hier->retained指针一个消息。然后遍历每一个订阅的客户端，将当前消息挂入到其context->msg链表里面
+/* Queue a message for a hibernated client. If it is going into the client's
+ * spool anyway, and the ACL check can be made without the full context,
+ * this is done without waking the client. Returns -1 if the client has been
+ * woken and the message should be delivered to leaf->context as usual. */
+static int _subs_process_hibernated(struct mosquitto_db *db, struct _mosquitto_subleaf *leaf, const char *topic, int qos, struct mosquitto_msg_store *stored)
+{
+	struct mosquitto_hibernated *hibernated = leaf->hibernated;
+	int msg_qos;
+	int rc;
 
-	int rc = 0;
-	int rc2;
-	int client_qos, msg_qos;
+	msg_qos = _subs_leaf_qos(db, leaf, qos);
+	if(msg_qos == 0 && !db->config->queue_qos0_messages){
+		/* Wouldn't be queued for a disconnected client. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(db->config->queue_spill_threshold > 0 && db->config->queue_spill_location){
+		rc = mosquitto_acl_check_hibernated(db, hibernated, topic, MOSQ_ACL_READ);
+		if(rc == MOSQ_ERR_ACL_DENIED){
+			return MOSQ_ERR_SUCCESS;
+		}else if(rc == MOSQ_ERR_SUCCESS){
+			if(mqtt3_db_message_insert_hibernated(db, hibernated, msg_qos, stored) == 1) return 1;
+			return MOSQ_ERR_SUCCESS;
+		}else if(rc != -1){
+			return 1;
+		}
+	}
+	if(!mqtt3_context_wake(db, hibernated)) return 1;
+	return -1;
+}
+
+static int _subs_process_leaf(struct mosquitto_db *db, struct _mosquitto_subleaf *leaf, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{//将当前消息挂入到订阅者的context->msg链表里面，bridge和ACL的检查由调用者完成
+
+	int msg_qos;
 	uint16_t mid;
-	struct _mosquitto_subleaf *leaf;
+	struct mosquitto *context;
 	bool client_retain;
 
-	leaf = hier->subs; //当前节点下面订阅的客户端
+  // 对消息级别做转换
+	msg_qos = _subs_leaf_qos(db, leaf, qos);
 
-  //如果retain为true，那么意思是这条消息以后任何人上线，都要给他发一次。其实就等于"每日推荐"一样
-	if(retain && set_retain){
-#ifdef WITH_PERSISTENCE
-		if(strncmp(topic, "$SYS", 4)){
-			/* Retained messages count as a persistence change, but only if
-			 * they aren't for $SYS. */
-			db->persistence_changes++;
-		}
+  //QOS大于0的消息必须有msgid,这个msgid每个连接一个
+	context = leaf->context;
+#ifdef WITH_BRIDGE
+	if(context->bridge && context->bridge->connection_count > 1){
+		context = mqtt3_bridge_partition(context, topic);
+	}
 #endif
+	if(msg_qos){
+		mid = _mosquitto_mid_generate(context);
+	}else{
+		mid = 0;
+	}
+
+	if(leaf->flags & MOSQ_SUBLEAF_BRIDGE){
+		/* If we know the client is a bridge then we should set retain
+		 * even if the message is fresh. If we don't do this, retained
+		 * messages won't be propagated. */
+		client_retain = retain;
+	}else{
+		/* Client is not a bridge and this isn't a stale message so
+		 * retain should be false. */
+		client_retain = false;
+	}
 
-    // 如果原有的消息还存在这一个主题节点上的话，就减少引用计数
-		if(hier->retained){
-			hier->retained->ref_count--;
-			/* FIXME - it would be nice to be able to remove the message from the store at this point if ref_count == 0 */
-			db->retained_count--;
+  printf("a message is going to be inserted\n");
+  //将一条消息插入到context->msg链表后面，设置相关的状态。然后记录这条消息给哪些人发送过等
+	if(mqtt3_db_message_insert(db, context, mid, mosq_md_out, msg_qos, client_retain, stored) == 1) return 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Choose the member of share that gets the next message: the next connected
+ * member after the last one chosen, or with least_loaded the connected member
+ * with the fewest queued messages. Members that are all offline take turns in
+ * the same way, so their messages are queued for when they come back.
+ * Hibernated members are only picked when no other member is awake, so that
+ * as few of them as possible are woken. */
+static struct _mosquitto_subleaf *_subs_share_pick(struct mosquitto_db *db, struct _mosquitto_subhier *hier, struct _mosquitto_subshare *share, const char *source_id, const char *topic)
+{
+	struct _mosquitto_subleaf *leaf, *best = NULL, *offline = NULL, *hibernated = NULL;
+	int i, n, rc;
+
+	for(n=0; n<hier->sub_count; n++){
+		i = (share->next + n) % hier->sub_count;
+		leaf = &hier->subs[i];
+		if(leaf->share != share) continue;
+		if(leaf->flags & MOSQ_SUBLEAF_HIBERNATED){
+			if(!hibernated) hibernated = leaf;
+			continue;
 		}
+		if((leaf->flags & MOSQ_SUBLEAF_BRIDGE) && !strcmp(leaf->context->id, source_id)) continue;
+		rc = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+		if(rc != MOSQ_ERR_SUCCESS) continue;
 
-    // 用新消息覆盖掉原有的旧消息
-    // 看来是每个节点最多只保存一条信息？
-		if(stored->msg.payloadlen){
-			hier->retained = stored;
-			hier->retained->ref_count++;
-			db->retained_count++;
-		}else{
-			hier->retained = NULL;
+		if(leaf->context->sock == INVALID_SOCKET){
+			if(!offline) offline = leaf;
+			continue;
 		}
-	} // end of retain && set_retain
+		if(!best || leaf->context->cold->msg_count < best->context->cold->msg_count){
+			best = leaf;
+			if(db->config->shared_subscription_policy == sp_round_robin || !best->context->cold->msg_count) break;
+		}
+	}
+	if(!best) best = offline;
+	if(!best) best = hibernated;
+	if(best){
+		share->next = best - hier->subs + 1;
+	}
+	return best;
+}
 
-  // source_id
-	while(source_id && leaf){
+static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{//遍历每一个订阅的客户端，将当前消息挂入到其context->msg链表里面
 
-		if(leaf->context->is_bridge && !strcmp(leaf->context->id, source_id)){
-			leaf = leaf->next; // bridge不发给自己
-			continue;
+	int rc = 0;
+	int rc2;
+	struct _mosquitto_subleaf *leaf, *end;
+	struct _mosquitto_subshare *share, *tmp;
+
+	if(!source_id) return MOSQ_ERR_SUCCESS;
+
+  //当前节点下面订阅的客户端
+	end = hier->subs + hier->sub_count;
+	for(leaf = hier->subs; leaf < end; leaf++){
+		if(leaf->share){
+			continue; // 共享订阅在下面按组处理
+		}
+
+		if(leaf->flags & MOSQ_SUBLEAF_HIBERNATED){
+			rc2 = _subs_process_hibernated(db, leaf, topic, qos, stored);
+			if(rc2 != -1){
+				if(rc2) rc = 1;
+				continue;
+			}
+		}
+
+		if((leaf->flags & MOSQ_SUBLEAF_BRIDGE) && !strcmp(leaf->context->id, source_id)){
+			continue; // bridge不发给自己
 		}
 
 		/* Check for ACL topic access. */
 		rc2 = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ); //TODO 看看权限设置的实现
 		if(rc2 == MOSQ_ERR_ACL_DENIED){
-			leaf = leaf->next;
 			continue;
 		}else if(rc2 == MOSQ_ERR_SUCCESS){
       // 客户端有权限
-      // 对消息级别做转换
-			client_qos = leaf->qos;
-			if(db->config->upgrade_outgoing_qos){
-				msg_qos = client_qos;
-			}else{
-				if(qos > client_qos){
-					msg_qos = client_qos;
-				}else{
-					msg_qos = qos;
-				}
-			}
-
-      //QOS大于0的消息必须有msgid,这个msgid每个连接一个
-			if(msg_qos){
-				mid = _mosquitto_mid_generate(leaf->context);
-			}else{
-				mid = 0;
-			}
-
-			if(leaf->context->is_bridge){
-				/* If we know the client is a bridge then we should set retain
-				 * even if the message is fresh. If we don't do this, retained
-				 * messages won't be propagated. */
-				client_retain = retain;
-			}else{
-				/* Client is not a bridge and this isn't a stale message so
-				 * retain should be false. */
-				client_retain = false;
-			}
-
-      printf("a message is going to be inserted\n");
-      //将一条消息插入到context->msg链表后面，设置相关的状态。然后记录这条消息给哪些人发送过等
-			if(mqtt3_db_message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored) == 1) rc = 1;
-
+			if(_subs_process_leaf(db, leaf, topic, qos, retain, stored)) rc = 1;
 		}else{
 			rc = 1;
 		}
-		leaf = leaf->next;
-	} // end of source_id && leaf
+	}
+
+  // 每个共享订阅组只发给其中一个成员
+	HASH_ITER(hh, hier->shares, share, tmp){
+		leaf = _subs_share_pick(db, hier, share, source_id, topic);
+		if(leaf && (leaf->flags & MOSQ_SUBLEAF_HIBERNATED)){
+			rc2 = _subs_process_hibernated(db, leaf, topic, qos, stored);
+			if(rc2 != -1){
+				if(rc2) rc = 1;
+				continue;
+			}
+			if(mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ) != MOSQ_ERR_SUCCESS) continue;
+		}
+		if(leaf && _subs_process_leaf(db, leaf, topic, qos, retain, stored)) rc = 1;
+	}
 	return rc;
 }
 
-static int _sub_topic_tokenise(const char *subtopic, struct _sub_token **topics)
-{ // 按照"/"对订阅主题进行划分
-	struct _sub_token *new_topic, *tail = NULL;
+/* Split topic into levels: a leading / is a level of its own and empty levels
+ * are skipped. *levels points into *buf and both must be freed by the
+ * caller. */
+int mqtt3_sub_topic_tokenise(const char *topic, char **buf, char ***levels, int *level_count)
+{
+	char *local;
 	char *token;
-	char *local_subtopic = NULL;
 	char *saveptr = NULL;
-	char *real_subtopic;
+	char **l;
+	const char *c;
+	int count = 0;
+	int max = 2;
 
-	assert(subtopic);
-	assert(topics);
+	for(c=topic; *c; c++){
+		if(*c == '/') max++;
+	}
+
+	local = _mosquitto_strdup(topic);
+	if(!local) return MOSQ_ERR_NOMEM;
+	l = _mosquitto_malloc(sizeof(char *)*max);
+	if(!l){
+		_mosquitto_free(local);
+		return MOSQ_ERR_NOMEM;
+	}
 
-	if(strlen(subtopic) == 0) return 1;
+	if(local[0] == '/'){ //第一个字符是斜杠的话算一个话题，
+		l[count++] = "/";
+	}
+	token = strtok_r(local, "/", &saveptr);
+	while(token){
+		l[count++] = token;
+		token = strtok_r(NULL, "/", &saveptr);
+	}
 
-	local_subtopic = _mosquitto_strdup(subtopic);
-	if(!local_subtopic) return MOSQ_ERR_NOMEM;
-	real_subtopic = local_subtopic; //记住头部
+	*buf = local;
+	*levels = l;
+	*level_count = count;
+	return MOSQ_ERR_SUCCESS;
+}
 
-	if(local_subtopic[0] == '/'){ //第一个字符是斜杠的话算一个话题，
-		new_topic = _mosquitto_malloc(sizeof(struct _sub_token));
-		if(!new_topic) goto cleanup;
-		new_topic->next = NULL;
-		new_topic->topic = _mosquitto_strdup("/");
-		if(!new_topic->topic) goto cleanup;
+/* Copy count levels into a single block, the pointers followed by the
+ * strings they point at. */
+static char **_sub_levels_dup(char **first, int first_count, char **second, int second_count)
+{
+	char **levels;
+	char *str;
+	size_t len;
+	int i;
 
-		*topics = new_topic;
-		tail = new_topic;
+	len = sizeof(char *)*(first_count + second_count);
+	for(i=0; i<first_count; i++){
+		len += strlen(first[i]) + 1;
+	}
+	for(i=0; i<second_count; i++){
+		len += strlen(second[i]) + 1;
+	}
+	levels = _mosquitto_malloc(len);
+	if(!levels) return NULL;
+
+	str = (char *)&levels[first_count + second_count];
+	for(i=0; i<first_count; i++){
+		levels[i] = str;
+		strcpy(str, first[i]);
+		str += strlen(first[i]) + 1;
+	}
+	for(i=0; i<second_count; i++){
+		levels[first_count+i] = str;
+		strcpy(str, second[i]);
+		str += strlen(second[i]) + 1;
+	}
+	return levels;
+}
 
-		local_subtopic++;
+static struct _mosquitto_subhier *_sub_hier_new(struct _mosquitto_subhier *parent, char **levels, int level_count)
+{
+	struct _mosquitto_subhier *hier;
+
+	hier = _mosquitto_calloc(1, sizeof(struct _mosquitto_subhier));
+	if(!hier) return NULL;
+	hier->levels = _sub_levels_dup(levels, level_count, NULL, 0);
+	if(!hier->levels){
+		_mosquitto_free(hier);
+		return NULL;
 	}
+	hier->level_count = level_count;
+	hier->parent = parent;
+	if(parent){
+		HASH_ADD_KEYPTR(hh, parent->children, hier->levels[0], strlen(hier->levels[0]), hier);
+	}
+	return hier;
+}
 
-	token = strtok_r(local_subtopic, "/", &saveptr);
-	while(token){ // 一节一节的处理，形成一个单向链表，挂在参数topics上面，供上层使用
-		new_topic = _mosquitto_malloc(sizeof(struct _sub_token));
-		if(!new_topic) goto cleanup;
-		new_topic->next = NULL;
-		new_topic->topic = _mosquitto_strdup(token);
-		if(!new_topic->topic) goto cleanup;
+static void _sub_share_free(struct _mosquitto_subhier *hier, struct _mosquitto_subshare *share)
+{
+	HASH_DELETE(hh, hier->shares, share);
+	_mosquitto_free(share->name);
+	_mosquitto_free(share);
+}
 
-		if(tail){
-			tail->next = new_topic;
-			tail = tail->next;
-		}else{
-			tail = new_topic;
-			*topics = tail;
-		}
-		token = strtok_r(NULL, "/", &saveptr);
+static void _sub_hier_free(struct _mosquitto_subhier *hier)
+{
+	struct _mosquitto_subshare *share, *tmp;
+
+	HASH_ITER(hh, hier->shares, share, tmp){
+		_sub_share_free(hier, share);
 	}
+	if(hier->subs) _mosquitto_free(hier->subs);
+	_mosquitto_free(hier->levels);
+	_mosquitto_free(hier);
+}
 
-	_mosquitto_free(real_subtopic);
+static bool _sub_hier_is_hash(struct _mosquitto_subhier *hier)
+{
+	return hier->level_count == 1 && !strcmp(hier->levels[0], "#");
+}
 
-	return MOSQ_ERR_SUCCESS;
+/* Add delta to the summary counts of hier and everything above it. A
+ * subscription counts towards plus_below of the nodes above the first + on
+ * its path, and towards hash_below of every node above a # node. */
+static void _sub_summary_update(struct _mosquitto_subhier *hier, int delta)
+{
+	bool plus = false;
+	bool hash;
+	int i;
 
-cleanup:
-	_mosquitto_free(real_subtopic);
+	hash = _sub_hier_is_hash(hier);
+	hier->subs_below += delta;
+	while(hier->parent){
+		for(i=0; !plus && i<hier->level_count; i++){
+			if(!strcmp(hier->levels[i], "+")) plus = true;
+		}
+		hier = hier->parent;
+		hier->subs_below += delta;
+		if(plus) hier->plus_below += delta;
+		if(hash) hier->hash_below += delta;
+	}
+}
 
-	tail = *topics;
-	*topics = NULL;
-	while(tail){
-		if(tail->topic) _mosquitto_free(tail->topic);
-		new_topic = tail->next;
-		_mosquitto_free(tail);
-		tail = new_topic;
+/* Split the edge leading to hier after its first n levels. The node that is
+ * created there takes hier's place in the tree and is returned. */
+static struct _mosquitto_subhier *_sub_hier_split(struct _mosquitto_subhier *hier, int n)
+{
+	struct _mosquitto_subhier *parent, *top;
+	char **rest;
+	int i;
+
+	parent = hier->parent;
+	rest = _sub_levels_dup(&hier->levels[n], hier->level_count-n, NULL, 0);
+	if(!rest) return NULL;
+	top = _sub_hier_new(NULL, hier->levels, n);
+	if(!top){
+		_mosquitto_free(rest);
+		return NULL;
+	}
+
+	HASH_DELETE(hh, parent->children, hier);
+	top->parent = parent;
+	HASH_ADD_KEYPTR(hh, parent->children, top->levels[0], strlen(top->levels[0]), top);
+
+	_mosquitto_free(hier->levels);
+	hier->levels = rest;
+	hier->level_count -= n;
+	hier->parent = top;
+	HASH_ADD_KEYPTR(hh, top->children, hier->levels[0], strlen(hier->levels[0]), hier);
+
+	/* Everything that was below parent through hier is now below top. */
+	top->subs_below = hier->subs_below;
+	top->hash_below = hier->hash_below;
+	top->plus_below = hier->plus_below;
+	for(i=0; i<hier->level_count; i++){
+		if(!strcmp(hier->levels[i], "+")){
+			top->plus_below = hier->subs_below;
+			break;
+		}
 	}
-	return 1;
+	return top;
 }
 
-static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
-{//递归的查找参数tokens链表代表的路径段，并在查找的过程中生成不存在的订阅节点
-  // 找到其最终的订阅位置，放到subs链表里面,返回MOSQ_ERR_SUCCESS表示成功，-1表示重复订阅
+/* hier has no subscriptions and a single child: fold it into the edge leading
+ * to that child. # nodes are always kept on their own. */
+static void _sub_hier_merge(struct _mosquitto_subhier *hier)
+{
+	struct _mosquitto_subhier *parent, *child;
+	char **levels;
 
-	struct _mosquitto_subhier *branch, *last = NULL;
-	struct _mosquitto_subleaf *leaf, *last_leaf;
+	child = hier->children;
+	if(_sub_hier_is_hash(child)) return;
+	levels = _sub_levels_dup(hier->levels, hier->level_count, child->levels, child->level_count);
+	if(!levels) return; /* Not merging is harmless. */
 
-	if(!tokens){ //tokens为空，只需要将当前订阅放到当前主题的订阅链表下面，即subhier->subs链表后面
+	parent = hier->parent;
+	HASH_DELETE(hh, hier->children, child);
+	HASH_DELETE(hh, parent->children, hier);
 
-    // context为空相当于一个hack，就是单纯为了创建订阅节点
-		if(context){
-			leaf = subhier->subs; //遍历这个主题下面的所有客户端，然后把我们的客户端加进去
-			last_leaf = NULL;
-
-			while(leaf){ // O(n)，数据量大会有性能问题
-				if(!strcmp(leaf->context->id, context->id)){
-					/* Client making a second subscription to same topic. Only
-					 * need to update QoS. Return -1 to indicate this to the
-					 * calling function. */
-					leaf->qos = qos;
-					return -1;
-				}
-				last_leaf = leaf;
-				leaf = leaf->next;
-			}
+	_mosquitto_free(child->levels);
+	child->levels = levels;
+	child->level_count += hier->level_count;
+	child->parent = parent;
+	HASH_ADD_KEYPTR(hh, parent->children, child->levels[0], strlen(child->levels[0]), child);
 
-			leaf = _mosquitto_malloc(sizeof(struct _mosquitto_subleaf));
-			if(!leaf) return MOSQ_ERR_NOMEM;
-			leaf->next = NULL;
-			leaf->context = context; // 指向订阅的客户端，保持对客户端的记录
-			leaf->qos = qos;
-			if(last_leaf){
-        // 什么时候变成双向链表的？？
-				last_leaf->next = leaf;
-				leaf->prev = last_leaf;
-			}else{
-				subhier->subs = leaf;
-				leaf->prev = NULL;
-			}
-			db->subscription_count++;
+	_sub_hier_free(hier);
+}
+
+/* Add a subscription for context to the end of hier->subs, and its back
+ * reference to the end of the subs of the context. */
+static int _sub_leaf_add(struct mosquitto_db *db, struct _mosquitto_subhier *hier, struct mosquitto *context, int qos, struct _mosquitto_subshare *share)
+{
+	struct mosquitto_cold *cold;
+	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subref *ref;
+	int max;
+
+	cold = mqtt3_context_cold(context);
+	if(!cold) return MOSQ_ERR_NOMEM;
+
+	if(hier->sub_count == hier->sub_max){
+		max = hier->sub_max ? hier->sub_max*2 : 2;
+		leaf = _mosquitto_realloc(hier->subs, max*sizeof(struct _mosquitto_subleaf));
+		if(!leaf) return MOSQ_ERR_NOMEM;
+		hier->subs = leaf;
+		hier->sub_max = max;
+	}
+	if(cold->sub_count == cold->sub_max){
+		max = cold->sub_max ? cold->sub_max*2 : 4;
+		ref = _mosquitto_realloc(cold->subs, max*sizeof(struct _mosquitto_subref));
+		if(!ref) return MOSQ_ERR_NOMEM;
+		cold->subs = ref;
+		cold->sub_max = max;
+	}
+
+	leaf = &hier->subs[hier->sub_count];
+	leaf->context = context;
+	leaf->share = share;
+	leaf->ref = cold->sub_count;
+	leaf->qos = qos;
+	leaf->flags = context->is_bridge ? MOSQ_SUBLEAF_BRIDGE : 0;
+
+	ref = &cold->subs[cold->sub_count];
+	ref->hier = hier;
+	ref->leaf = hier->sub_count;
+
+	if(share) share->member_count++;
+	hier->sub_count++;
+	cold->sub_count++;
+	db->subscription_count++;
+	db->sub_generation++;
+	_sub_summary_update(hier, 1);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Remove hier->subs[index] and its back reference, moving the last entry of
+ * each array into the hole. */
+static void _sub_leaf_remove(struct mosquitto_db *db, struct _mosquitto_subhier *hier, int index)
+{
+	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subref *ref, *refs;
+	struct _mosquitto_subshare *share;
+	int *ref_count;
+	int r;
+
+	leaf = &hier->subs[index];
+	if(leaf->flags & MOSQ_SUBLEAF_HIBERNATED){
+		refs = leaf->hibernated->subs;
+		ref_count = &leaf->hibernated->sub_count;
+	}else{
+		refs = leaf->context->cold->subs;
+		ref_count = &leaf->context->cold->sub_count;
+	}
+	share = leaf->share;
+	r = leaf->ref;
+
+	if(share){
+		share->member_count--;
+		if(!share->member_count) _sub_share_free(hier, share);
+	}
+
+	hier->sub_count--;
+	if(index != hier->sub_count){
+		hier->subs[index] = hier->subs[hier->sub_count];
+		leaf = &hier->subs[index];
+		if(leaf->flags & MOSQ_SUBLEAF_HIBERNATED){
+			leaf->hibernated->subs[leaf->ref].leaf = index;
+		}else{
+			leaf->context->cold->subs[leaf->ref].leaf = index;
 		}
-		return MOSQ_ERR_SUCCESS;
 	}
 
-  // 遍历找出当前节点下的主题和tokens要订阅的主题
-	branch = subhier->children;
-	while(branch){
-		if(!strcmp(branch->topic, tokens->topic)){
-			return _sub_add(db, context, qos, branch, tokens->next);
+	(*ref_count)--;
+	if(r != *ref_count){
+		refs[r] = refs[*ref_count];
+		ref = &refs[r];
+		ref->hier->subs[ref->leaf].ref = r;
+	}
+	db->subscription_count--;
+	db->sub_generation++;
+	_sub_summary_update(hier, -1);
+}
+
+/* Find where context is subscribed on hier, using the client's own list of
+ * subscriptions rather than the node's. Returns the index in hier->subs or -1. */
+static int _sub_leaf_find(struct _mosquitto_subhier *hier, struct mosquitto *context, struct _mosquitto_subshare *share)
+{
+	struct mosquitto_cold *cold = context->cold;
+	int i;
+
+	if(!cold) return -1;
+	for(i=0; i<cold->sub_count; i++){
+		if(cold->subs[i].hier == hier && hier->subs[cold->subs[i].leaf].share == share){
+			return cold->subs[i].leaf;
 		}
-		last = branch;
-		branch = branch->next;
 	}
+	return -1;
+}
 
-	/* Not found */
-  // 这是一个新的topic节点，在这里构建topic链和对应的客户端链
-	branch = _mosquitto_calloc(1, sizeof(struct _mosquitto_subhier));
-	if(!branch) return MOSQ_ERR_NOMEM;
-	branch->topic = _mosquitto_strdup(tokens->topic);
-	if(!branch->topic){
-		_mosquitto_free(branch);
-		return MOSQ_ERR_NOMEM;
+/* Free hier, and then its parents, for as long as they are left with neither
+ * subscriptions nor children. A node that is left with no subscriptions and
+ * one child is merged into it. The top level nodes directly under root are
+ * never removed. */
+static void _sub_prune(struct _mosquitto_subhier *root, struct _mosquitto_subhier *hier)
+{
+	struct _mosquitto_subhier *parent;
+
+	while(hier->parent && hier->parent != root && !hier->children && !hier->sub_count){
+		parent = hier->parent;
+		HASH_DELETE(hh, parent->children, hier);
+		_sub_hier_free(hier);
+		hier = parent;
 	}
-	if(!last){
-		subhier->children = branch;
-	}else{
-		last->next = branch;
+	if(hier->parent && hier->parent != root && !hier->sub_count && HASH_COUNT(hier->children) == 1){
+		_sub_hier_merge(hier);
 	}
-	return _sub_add(db, context, qos, branch, tokens->next);
 }
 
-static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+static struct _mosquitto_subhier *_sub_tree_find(struct _mosquitto_subhier *root, const char *name)
 {
-	struct _mosquitto_subhier *branch, *last = NULL;
-	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subhier *tree;
 
-  // 作者对整个结构采用了枝叶的描述
-  // 枝代表层级
-  // 叶代表订阅的客户端
-	if(!tokens){
-		leaf = subhier->subs;
-		while(leaf){
-			if(leaf->context==context){
-				db->subscription_count--;
-				if(leaf->prev){
-					leaf->prev->next = leaf->next;
-				}else{
-					subhier->subs = leaf->next;
-				}
-				if(leaf->next){
-					leaf->next->prev = leaf->prev;
-				}
-				_mosquitto_free(leaf);
-				return MOSQ_ERR_SUCCESS;
-			}
-			leaf = leaf->next;
+	HASH_FIND(hh, root->children, name, strlen(name), tree);
+	return tree;
+}
+
+static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, char **levels, int level_count, const char *group)
+{//沿着levels代表的路径找到订阅的位置，在查找的过程中生成不存在的订阅节点，必要时拆分压缩过的边
+  // 找到其最终的订阅位置，放到subs数组里面,返回MOSQ_ERR_SUCCESS表示成功，-1表示重复订阅
+
+	struct _mosquitto_subhier *child;
+	struct _mosquitto_subshare *share = NULL;
+	int i = 0;
+	int j, n;
+	int rc;
+
+	while(i < level_count){
+		HASH_FIND(hh, subhier->children, levels[i], strlen(levels[i]), child);
+		if(!child){
+			/* Nothing else shares the rest of the path, so it becomes a
+			 * single edge. A trailing # gets a node of its own. */
+			n = level_count - i;
+			if(n > 1 && !strcmp(levels[level_count-1], "#")) n--;
+			child = _sub_hier_new(subhier, &levels[i], n);
+			if(!child) return MOSQ_ERR_NOMEM;
+			subhier = child;
+			i += n;
+			continue;
 		}
-		return MOSQ_ERR_SUCCESS;
+		/* Follow the edge for as long as it agrees with the subscription. */
+		for(j=1; j<child->level_count && i+j<level_count; j++){
+			if(strcmp(child->levels[j], levels[i+j])) break;
+		}
+		if(j < child->level_count){
+			child = _sub_hier_split(child, j);
+			if(!child) return MOSQ_ERR_NOMEM;
+		}
+		subhier = child;
+		i += j;
 	}
 
-	branch = subhier->children;
-	while(branch){
-		if(!strcmp(branch->topic, tokens->topic)){
-			_sub_remove(db, context, branch, tokens->next);
-			if(!branch->children && !branch->subs && !branch->retained){
-				if(last){
-					last->next = branch->next;
-				}else{
-					subhier->children = branch->next;
+    // context为空相当于一个hack，就是单纯为了创建订阅节点
+	if(context){
+		if(group){
+			HASH_FIND(hh, subhier->shares, group, strlen(group), share);
+			if(!share){
+				share = _mosquitto_calloc(1, sizeof(struct _mosquitto_subshare));
+				if(!share) return MOSQ_ERR_NOMEM;
+				share->name = _mosquitto_strdup(group);
+				if(!share->name){
+					_mosquitto_free(share);
+					return MOSQ_ERR_NOMEM;
 				}
-				_mosquitto_free(branch->topic);
-				_mosquitto_free(branch);
+				HASH_ADD_KEYPTR(hh, subhier->shares, share->name, strlen(share->name), share);
 			}
-			return MOSQ_ERR_SUCCESS;
 		}
-		last = branch;
-		branch = branch->next;
+		i = _sub_leaf_find(subhier, context, share);
+		if(i != -1){
+			/* Client making a second subscription to same topic. Only
+			 * need to update QoS. Return -1 to indicate this to the
+			 * calling function. */
+			subhier->subs[i].qos = qos;
+			return -1;
+		}
+		rc = _sub_leaf_add(db, subhier, context, qos, share);
+		if(rc && share && !share->member_count) _sub_share_free(subhier, share);
+		return rc;
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
+static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, char **levels, int level_count, const char *group)
+{
+	struct _mosquitto_subhier *child;
+	struct _mosquitto_subshare *share = NULL;
+	int i = 0;
+	int j;
+
+	while(i < level_count){
+		HASH_FIND(hh, subhier->children, levels[i], strlen(levels[i]), child);
+		if(!child || child->level_count > level_count - i) return MOSQ_ERR_SUCCESS;
+		for(j=1; j<child->level_count; j++){
+			if(strcmp(child->levels[j], levels[i+j])) return MOSQ_ERR_SUCCESS;
+		}
+		subhier = child;
+		i += j;
+	}
+
+	if(group){
+		HASH_FIND(hh, subhier->shares, group, strlen(group), share);
+		if(!share) return MOSQ_ERR_SUCCESS;
+	}
+	i = _sub_leaf_find(subhier, context, share);
+	if(i != -1){
+		_sub_leaf_remove(db, subhier, i);
+		_sub_prune(&db->subs, subhier);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
 
-static int _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+/* Remember a node whose subscriptions match the topic being published to.
+ * Nodes without any subscribers aren't worth keeping. */
+static int _sub_match_add(struct mosquitto_db *db, struct _mosquitto_subhier *hier)
 {
-	/* FIXME - need to take into account source_id if the client is a bridge */
-	struct _mosquitto_subhier *branch;
-	int flag = 0;
-	bool sr;
+	struct _mosquitto_subhier **matches;
+	int max;
 
-	branch = subhier->children;
-	while(branch){
-		sr = set_retain;
+	if(!hier->sub_count) return MOSQ_ERR_SUCCESS;
 
-		if(tokens && tokens->topic && (!strcmp(branch->topic, tokens->topic) || !strcmp(branch->topic, "+"))){
-			/* The topic matches this subscription.
-			 * Doesn't include # wildcards */
-			if(!strcmp(branch->topic, "+")){
-				/* Don't set a retained message where + is in the hierarchy. */
-				sr = false;
-			}
+	if(db->sub_match_count == db->sub_match_max){
+		max = db->sub_match_max ? db->sub_match_max*2 : 16;
+		matches = _mosquitto_realloc(db->sub_matches, max*sizeof(struct _mosquitto_subhier *));
+		if(!matches) return MOSQ_ERR_NOMEM;
+		db->sub_matches = matches;
+		db->sub_match_max = max;
+	}
+	db->sub_matches[db->sub_match_count++] = hier;
+	return MOSQ_ERR_SUCCESS;
+}
 
-			if(_sub_search(db, branch, tokens->next, source_id, topic, qos, retain, stored, sr) == -1){
-				flag = -1;
-			}
+static int _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, char **levels, int level_count);
 
-      //在当前这一个层级下面，找到了对应的那个话题，然后我们的tokens也匹配完了
-      //所以在这一个地方开始我们的subs处理
-			if(!tokens->next){
-				_subs_process(db, branch, source_id, topic, qos, retain, stored, sr);
-			}
+/* Follow the edge leading to child, whose first level is already known to
+ * match levels[0], and carry on below it. */
+static int _sub_search_edge(struct mosquitto_db *db, struct _mosquitto_subhier *child, char **levels, int level_count)
+{
+	int i;
 
-		}else if(!strcmp(branch->topic, "#") && !branch->children){
-			/* The topic matches due to a # wildcard - process the
-			 * subscriptions but *don't* return. Although this branch has ended
-			 * there may still be other subscriptions to deal with.
-			 */
-			_subs_process(db, branch, source_id, topic, qos, retain, stored, false);
-			flag = -1;
+	/* Edges never hold a #, so they can't match a shorter topic. */
+	if(child->level_count > level_count) return MOSQ_ERR_SUCCESS;
+	for(i=1; i<child->level_count; i++){
+		if(strcmp(child->levels[i], "+") && strcmp(child->levels[i], levels[i])){
+			return MOSQ_ERR_SUCCESS;
 		}
-		branch = branch->next;
 	}
-	return flag;
+	levels += child->level_count;
+	level_count -= child->level_count;
+
+	if(!level_count){
+		if(_sub_match_add(db, child)) return MOSQ_ERR_NOMEM;
+	}else if(child->subs_below == child->sub_count){
+		/* Nothing below here that could match the rest of the topic. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	return _sub_search(db, child, levels, level_count);
+}
+
+static int _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, char **levels, int level_count)
+{
+	struct _mosquitto_subhier *child;
+	int rc;
+
+	/* The summary counts say whether a # or + child is worth looking for. A
+	 * # matches here even once the topic has run out, so a/# matches a. */
+	if(subhier->hash_below){
+		HASH_FIND(hh, subhier->children, "#", 1, child);
+		if(child && _sub_match_add(db, child)) return MOSQ_ERR_NOMEM;
+	}
+	if(!level_count) return MOSQ_ERR_SUCCESS;
+
+	HASH_FIND(hh, subhier->children, levels[0], strlen(levels[0]), child);
+	if(child){
+		rc = _sub_search_edge(db, child, levels, level_count);
+		if(rc) return rc;
+	}
+	if(subhier->plus_below){
+		HASH_FIND(hh, subhier->children, "+", 1, child);
+		if(child){
+			rc = _sub_search_edge(db, child, levels, level_count);
+			if(rc) return rc;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Split a shared subscription, $share/<group>/<filter>, into its group and
+ * filter. Returns false for any other subscription, including a $share topic
+ * that lacks either part or has a wildcard in the group name. */
+bool mqtt3_sub_share_split(const char *sub, const char **group, int *group_len, const char **filter)
+{
+	const char *g, *c;
+
+	if(strncmp(sub, "$share/", 7)) return false;
+	g = sub + 7;
+	for(c=g; *c && *c != '/'; c++){
+		if(*c == '+' || *c == '#') return false;
+	}
+	if(c == g || *c != '/' || c[1] == '\0') return false;
+
+	*group = g;
+	*group_len = c - g;
+	*filter = c + 1;
+	return true;
 }
 
 int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root)
 {//将一个订阅的topic加入到root参数，也就是订阅树&db->subs上面,这里需要区分$SYS还是正常的客户端订阅
 
-	int tree;
 	int rc = 0;
 	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
+	char *buf;
+	char **levels;
+	int level_count;
+	char *group = NULL;
+	const char *group_start;
+	int group_len;
 
 	assert(root);
 	assert(sub);
 
+	if(mqtt3_sub_share_split(sub, &group_start, &group_len, &sub)){
+		group = _mosquitto_malloc(group_len + 1);
+		if(!group) return MOSQ_ERR_NOMEM;
+		memcpy(group, group_start, group_len);
+		group[group_len] = '\0';
+	}
+
   // 拆解sub主题
 	if(!strncmp(sub, "$SYS/", 5)){ //系统属性区别对待
-		tree = 2;
-		if(strlen(sub+5) == 0) return MOSQ_ERR_SUCCESS;
-		if(_sub_topic_tokenise(sub+5, &tokens)) return 1;
+		sub += 5;
+		subhier = _sub_tree_find(root, "$SYS");
 	}else{
-		tree = 0;
-		if(strlen(sub) == 0) return MOSQ_ERR_SUCCESS;
-		if(_sub_topic_tokenise(sub, &tokens)) return 1;
+		subhier = _sub_tree_find(root, "");
 	}
-
-
-  // 感觉像是一颗订阅树
-	subhier = root->children; //mqtt3_db_open初始化的时候初始分配了2个节点，一个数据节点和$SYS系统数据节点
-	while(subhier){
-		if(!strcmp(subhier->topic, "") && tree == 0){
-      // 正常的数据节点，mqtt3_add_open的时候初始化的
-			rc = _sub_add(db, context, qos, subhier, tokens);
-			break;
-		}else if(!strcmp(subhier->topic, "$SYS") && tree == 2){
-      //tree=2，订阅到$SYS的下面
-			rc = _sub_add(db, context, qos, subhier, tokens);
-			break;
-		}
-		subhier = subhier->next;
+	if(strlen(sub) == 0 || !subhier){
+		if(group) _mosquitto_free(group);
+		return MOSQ_ERR_SUCCESS;
 	}
-
-  // 释放掉整个订阅树
-	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
+	if(mqtt3_sub_topic_tokenise(sub, &buf, &levels, &level_count)){
+		if(group) _mosquitto_free(group);
+		return 1;
 	}
 
+	rc = _sub_add(db, context, qos, subhier, levels, level_count, group);
+
+	_mosquitto_free(levels);
+	_mosquitto_free(buf);
+	if(group) _mosquitto_free(group);
 
 	/* We aren't worried about -1 (already subscribed) return codes. */
 	if(rc == -1) rc = MOSQ_ERR_SUCCESS;
 	return rc;
-
 }
 
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
-	int tree;
 	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
+	char *buf;
+	char **levels;
+	int level_count;
+	char *group = NULL;
+	const char *group_start;
+	int group_len;
 
 	assert(root);
 	assert(sub);
 
+	if(mqtt3_sub_share_split(sub, &group_start, &group_len, &sub)){
+		group = _mosquitto_malloc(group_len + 1);
+		if(!group) return MOSQ_ERR_NOMEM;
+		memcpy(group, group_start, group_len);
+		group[group_len] = '\0';
+	}
+
 	if(!strncmp(sub, "$SYS/", 5)){
-		tree = 2;
-		if(_sub_topic_tokenise(sub+5, &tokens)) return 1;
+		sub += 5;
+		subhier = _sub_tree_find(root, "$SYS");
 	}else{
-		tree = 0;
-		if(_sub_topic_tokenise(sub, &tokens)) return 1;
+		subhier = _sub_tree_find(root, "");
+	}
+	if(strlen(sub) == 0 || !subhier || mqtt3_sub_topic_tokenise(sub, &buf, &levels, &level_count)){
+		if(group) _mosquitto_free(group);
+		return 1;
 	}
 
-	subhier = root->children;
-	while(subhier){
-		if(!strcmp(subhier->topic, "") && tree == 0){
-			rc = _sub_remove(db, context, subhier, tokens);
-			break;
-		}else if(!strcmp(subhier->topic, "$SYS") && tree == 2){
-			rc = _sub_remove(db, context, subhier, tokens);
-			break;
+	rc = _sub_remove(db, context, subhier, levels, level_count, group);
+
+	_mosquitto_free(levels);
+	_mosquitto_free(buf);
+	if(group) _mosquitto_free(group);
+
+	return rc;
+}
+
+static void _sub_match_cache_free(struct mosquitto_db *db, struct _mosquitto_match_cache *entry)
+{
+	HASH_DELETE(hh, db->match_cache, entry);
+	_mosquitto_free(entry->topic);
+	if(entry->matches) _mosquitto_free(entry->matches);
+	_mosquitto_free(entry);
+}
+
+/* Look topic up in the match cache. On a hit the cached nodes are copied to
+ * db->sub_matches and MOSQ_ERR_SUCCESS is returned. */
+static int _sub_match_cache_get(struct mosquitto_db *db, const char *topic, struct _mosquitto_match_cache **entry)
+{
+	struct _mosquitto_match_cache *e;
+	struct _mosquitto_subhier **matches;
+
+	HASH_FIND(hh, db->match_cache, topic, strlen(topic), e);
+	*entry = e;
+	if(!e) return 1;
+
+	/* Re-adding moves the entry to the back, so the front of the hash is
+	 * always the least recently used entry. */
+	HASH_DELETE(hh, db->match_cache, e);
+	HASH_ADD_KEYPTR(hh, db->match_cache, e->topic, strlen(e->topic), e);
+
+	/* Nodes may have been freed since the entry was made. */
+	if(e->generation != db->sub_generation) return 1;
+
+	if(e->match_count > db->sub_match_max){
+		matches = _mosquitto_realloc(db->sub_matches, e->match_count*sizeof(struct _mosquitto_subhier *));
+		if(!matches) return 1;
+		db->sub_matches = matches;
+		db->sub_match_max = e->match_count;
+	}
+	if(e->match_count){
+		memcpy(db->sub_matches, e->matches, e->match_count*sizeof(struct _mosquitto_subhier *));
+	}
+	db->sub_match_count = e->match_count;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Remember the contents of db->sub_matches as the result for topic, reusing
+ * entry if the topic was already cached. */
+static void _sub_match_cache_put(struct mosquitto_db *db, const char *topic, struct _mosquitto_match_cache *entry)
+{
+	struct _mosquitto_subhier **matches = NULL;
+
+	if(db->sub_match_count){
+		matches = _mosquitto_malloc(db->sub_match_count*sizeof(struct _mosquitto_subhier *));
+		if(!matches){
+			if(entry) _sub_match_cache_free(db, entry);
+			return;
 		}
-		subhier = subhier->next;
+		memcpy(matches, db->sub_matches, db->sub_match_count*sizeof(struct _mosquitto_subhier *));
 	}
 
-	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
+	if(!entry){
+		while(db->match_cache && HASH_COUNT(db->match_cache) >= (unsigned int)db->config->match_cache_size){
+			_sub_match_cache_free(db, db->match_cache);
+		}
+		entry = _mosquitto_calloc(1, sizeof(struct _mosquitto_match_cache));
+		if(!entry){
+			if(matches) _mosquitto_free(matches);
+			return;
+		}
+		entry->topic = _mosquitto_strdup(topic);
+		if(!entry->topic){
+			_mosquitto_free(entry);
+			if(matches) _mosquitto_free(matches);
+			return;
+		}
+		HASH_ADD_KEYPTR(hh, db->match_cache, entry->topic, strlen(entry->topic), entry);
+	}else if(entry->matches){
+		_mosquitto_free(entry->matches);
 	}
+	entry->matches = matches;
+	entry->match_count = db->sub_match_count;
+	entry->generation = db->sub_generation;
+}
 
-	return rc;
+static void _sub_match_cache_clean(struct mosquitto_db *db)
+{
+	while(db->match_cache){
+		_sub_match_cache_free(db, db->match_cache);
+	}
 }
 
-// 把消息插入客户端自己维护的消息队列里面
-int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+/* Find the subscription tree nodes that a message published to topic would
+ * be delivered through, without touching any client. The nodes are left in
+ * db->sub_matches for mqtt3_sub_deliver(), so a publish that nobody is
+ * subscribed to can be dropped before anything is stored for it. Results are
+ * kept in a cache of up to match_cache_size topics until the next
+ * subscription change. */
+int mqtt3_sub_match(struct mosquitto_db *db, const char *topic)
 {
-	int rc = 0;
-	int tree;
+	int rc;
 	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
+	struct _mosquitto_match_cache *entry = NULL;
+	const char *local_topic;
+	char *buf;
+	char **levels;
+	int level_count;
+	bool cache;
 
 	assert(db);
 	assert(topic);
 
+	db->sub_match_count = 0;
+
   // 判断话题类型，解构话题成分
-	if(!strncmp(topic, "$SYS/", 5)){
-		tree = 2;
-		if(_sub_topic_tokenise(topic+5, &tokens)) return 1;
+	local_topic = topic;
+	if(!strncmp(local_topic, "$SYS/", 5)){
+		local_topic += 5;
+		subhier = _sub_tree_find(&db->subs, "$SYS");
 	}else{
-		tree = 0;
-		if(_sub_topic_tokenise(topic, &tokens)) return 1;
+		subhier = _sub_tree_find(&db->subs, "");
+	}
+	/* Don't bother splitting the topic up if nobody is subscribed at all. */
+	if(!subhier || !subhier->subs_below) return MOSQ_ERR_SUCCESS;
+	if(strlen(local_topic) == 0) return 1;
+
+	cache = db->config->match_cache_size > 0;
+	if(cache){
+		if(!_sub_match_cache_get(db, topic, &entry)){
+			db->match_cache_hits++;
+			return MOSQ_ERR_SUCCESS;
+		}
+		db->match_cache_misses++;
+	}else if(db->match_cache){
+		/* The cache has been turned off by a reload. */
+		_sub_match_cache_clean(db);
 	}
 
-	subhier = db->subs.children;
-	while(subhier){
-
-		if(!strcmp(subhier->topic, "") && tree == 0 || !strcmp(subhier->topic, "$SYS") && tree == 2){
+	if(mqtt3_sub_topic_tokenise(local_topic, &buf, &levels, &level_count)) return 1;
 
-			if(retain){
-				/* We have a message that needs to be retained, so ensure that the subscription
-				 * tree for its topic exists.
-				 */
-        //注意这个参数，为NULL的话，不会真的挂载订阅节点的，因为是NULL，没有客户端，但是会创建空的分支节点的
-				_sub_add(db, NULL, 0, subhier, tokens);
-			}
+	rc = _sub_search(db, subhier, levels, level_count);
 
-      //下面搜索订阅树，如果碰到中间有人订阅万能通配符，那么返回-1，这是什么意思?
-			rc = _sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored, true);
-			if(rc == -1){
-        //如果retain那么挂入当前节点的hier->retained指针一个消息。然后遍历每一个订阅的客户端，将当前消息挂入到其context->msg链表里面
-				_subs_process(db, subhier, source_id, topic, qos, retain, stored, true);
-				rc = 0;
-			}
-		}
+	_mosquitto_free(levels);
+	_mosquitto_free(buf);
 
-		subhier = subhier->next;
+	if(!rc && cache){
+		_sub_match_cache_put(db, topic, entry);
 	}
+	return rc;
+}
+
+/* Queue a stored message for every subscription found by the last call to
+ * mqtt3_sub_match(). */
+int mqtt3_sub_deliver(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_subhier **matches;
+	int count, max;
+	int i;
 
-  // do the clean job
-	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
+	/* Take the list out of the db while we work through it, delivering can
+	 * end up publishing another message (a will, for example). */
+	matches = db->sub_matches;
+	count = db->sub_match_count;
+	max = db->sub_match_max;
+	db->sub_matches = NULL;
+	db->sub_match_count = 0;
+	db->sub_match_max = 0;
+
+	for(i=0; i<count; i++){
+    //遍历每一个订阅的客户端，将当前消息挂入到其context->msg链表里面
+		_subs_process(db, matches[i], source_id, topic, qos, retain, stored);
 	}
 
-	return rc;
+	if(db->sub_matches) _mosquitto_free(db->sub_matches);
+	db->sub_matches = matches;
+	db->sub_match_max = max;
+
+	return MOSQ_ERR_SUCCESS;
 }
 
-static int _subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root)
+/* Send a QoS 0 message with exactly one recipient straight from the
+ * publisher's buffers, without going through the message store. Returns -1 if
+ * the message has to be stored and queued as usual instead. */
+int mqtt3_sub_deliver_direct(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, uint32_t payloadlen, const void *payload)
 {
-	int rc = 0;
-	struct _mosquitto_subhier *child, *last = NULL;
-	struct _mosquitto_subleaf *leaf, *next;
-
-	if(!root) return MOSQ_ERR_SUCCESS;
-
-  // 从删除的逻辑看，在这个branch下的客户端是可以多次的？
-	leaf = root->subs;
-	while(leaf){
-		if(leaf->context == context){
-			db->subscription_count--;
-			if(leaf->prev){
-				leaf->prev->next = leaf->next;
-			}else{
-				root->subs = leaf->next;
-			}
-			if(leaf->next){
-				leaf->next->prev = leaf->prev;
-			}
-			next = leaf->next;
-			_mosquitto_free(leaf);
-			leaf = next;
-		}else{
-			leaf = leaf->next;
-		}
+	struct _mosquitto_subleaf *leaf;
+	struct mosquitto *context;
+	bool corked;
+	int rc;
+
+	if(qos > 0 || db->sub_match_count != 1 || db->sub_matches[0]->sub_count != 1) return -1;
+	leaf = &db->sub_matches[0]->subs[0];
+	if(leaf->flags & MOSQ_SUBLEAF_HIBERNATED) return -1;
+
+	if((leaf->flags & MOSQ_SUBLEAF_BRIDGE) && !strcmp(leaf->context->id, source_id)){
+		/* Don't send it back where it came from. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	rc = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+	if(rc == MOSQ_ERR_ACL_DENIED){
+		return MOSQ_ERR_SUCCESS;
+	}else if(rc != MOSQ_ERR_SUCCESS){
+		return -1;
 	}
+	if(db->config->upgrade_outgoing_qos && leaf->qos > 0) return -1;
 
-  //
-	child = root->children;
-	while(child){
-    // 递归删除子branch
-		_subs_clean_session(db, context, child);
-		if(!child->children && !child->subs && !child->retained){
-			if(last){
-				last->next = child->next;
-			}else{
-				root->children = child->next;
-			}
-			_mosquitto_free(child->topic);
-			_mosquitto_free(child);
-			if(last){
-				child = last->next;
-			}else{
-				child = root->children;
-			}
-		}else{
-			last = child;
-			child = child->next;
-		}
+	context = leaf->context;
+#ifdef WITH_BRIDGE
+	if(context->bridge && context->bridge->connection_count > 1){
+		context = mqtt3_bridge_partition(context, topic);
+	}
+#endif
+	/* Anything already queued for the client has to go out first. */
+	if(context->sock == INVALID_SOCKET || context->state != mosq_cs_connected || context->msgs){
+		return -1;
+	}
+	if(db->config->max_buffered_bytes > 0 && context->out_bytes >= (uint64_t)db->config->max_buffered_bytes){
+		/* Held back in the queue until the client catches up. */
+		return -1;
 	}
 
-	return rc;
+	/* Leave the packet for the next write event, like any other message. */
+	corked = context->out_packet_corked;
+	context->out_packet_corked = true;
+	rc = _mosquitto_send_publish(context, 0, topic, payloadlen, payload, 0, false, false);
+	context->out_packet_corked = corked;
+	if(rc) return rc;
+	db->out_queued += payloadlen;
+
+	return mqtt3_event_write_set(context, true);
+}
+
+// 把消息插入客户端自己维护的消息队列里面
+int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	int rc;
+
+	assert(db);
+	assert(topic);
+
+	if(retain){
+		/* Retained messages are kept in their own index, see retain.c. */
+		if(mqtt3_retain_store(db, topic, stored)) return 1;
+	}
+
+	rc = mqtt3_sub_match(db, topic);
+	if(rc) return rc;
+
+	return mqtt3_sub_deliver(db, source_id, topic, qos, retain, stored);
 }
 
-/* Remove all subscriptions for a client.
+/* Remove all subscriptions for a client. This only visits the nodes the
+ * client is subscribed on, not the whole tree.
  */
 int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root)
 {
-	struct _mosquitto_subhier *child;
-
-	child = root->children;
-	while(child){
-		_subs_clean_session(db, context, child);
-		child = child->next;
+	struct mosquitto_cold *cold = context->cold;
+	struct _mosquitto_subhier *hier;
+	struct _mosquitto_subref *ref;
+
+	if(!cold) return MOSQ_ERR_SUCCESS;
+	while(cold->sub_count){
+		/* Taking the last entry means nothing moves in cold->subs. */
+		ref = &cold->subs[cold->sub_count-1];
+		hier = ref->hier;
+		_sub_leaf_remove(db, hier, ref->leaf);
+		_sub_prune(root, hier);
+	}
+	if(cold->subs){
+		_mosquitto_free(cold->subs);
+		cold->subs = NULL;
+		cold->sub_max = 0;
 	}
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* As mqtt3_subs_clean_session() for a hibernated client. */
+void mqtt3_subs_clean_hibernated(struct mosquitto_db *db, struct mosquitto_hibernated *hibernated)
+{
+	struct _mosquitto_subhier *hier;
+	struct _mosquitto_subref *ref;
+
+	while(hibernated->sub_count){
+		ref = &hibernated->subs[hibernated->sub_count-1];
+		hier = ref->hier;
+		_sub_leaf_remove(db, hier, ref->leaf);
+		_sub_prune(&db->subs, hier);
+	}
+}
+
+static void _sub_tree_print_levels(struct _mosquitto_subhier *hier)
+{
+	int i;
+
+	for(i=0; i<hier->level_count; i++){
+		printf(i ? "/%s" : "%s", hier->levels[i]);
+	}
+}
+
 void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level)
 {
 	int i;
-	struct _mosquitto_subhier *branch;
+	struct _mosquitto_subhier *branch, *tmp;
 	struct _mosquitto_subleaf *leaf;
 
 	for(i=0; i<level*2; i++){
 		printf(" ");
 	}
-	printf("%s", root->topic);
-	leaf = root->subs;
-	while(leaf){
-		if(leaf->context){
+	_sub_tree_print_levels(root);
+	for(i=0; i<root->sub_count; i++){
+		leaf = &root->subs[i];
+		if(leaf->flags & MOSQ_SUBLEAF_HIBERNATED){
+			printf(" (%s, %d, hibernated)", leaf->hibernated->id, leaf->qos);
+		}else if(leaf->share){
+			printf(" (%s, %d, $share/%s)", leaf->context->id, leaf->qos, leaf->share->name);
+		}else if(leaf->context){
 			printf(" (%s, %d)", leaf->context->id, leaf->qos);
 		}else{
 			printf(" (%s, %d)", "", leaf->qos);
 		}
-		leaf = leaf->next;
-	}
-	if(root->retained){
-		printf(" (r)");
 	}
 	printf("\n");
 
-	branch = root->children;
-	while(branch){
+	HASH_ITER(hh, root->children, branch, tmp){
 		mqtt3_sub_tree_print(branch, level+1);
-		branch = branch->next;
 	}
 }
 
-static int _retain_process(struct mosquitto_db *db, struct mosquitto_msg_store *retained, struct mosquitto *context, const char *sub, int sub_qos)
+/* Set up the root of the subscription tree with its two top level nodes,
+ * one for normal topics and one for $SYS. */
+int mqtt3_sub_tree_init(struct mosquitto_db *db)
 {
-	int rc = 0;
-	int qos;
-	uint16_t mid;
-
-	rc = mosquitto_acl_check(db, context, retained->msg.topic, MOSQ_ACL_READ);
-	if(rc == MOSQ_ERR_ACL_DENIED){
-		return MOSQ_ERR_SUCCESS;
-	}else if(rc != MOSQ_ERR_SUCCESS){
-		return rc;
-	}
-
-	qos = retained->msg.qos;
-
-	if(qos > sub_qos) qos = sub_qos;
-	if(qos > 0){
-		mid = _mosquitto_mid_generate(context);
-	}else{
-		mid = 0;
+	char *empty = "";
+	char *sys = "$SYS";
+
+	memset(&db->subs, 0, sizeof(struct _mosquitto_subhier));
+	db->sub_matches = NULL;
+	db->sub_match_count = 0;
+	db->sub_match_max = 0;
+	db->sub_generation = 0;
+	db->match_cache = NULL;
+	db->match_cache_hits = 0;
+	db->match_cache_misses = 0;
+
+	if(!_sub_hier_new(&db->subs, &empty, 1) || !_sub_hier_new(&db->subs, &sys, 1)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
 	}
-	return mqtt3_db_message_insert(db, context, mid, mosq_md_out, qos, true, retained);
+	return MOSQ_ERR_SUCCESS;
 }
 
-static int _retain_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, struct mosquitto *context, const char *sub, int sub_qos, int level)
+static void _sub_tree_clean(struct _mosquitto_subhier *hier)
 {
-	struct _mosquitto_subhier *branch;
-	int flag = 0;
+	struct _mosquitto_subhier *child, *tmp;
 
-	branch = subhier->children;
-	while(branch){
-		/* Subscriptions with wildcards in aren't really valid topics to publish to
-		 * so they can't have retained messages.
-		 */
-		if(!strcmp(tokens->topic, "#") && !tokens->next){
-			/* Set flag to indicate that we should check for retained messages
-			 * on "foo" when we are subscribing to e.g. "foo/#" and then exit
-			 * this function and return to an earlier _retain_search().
-			 */
-			flag = -1;
-			if(branch->retained){
-				_retain_process(db, branch->retained, context, sub, sub_qos);
-			}
-			if(branch->children){
-				_retain_search(db, branch, tokens, context, sub, sub_qos, level+1);
-			}
-		}else if(strcmp(branch->topic, "+") && (!strcmp(branch->topic, tokens->topic) || !strcmp(tokens->topic, "+"))){
-			if(tokens->next){
-				if(_retain_search(db, branch, tokens->next, context, sub, sub_qos, level+1) == -1
-						|| (!branch->next && tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
-
-					if(branch->retained){
-						_retain_process(db, branch->retained, context, sub, sub_qos);
-					}
-				}
-			}else{
-				if(branch->retained){
-					_retain_process(db, branch->retained, context, sub, sub_qos);
-				}
-			}
-		}
-
-		branch = branch->next;
+	HASH_ITER(hh, hier->children, child, tmp){
+		HASH_DELETE(hh, hier->children, child);
+		_sub_tree_clean(child);
+		_sub_hier_free(child);
 	}
-	return flag;
 }
 
-int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos)
+void mqtt3_sub_tree_clean(struct mosquitto_db *db)
 {
-	int tree;
-	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
-
-	assert(db);
-	assert(context);
-	assert(sub);
-
-	if(!strncmp(sub, "$SYS/", 5)){
-		tree = 2;
-		if(_sub_topic_tokenise(sub+5, &tokens)) return 1;
-	}else{
-		tree = 0;
-		if(_sub_topic_tokenise(sub, &tokens)) return 1;
-	}
-
-	subhier = db->subs.children;
-	while(subhier){
-		if(!strcmp(subhier->topic, "") && tree == 0){
-			_retain_search(db, subhier, tokens, context, sub, sub_qos, 0);
-			break;
-		}else if(!strcmp(subhier->topic, "$SYS") && tree == 2){
-			_retain_search(db, subhier, tokens, context, sub, sub_qos, 0);
-			break;
-		}
-		subhier = subhier->next;
-	}
-	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
+	_sub_match_cache_clean(db);
+	_sub_tree_clean(&db->subs);
+	if(db->sub_matches){
+		_mosquitto_free(db->sub_matches);
+		db->sub_matches = NULL;
 	}
-
-	return MOSQ_ERR_SUCCESS;
 }
@@ -52,11 +52,21 @@ unsigned long g_msgs_dropped = 0;
 int g_clients_expired = 0;
 unsigned int g_socket_connections = 0;
 unsigned int g_connection_count = 0;
+unsigned long g_clients_throttled = 0; /* times a client was paused by a rate limit */
+/* Time packets spent queued before being written, per output lane. */
+uint64_t g_out_wait_ms[2] = {0, 0};
+uint64_t g_out_wait_max[2] = {0, 0};
+unsigned long g_out_wait_count[2] = {0, 0};
+#ifdef WITH_TLS
+unsigned long g_tls_handshakes_full = 0;
+unsigned long g_tls_handshakes_resumed = 0;
+#endif
 
 static void _sys_update_clients(struct mosquitto_db *db, char *buf)
 {
 	static unsigned int client_count = -1;
 	static int clients_expired = -1;
+	static int hibernated_count = -1;
 	static unsigned int client_max = -1;
 	static unsigned int inactive_count = -1;
 	static unsigned int active_count = -1;
@@ -92,8 +102,168 @@ static void _sys_update_clients(struct mosquitto_db *db, char *buf)
 		snprintf(buf, BUFLEN, "%d", clients_expired);
 		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/expired", 2, strlen(buf), buf, 1);
 	}
+	if(db->hibernated_count != hibernated_count){
+		hibernated_count = db->hibernated_count;
+		snprintf(buf, BUFLEN, "%d", hibernated_count);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/hibernated", 2, strlen(buf), buf, 1);
+	}
+}
+
+/* Output buffer and read pausing gauges. Per client values are only
+ * published while they change and are not retained, so disconnected clients
+ * don't leave stale entries behind. */
+static void _sys_update_buffers(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long long out_bytes = -1;
+	static int paused_count = -1;
+	static int throttled_count = -1;
+	static unsigned long throttle_events = -1;
+	struct mosquitto *context;
+	struct mosquitto_cold *cold;
+	char *topic;
+	int len;
+	int paused = 0;
+	int throttled = 0;
+	int watermark;
+	int i;
+
+	if(db->out_bytes != out_bytes){
+		out_bytes = db->out_bytes;
+		snprintf(buf, BUFLEN, "%llu", out_bytes);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/buffered", 2, strlen(buf), buf, 1);
+	}
+
+	/* Only clients at or over half their budget are reported, one message
+	 * per client per update would cost more than the buffering it reports.
+	 * A client that drops back under gets one last update. */
+	watermark = db->config->max_buffered_bytes/2;
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context || !context->id) continue;
+		if(context->read_paused) paused++;
+		if(context->rate_paused) throttled++;
+		if(watermark <= 0) continue;
+		if(context->out_bytes < (uint64_t)watermark){
+			if(!context->cold || !context->cold->out_bytes_reported) continue;
+			cold = context->cold;
+			cold->out_bytes_reported = 0;
+		}else{
+			if(context->cold && context->out_bytes == context->cold->out_bytes_reported) continue;
+			cold = mqtt3_context_cold(context);
+			if(!cold) return;
+			cold->out_bytes_reported = context->out_bytes;
+		}
+		len = strlen("$SYS/broker/clients/buffered/") + strlen(context->id) + 1;
+		topic = _mosquitto_malloc(len);
+		if(!topic) return;
+		snprintf(topic, len, "$SYS/broker/clients/buffered/%s", context->id);
+		snprintf(buf, BUFLEN, "%llu", (unsigned long long)context->out_bytes);
+		mqtt3_db_messages_easy_queue(db, NULL, topic, 0, strlen(buf), buf, 0);
+		_mosquitto_free(topic);
+	}
+
+	if(paused != paused_count){
+		paused_count = paused;
+		snprintf(buf, BUFLEN, "%d", paused_count);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/paused", 2, strlen(buf), buf, 1);
+	}
+	if(throttled != throttled_count){
+		throttled_count = throttled;
+		snprintf(buf, BUFLEN, "%d", throttled_count);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/throttled", 2, strlen(buf), buf, 1);
+	}
+	if(g_clients_throttled != throttle_events){
+		throttle_events = g_clients_throttled;
+		snprintf(buf, BUFLEN, "%lu", throttle_events);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/throttle events", 2, strlen(buf), buf, 1);
+	}
+}
+
+/* Average and longest time in milliseconds that packets written since the
+ * last update waited in each output lane. */
+static void _sys_update_lanes(struct mosquitto_db *db, char *buf)
+{
+	static const char *topics[2][2] = {
+		{"$SYS/broker/output/control/wait/average", "$SYS/broker/output/control/wait/maximum"},
+		{"$SYS/broker/output/data/wait/average", "$SYS/broker/output/data/wait/maximum"}
+	};
+	static unsigned long long average[2] = {-1, -1};
+	static unsigned long long maximum[2] = {-1, -1};
+	unsigned long long value;
+	int lane;
+
+	for(lane=MOSQ_LANE_CTRL; lane<=MOSQ_LANE_DATA; lane++){
+		value = g_out_wait_count[lane] ? g_out_wait_ms[lane]/g_out_wait_count[lane] : 0;
+		if(value != average[lane]){
+			average[lane] = value;
+			snprintf(buf, BUFLEN, "%llu", value);
+			mqtt3_db_messages_easy_queue(db, NULL, topics[lane][0], 2, strlen(buf), buf, 1);
+		}
+		value = g_out_wait_max[lane];
+		if(value != maximum[lane]){
+			maximum[lane] = value;
+			snprintf(buf, BUFLEN, "%llu", value);
+			mqtt3_db_messages_easy_queue(db, NULL, topics[lane][1], 2, strlen(buf), buf, 1);
+		}
+		g_out_wait_ms[lane] = 0;
+		g_out_wait_max[lane] = 0;
+		g_out_wait_count[lane] = 0;
+	}
 }
 
+#ifdef WITH_TLS
+/* TLS handshakes since the broker started, the percentage of those since the
+ * last update that resumed a session, and the sessions in the listeners'
+ * session caches. */
+static void _sys_update_tls(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long full = -1;
+	static unsigned long resumed = -1;
+	static unsigned long interval_full = 0;
+	static unsigned long interval_resumed = 0;
+	static double resumption_rate = -1;
+	static long cached_count = -1;
+	unsigned long handshakes;
+	double value;
+	long cached = 0;
+	int i;
+
+	if(g_tls_handshakes_full != full){
+		full = g_tls_handshakes_full;
+		snprintf(buf, BUFLEN, "%lu", full);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/handshakes/full", 2, strlen(buf), buf, 1);
+	}
+	if(g_tls_handshakes_resumed != resumed){
+		resumed = g_tls_handshakes_resumed;
+		snprintf(buf, BUFLEN, "%lu", resumed);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/handshakes/resumed", 2, strlen(buf), buf, 1);
+	}
+
+	handshakes = (full - interval_full) + (resumed - interval_resumed);
+	if(handshakes){
+		value = 100.0*(resumed - interval_resumed)/handshakes;
+		if(value != resumption_rate){
+			resumption_rate = value;
+			snprintf(buf, BUFLEN, "%.2f", value);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/resumption rate", 2, strlen(buf), buf, 1);
+		}
+		interval_full = full;
+		interval_resumed = resumed;
+	}
+
+	for(i=0; i<db->config->listener_count; i++){
+		if(db->config->listeners[i].ssl_ctx){
+			cached += SSL_CTX_sess_number(db->config->listeners[i].ssl_ctx);
+		}
+	}
+	if(cached != cached_count){
+		cached_count = cached;
+		snprintf(buf, BUFLEN, "%ld", cached);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/sessions/cached", 2, strlen(buf), buf, 1);
+	}
+}
+#endif
+
 #ifdef REAL_WITH_MEMORY_TRACKING
 static void _sys_update_memory(struct mosquitto_db *db, char *buf)
 {
@@ -143,6 +313,7 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	char buf[BUFLEN];
 
 	static int msg_store_count = -1;
+	static unsigned long spool_count = -1;
 	static unsigned long msgs_received = -1;
 	static unsigned long msgs_sent = -1;
 	static unsigned long publish_dropped = -1;
@@ -153,6 +324,8 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	static unsigned long long pub_bytes_received = -1;
 	static unsigned long long pub_bytes_sent = -1;
 	static int subscription_count = -1;
+	static unsigned long match_cache_hits = -1;
+	static unsigned long match_cache_misses = -1;
 	static int retained_count = -1;
 
 	static double msgs_received_load1 = 0;
@@ -203,6 +376,11 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/uptime", 2, strlen(buf), buf, 1);
 
 		_sys_update_clients(db, buf);
+		_sys_update_buffers(db, buf);
+		_sys_update_lanes(db, buf);
+#ifdef WITH_TLS
+		_sys_update_tls(db, buf);
+#endif
 		if(last_update > 0){
 			i_mult = 60.0/(double)(now-last_update);
 
@@ -267,12 +445,30 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/stored", 2, strlen(buf), buf, 1);
 		}
 
+		if(db->spool_count != spool_count){
+			spool_count = db->spool_count;
+			snprintf(buf, BUFLEN, "%lu", spool_count);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/spooled", 2, strlen(buf), buf, 1);
+		}
+
 		if(db->subscription_count != subscription_count){
 			subscription_count = db->subscription_count;
 			snprintf(buf, BUFLEN, "%d", subscription_count);
 			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/count", 2, strlen(buf), buf, 1);
 		}
 
+		if(db->match_cache_hits != match_cache_hits){
+			match_cache_hits = db->match_cache_hits;
+			snprintf(buf, BUFLEN, "%lu", match_cache_hits);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/cache/hits", 2, strlen(buf), buf, 1);
+		}
+
+		if(db->match_cache_misses != match_cache_misses){
+			match_cache_misses = db->match_cache_misses;
+			snprintf(buf, BUFLEN, "%lu", match_cache_misses);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/cache/misses", 2, strlen(buf), buf, 1);
+		}
+
 		if(db->retained_count != retained_count){
 			retained_count = db->retained_count;
 			snprintf(buf, BUFLEN, "%d", retained_count);
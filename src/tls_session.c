@@ -0,0 +1,324 @@
+/*
+Copyright (c) 2009-2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* TLS session resumption on the listeners, so that clients which reconnect
+ * often, such as mobile and battery powered ones, can skip the expensive part
+ * of the handshake.
+ *
+ * Each listener's SSL_CTX keeps a bounded cache of sessions by session id
+ * (tls_session_cache_size) and, unless tls_session_tickets is false, issues
+ * stateless session tickets that the clients hold on to instead. The ticket
+ * keys are either generated at startup and replaced every
+ * tls_ticket_key_rotate seconds, with older keys still accepted for as long
+ * as tls_session_timeout says a ticket lasts, or read from
+ * tls_ticket_key_file, so that several brokers behind a load balancer can
+ * resume each other's sessions. That file is reloaded when it changes.
+ */
+
+#include <config.h>
+
+#ifdef WITH_TLS
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#else
+#  include <openssl/hmac.h>
+#endif
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <time_mosq.h>
+
+
+#ifdef WITH_SYS_TREE
+extern unsigned long g_tls_handshakes_full;
+extern unsigned long g_tls_handshakes_resumed;
+#endif
+
+static int ssl_ctx_ex_index_listener = -1;
+
+static void _keys_free(struct _mqtt3_listener *listener)
+{
+	if(listener->ticket_keys){
+		OPENSSL_cleanse(listener->ticket_keys, listener->ticket_key_count*sizeof(struct mosquitto_ticket_key));
+		_mosquitto_free(listener->ticket_keys);
+		listener->ticket_keys = NULL;
+	}
+	listener->ticket_key_count = 0;
+}
+
+/* Generated keys that are kept. A ticket issued just before a rotation has to
+ * be accepted for tls_session_timeout after it, so besides the current key
+ * there must be enough older ones to cover that. */
+static int _keys_kept(struct _mqtt3_listener *listener)
+{
+	if(listener->tls_ticket_key_rotate <= 0) return 1;
+	if(listener->tls_session_timeout <= 0) return 2;
+	return (listener->tls_session_timeout + listener->tls_ticket_key_rotate - 1)/listener->tls_ticket_key_rotate + 1;
+}
+
+/* Make a new key the one that issues tickets, keeping older ones for
+ * tickets that are still out there. */
+static int _keys_generate(struct _mqtt3_listener *listener, time_t now)
+{
+	struct mosquitto_ticket_key key;
+	int kept = _keys_kept(listener);
+
+	if(RAND_bytes((unsigned char *)&key, sizeof(key)) != 1){
+		return 1;
+	}
+	if(!listener->ticket_keys){
+		listener->ticket_keys = _mosquitto_calloc(kept, sizeof(struct mosquitto_ticket_key));
+		if(!listener->ticket_keys){
+			OPENSSL_cleanse(&key, sizeof(key));
+			return 1;
+		}
+	}
+	memmove(&listener->ticket_keys[1], &listener->ticket_keys[0], (kept-1)*sizeof(struct mosquitto_ticket_key));
+	memcpy(&listener->ticket_keys[0], &key, sizeof(key));
+	OPENSSL_cleanse(&key, sizeof(key));
+	if(listener->ticket_key_count < kept){
+		listener->ticket_key_count++;
+	}
+	listener->ticket_key_t = now;
+	return 0;
+}
+
+/* Read tls_ticket_key_file, which is any number of MOSQ_TICKET_KEY_LEN byte
+ * records, newest first. The current keys are kept if it isn't valid. */
+static int _keys_load(struct _mqtt3_listener *listener, time_t mtime)
+{
+	FILE *fptr;
+	long len;
+	struct mosquitto_ticket_key *keys;
+
+	fptr = fopen(listener->tls_ticket_key_file, "rb");
+	if(!fptr){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open TLS ticket key file \"%s\".", listener->tls_ticket_key_file);
+		return 1;
+	}
+	fseek(fptr, 0, SEEK_END);
+	len = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+	if(len <= 0 || len % MOSQ_TICKET_KEY_LEN){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: TLS ticket key file \"%s\" must hold one or more keys of %d bytes.",
+				listener->tls_ticket_key_file, MOSQ_TICKET_KEY_LEN);
+		fclose(fptr);
+		return 1;
+	}
+	keys = _mosquitto_malloc(len);
+	if(!keys){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		fclose(fptr);
+		return 1;
+	}
+	if(fread(keys, 1, len, fptr) != (size_t)len){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read TLS ticket key file \"%s\".", listener->tls_ticket_key_file);
+		OPENSSL_cleanse(keys, len);
+		_mosquitto_free(keys);
+		fclose(fptr);
+		return 1;
+	}
+	fclose(fptr);
+
+	_keys_free(listener);
+	listener->ticket_keys = keys;
+	listener->ticket_key_count = len / MOSQ_TICKET_KEY_LEN;
+	listener->ticket_key_t = mtime;
+	return 0;
+}
+
+/* The cipher half of the ticket key callback. Returns as the callback does:
+ * 1 to use the key, 2 to use it and issue a fresh ticket, as for tickets
+ * from an older key, 0 if the key is unknown so a full handshake follows, or
+ * -1 on error. */
+static int _ticket_key_cipher(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, int enc, const struct mosquitto_ticket_key **key)
+{
+	struct _mqtt3_listener *listener;
+	int i;
+
+	listener = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ssl_ctx_ex_index_listener);
+	if(!listener || !listener->ticket_key_count) return -1;
+
+	if(enc){
+		*key = &listener->ticket_keys[0];
+		memcpy(key_name, (*key)->name, sizeof((*key)->name));
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+		if(!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, (*key)->aes_key, iv)) return -1;
+		return 1;
+	}
+	for(i=0; i<listener->ticket_key_count; i++){
+		if(!memcmp(key_name, listener->ticket_keys[i].name, sizeof(listener->ticket_keys[i].name))){
+			*key = &listener->ticket_keys[i];
+			if(!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, (*key)->aes_key, iv)) return -1;
+			return i == 0 ? 1 : 2;
+		}
+	}
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int _ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+	const struct mosquitto_ticket_key *key = NULL;
+	OSSL_PARAM params[2];
+	int rc;
+
+	rc = _ticket_key_cipher(ssl, key_name, iv, ctx, enc, &key);
+	if(rc <= 0) return rc;
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if(!EVP_MAC_init(hctx, key->hmac_key, sizeof(key->hmac_key), params)) return -1;
+	return rc;
+}
+#else
+static int _ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+{
+	const struct mosquitto_ticket_key *key = NULL;
+	int rc;
+
+	rc = _ticket_key_cipher(ssl, key_name, iv, ctx, enc, &key);
+	if(rc <= 0) return rc;
+
+	if(!HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL)) return -1;
+	return rc;
+}
+#endif
+
+#ifdef WITH_SYS_TREE
+static void _info_cb(const SSL *ssl, int where, int ret)
+{
+	if(where & SSL_CB_HANDSHAKE_DONE){
+		if(SSL_session_reused((SSL *)ssl)){
+			g_tls_handshakes_resumed++;
+		}else{
+			g_tls_handshakes_full++;
+		}
+	}
+}
+#endif
+
+int mqtt3_tls_session_init(struct _mqtt3_listener *listener)
+{
+	SSL_CTX *ssl_ctx = listener->ssl_ctx;
+	char sid_ctx[SSL_MAX_SID_CTX_LENGTH];
+	struct stat st;
+	int len;
+
+	/* Sessions can only be resumed on the port they were made on, which with
+	 * a shared tls_ticket_key_file includes other brokers' same listener. */
+	len = snprintf(sid_ctx, sizeof(sid_ctx), "mosquitto:%d", listener->port);
+	SSL_CTX_set_session_id_context(ssl_ctx, (unsigned char *)sid_ctx, len);
+
+	if(listener->tls_session_cache_size > 0){
+		SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ssl_ctx, listener->tls_session_cache_size);
+	}else{
+		/* A cache size of 0 would be unlimited to OpenSSL. */
+		SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+	}
+	if(listener->tls_session_timeout > 0){
+		SSL_CTX_set_timeout(ssl_ctx, listener->tls_session_timeout);
+	}
+
+	if(listener->tls_session_tickets){
+		if(ssl_ctx_ex_index_listener == -1){
+			ssl_ctx_ex_index_listener = SSL_CTX_get_ex_new_index(0, "listener", NULL, NULL, NULL);
+		}
+		SSL_CTX_set_ex_data(ssl_ctx, ssl_ctx_ex_index_listener, listener);
+		if(listener->tls_ticket_key_file){
+			if(stat(listener->tls_ticket_key_file, &st)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open TLS ticket key file \"%s\".", listener->tls_ticket_key_file);
+				return 1;
+			}
+			if(_keys_load(listener, st.st_mtime)) return 1;
+		}else if(_keys_generate(listener, mosquitto_time())){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to generate TLS ticket keys.");
+			return 1;
+		}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, _ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, _ticket_key_cb);
+#endif
+	}else{
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+	}
+
+#ifdef WITH_SYS_TREE
+	SSL_CTX_set_info_callback(ssl_ctx, _info_cb);
+#endif
+	return 0;
+}
+
+void mqtt3_tls_session_update(struct mosquitto_db *db, time_t now)
+{
+	struct _mqtt3_listener *listener;
+	struct stat st;
+	int i;
+
+	for(i=0; i<db->config->listener_count; i++){
+		listener = &db->config->listeners[i];
+		if(!listener->ssl_ctx || !listener->ticket_keys) continue;
+
+		if(listener->tls_ticket_key_file){
+			if(!stat(listener->tls_ticket_key_file, &st) && st.st_mtime != listener->ticket_key_t){
+				if(!_keys_load(listener, st.st_mtime)){
+					_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Reloaded TLS ticket keys from \"%s\".", listener->tls_ticket_key_file);
+				}else{
+					/* Don't try again until it changes again. */
+					listener->ticket_key_t = st.st_mtime;
+				}
+			}
+		}else if(listener->tls_ticket_key_rotate > 0 && now - listener->ticket_key_t >= listener->tls_ticket_key_rotate){
+			if(_keys_generate(listener, now)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to rotate TLS ticket keys.");
+			}
+		}
+	}
+}
+
+void mqtt3_tls_session_cleanup(struct _mqtt3_listener *listener)
+{
+	_keys_free(listener);
+	if(listener->tls_ticket_key_file){
+		_mosquitto_free(listener->tls_ticket_key_file);
+		listener->tls_ticket_key_file = NULL;
+	}
+}
+
+#endif /* WITH_TLS */
@@ -0,0 +1,81 @@
+#!/usr/bin/env python
+
+# With shared_subscription_policy least_loaded, does a shared subscription
+# group skip a member that still has an unacknowledged message?
+
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 3
+subscribe_packet = mosq_test.gen_subscribe(mid, "$share/group/shared/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+publish_packets = []
+puback_packets = []
+for i in range(3):
+    publish_packets.append(mosq_test.gen_publish("shared/test", qos=1, mid=i+1, payload="message-"+str(i+1)))
+    puback_packets.append(mosq_test.gen_puback(i+1))
+
+# As they arrive at the members, each of which numbers its own messages.
+publish1_packet = mosq_test.gen_publish("shared/test", qos=1, mid=1, payload="message-1")
+publish2_packet = mosq_test.gen_publish("shared/test", qos=1, mid=1, payload="message-2")
+publish3_packet = mosq_test.gen_publish("shared/test", qos=1, mid=2, payload="message-3")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '02-shared-sub-least-loaded.conf'], stderr=subprocess.PIPE)
+
+sub1 = None
+sub2 = None
+pub = None
+try:
+    time.sleep(0.5)
+
+    sub1 = mosq_test.connect("shared-ll-1", keepalive, connack_packet)
+    sub2 = mosq_test.connect("shared-ll-2", keepalive, connack_packet)
+    pub = mosq_test.connect("shared-ll-pub", keepalive, connack_packet)
+
+    # Members are taken in the order they subscribed, so sub1 has to be in
+    # before sub2 asks.
+    sub1.send(subscribe_packet)
+    subscribed = mosq_test.expect_packet(sub1, "suback 1", suback_packet)
+    if subscribed:
+        sub2.send(subscribe_packet)
+    if subscribed and mosq_test.expect_packet(sub2, "suback 2", suback_packet):
+        pub.send(publish_packets[0])
+        if mosq_test.expect_packet(pub, "puback 1", puback_packets[0]) \
+                and mosq_test.expect_packet(sub1, "publish 1", publish1_packet):
+
+            # sub1 doesn't acknowledge, so it stays the more loaded member and
+            # both of the next messages go to sub2.
+            pub.send(publish_packets[1])
+            if mosq_test.expect_packet(pub, "puback 2", puback_packets[1]) \
+                    and mosq_test.expect_packet(sub2, "publish 2", publish2_packet):
+
+                sub2.send(mosq_test.gen_puback(1))
+                time.sleep(0.2)
+                pub.send(publish_packets[2])
+                if mosq_test.expect_packet(pub, "puback 3", puback_packets[2]) \
+                        and mosq_test.expect_packet(sub2, "publish 3", publish3_packet):
+                    rc = 0
+finally:
+    for sock in (sub1, sub2, pub):
+        if sock:
+            sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
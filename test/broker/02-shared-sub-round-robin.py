@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+
+# Do the members of a shared subscription group take turns, and does a member
+# stop getting messages once it unsubscribes?
+
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 3
+subscribe_packet = mosq_test.gen_subscribe(mid, "$share/group/shared/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+unsubscribe_packet = mosq_test.gen_unsubscribe(mid, "$share/group/shared/#")
+unsuback_packet = mosq_test.gen_unsuback(mid)
+
+publish_packets = []
+for i in range(6):
+    publish_packets.append(mosq_test.gen_publish("shared/test", qos=0, payload="message-"+str(i+1)))
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '02-shared-sub-round-robin.conf'], stderr=subprocess.PIPE)
+
+sub1 = None
+sub2 = None
+pub = None
+try:
+    time.sleep(0.5)
+
+    sub1 = mosq_test.connect("shared-rr-1", keepalive, connack_packet)
+    sub2 = mosq_test.connect("shared-rr-2", keepalive, connack_packet)
+    pub = mosq_test.connect("shared-rr-pub", keepalive, connack_packet)
+
+    # Members are taken in the order they subscribed, so sub1 has to be in
+    # before sub2 asks.
+    sub1.send(subscribe_packet)
+    subscribed = mosq_test.expect_packet(sub1, "suback 1", suback_packet)
+    if subscribed:
+        sub2.send(subscribe_packet)
+    if subscribed and mosq_test.expect_packet(sub2, "suback 2", suback_packet):
+        for i in range(4):
+            pub.send(publish_packets[i])
+
+        if mosq_test.expect_packet(sub1, "publish 1", publish_packets[0]) \
+                and mosq_test.expect_packet(sub2, "publish 2", publish_packets[1]) \
+                and mosq_test.expect_packet(sub1, "publish 3", publish_packets[2]) \
+                and mosq_test.expect_packet(sub2, "publish 4", publish_packets[3]):
+
+            sub2.send(unsubscribe_packet)
+            if mosq_test.expect_packet(sub2, "unsuback", unsuback_packet):
+                # The only member left gets everything.
+                pub.send(publish_packets[4])
+                pub.send(publish_packets[5])
+                if mosq_test.expect_packet(sub1, "publish 5", publish_packets[4]) \
+                        and mosq_test.expect_packet(sub1, "publish 6", publish_packets[5]) \
+                        and mosq_test.expect_nothing(sub2):
+                    rc = 0
+finally:
+    for sock in (sub1, sub2, pub):
+        if sock:
+            sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
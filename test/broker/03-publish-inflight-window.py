@@ -0,0 +1,68 @@
+#!/usr/bin/env python
+
+# Does the in-flight window only count outgoing QoS 1 and 2 messages? A QoS 2
+# message the subscriber has sent but not yet released must not hold up what
+# the broker sends to it, and max_inflight_messages must still apply.
+
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 3
+subscribe_packet = mosq_test.gen_subscribe(mid, "inflight/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+held_packet = mosq_test.gen_publish("held/qos2", qos=2, mid=9, payload="held")
+held_pubrec_packet = mosq_test.gen_pubrec(9)
+
+publish1_packet = mosq_test.gen_publish("inflight/test", qos=1, mid=1, payload="message 1")
+publish2_packet = mosq_test.gen_publish("inflight/test", qos=1, mid=2, payload="message 2")
+puback1_packet = mosq_test.gen_puback(1)
+puback2_packet = mosq_test.gen_puback(2)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-inflight-window.conf'], stderr=subprocess.PIPE)
+
+sub = None
+pub = None
+try:
+    time.sleep(0.5)
+
+    sub = mosq_test.connect("inflight-sub", keepalive, connack_packet)
+    sub.send(subscribe_packet)
+    if mosq_test.expect_packet(sub, "suback", suback_packet):
+        # Never released, so it stays in the subscriber's message list.
+        sub.send(held_packet)
+        if mosq_test.expect_packet(sub, "pubrec", held_pubrec_packet):
+            pub = mosq_test.connect("inflight-pub", keepalive, connack_packet)
+            pub.send(publish1_packet)
+            if mosq_test.expect_packet(pub, "puback 1", puback1_packet):
+                pub.send(publish2_packet)
+                if mosq_test.expect_packet(pub, "puback 2", puback2_packet) \
+                        and mosq_test.expect_packet(sub, "publish 1", publish1_packet) \
+                        and mosq_test.expect_nothing(sub):
+
+                    sub.send(puback1_packet)
+                    if mosq_test.expect_packet(sub, "publish 2", publish2_packet):
+                        rc = 0
+finally:
+    for sock in (sub, pub):
+        if sock:
+            sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
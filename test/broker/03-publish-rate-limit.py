@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+
+# Does a client over its rate_limit_client stop being read from, and is it
+# read from again once its bucket refills? Disconnecting and coming back with
+# the same client id, after the broker has forgotten the old connection, must
+# not give it a full bucket again.
+
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 10
+subscribe_packet = mosq_test.gen_subscribe(mid, "rate/back", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+back_packet = mosq_test.gen_publish("rate/back", qos=0, payload="back")
+
+# 115 bytes each, against a limit of 50 bytes a second.
+publish_packets = []
+puback_packets = []
+for i in range(3):
+    publish_packets.append(mosq_test.gen_publish("rate/test", qos=1, mid=i+1, payload=("message-%d-" % (i+1))+"x"*90))
+    puback_packets.append(mosq_test.gen_puback(i+1))
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-rate-limit.conf'], stderr=subprocess.PIPE)
+
+pub = None
+other = None
+try:
+    time.sleep(0.5)
+
+    pub = mosq_test.connect("rate-pub", keepalive, connack_packet)
+    pub.send(subscribe_packet)
+    if mosq_test.expect_packet(pub, "suback", suback_packet):
+        pub.send(publish_packets[0])
+        pub.send(publish_packets[1])
+
+        # The first message puts the bucket two seconds in debt, so the
+        # second waits in the socket until it has refilled.
+        if mosq_test.expect_packet(pub, "puback 1", puback_packets[0]) \
+                and mosq_test.expect_nothing(pub, 1.0) \
+                and mosq_test.expect_packet(pub, "puback 2", puback_packets[1]):
+
+            # The second message leaves it over two seconds in debt again.
+            # The broker isn't reading from the client, so it only notices
+            # it has gone when sending to it fails. Come back once the old
+            # connection has been cleaned up, while still in debt.
+            pub.close()
+            pub = None
+            other = mosq_test.connect("rate-other", keepalive, connack_packet)
+            for i in range(3):
+                other.send(back_packet)
+                time.sleep(0.1)
+            time.sleep(1.2)
+
+            pub = mosq_test.connect("rate-pub", keepalive, connack_packet)
+            if pub:
+                pub.send(publish_packets[2])
+                if mosq_test.expect_nothing(pub, 0.5) \
+                        and mosq_test.expect_packet(pub, "puback 3", puback_packets[2]):
+                    rc = 0
+finally:
+    for sock in (pub, other):
+        if sock:
+            sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
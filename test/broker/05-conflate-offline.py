@@ -0,0 +1,92 @@
+#!/usr/bin/env python
+
+# Does an offline persistent client on a conflate_messages listener only get
+# the last value published for each topic, while messages that have already
+# been sent to it are never replaced?
+
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 7
+subscribe_packet = mosq_test.gen_subscribe(mid, "conflate/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+# Each queued message keeps its place and mid when a newer value replaces it,
+# although the mids of the replaced values are still used up.
+publish_a_packet = mosq_test.gen_publish("conflate/a", qos=1, mid=1, payload="a-3")
+publish_b_packet = mosq_test.gen_publish("conflate/b", qos=1, mid=2, payload="b-2")
+
+publish_c1_packet = mosq_test.gen_publish("conflate/c", qos=1, mid=6, payload="c-1")
+publish_c2_packet = mosq_test.gen_publish("conflate/c", qos=1, mid=7, payload="c-2")
+publish_c1_dup_packet = mosq_test.gen_publish("conflate/c", qos=1, mid=6, payload="c-1", dup=True)
+publish_c2_dup_packet = mosq_test.gen_publish("conflate/c", qos=1, mid=7, payload="c-2", dup=True)
+publish_c3_packet = mosq_test.gen_publish("conflate/c", qos=1, mid=8, payload="c-3")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-conflate-offline.conf'], stderr=subprocess.PIPE)
+
+sub = None
+pub = None
+try:
+    time.sleep(0.5)
+
+    sub = mosq_test.connect("conflate-sub", keepalive, connack_packet, clean_session=False)
+    sub.send(subscribe_packet)
+    if mosq_test.expect_packet(sub, "suback", suback_packet):
+        sub.send(disconnect_packet)
+        sub.close()
+        sub = None
+
+        pub = mosq_test.connect("conflate-pub", keepalive, connack_packet)
+        if mosq_test.publish(pub, "conflate/a", "a-1", 1) and mosq_test.publish(pub, "conflate/b", "b-1", 2) \
+                and mosq_test.publish(pub, "conflate/a", "a-2", 3) and mosq_test.publish(pub, "conflate/a", "a-3", 4) \
+                and mosq_test.publish(pub, "conflate/b", "b-2", 5):
+
+            sub = mosq_test.connect("conflate-sub", keepalive, connack_packet, clean_session=False)
+            if mosq_test.expect_packet(sub, "publish a", publish_a_packet) \
+                    and mosq_test.expect_packet(sub, "publish b", publish_b_packet) \
+                    and mosq_test.expect_nothing(sub):
+
+                sub.send(mosq_test.gen_puback(1))
+                sub.send(mosq_test.gen_puback(2))
+
+                # c-1 has been sent and isn't acknowledged, so c-2 can't
+                # replace it.
+                if mosq_test.publish(pub, "conflate/c", "c-1", 6) \
+                        and mosq_test.expect_packet(sub, "publish c-1", publish_c1_packet) \
+                        and mosq_test.publish(pub, "conflate/c", "c-2", 7) \
+                        and mosq_test.expect_packet(sub, "publish c-2", publish_c2_packet):
+
+                    # Nor can c-3 once the client has gone, c-1 and c-2 are
+                    # sent again as duplicates.
+                    sub.close()
+                    time.sleep(0.5)
+                    if mosq_test.publish(pub, "conflate/c", "c-3", 8):
+                        sub = mosq_test.connect("conflate-sub", keepalive, connack_packet, clean_session=False)
+                        if mosq_test.expect_packet(sub, "publish c-1 dup", publish_c1_dup_packet) \
+                                and mosq_test.expect_packet(sub, "publish c-2 dup", publish_c2_dup_packet) \
+                                and mosq_test.expect_packet(sub, "publish c-3", publish_c3_packet):
+                            rc = 0
+finally:
+    for sock in (sub, pub):
+        if sock:
+            sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+
+# Are messages for an offline persistent client written to disk once
+# queue_spill_threshold is reached, and are they all delivered in order when
+# it reconnects? The backlog is spread over several segment files, which are
+# all removed once it has been delivered.
+
+import glob
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def spool_files():
+    return glob.glob("*.spool")
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 5
+subscribe_packet = mosq_test.gen_subscribe(mid, "spill/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+count = 80
+payloads = []
+for i in range(count):
+    payloads.append(("message-%02d-" % (i+1)) + "x"*88)
+
+for f in spool_files():
+    os.remove(f)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-spill.conf'], stderr=subprocess.PIPE)
+
+sub = None
+pub = None
+try:
+    time.sleep(0.5)
+
+    sub = mosq_test.connect("spill-sub", keepalive, connack_packet, clean_session=False)
+    sub.send(subscribe_packet)
+    if mosq_test.expect_packet(sub, "suback", suback_packet):
+        sub.send(disconnect_packet)
+        sub.close()
+        sub = None
+
+        pub = mosq_test.connect("spill-pub", keepalive, connack_packet)
+        ok = True
+        for i in range(count):
+            if not mosq_test.publish(pub, "spill/test", payloads[i], i+1):
+                ok = False
+                break
+
+        if ok and len(spool_files()) < 3:
+            print("FAIL: Expected the backlog to be spread over several spool files, found "+str(len(spool_files()))+".")
+            ok = False
+
+        if ok:
+            sub = mosq_test.connect("spill-sub", keepalive, connack_packet, clean_session=False)
+            for i in range(count):
+                # The first messages were queued in memory with their mids.
+                # The mids of the spilled ones were used up when they were
+                # spilled, they get new ones as they are read back.
+                if i < 2:
+                    mid = i+1
+                else:
+                    mid = count+i-1
+                publish_packet = mosq_test.gen_publish("spill/test", qos=1, mid=mid, payload=payloads[i])
+                if not mosq_test.expect_packet(sub, "publish "+str(i+1), publish_packet):
+                    ok = False
+                    break
+                sub.send(mosq_test.gen_puback(mid))
+
+            if ok and mosq_test.expect_nothing(sub):
+                if len(spool_files()) == 0:
+                    rc = 0
+                else:
+                    print("FAIL: Spool files left after the backlog was delivered: "+str(spool_files()))
+finally:
+    for sock in (sub, pub):
+        if sock:
+            sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    for f in spool_files():
+        os.remove(f)
+
+exit(rc)
@@ -0,0 +1,113 @@
+#!/usr/bin/env python
+
+# Are durable shared subscription members saved as $share/<group>/<filter> and
+# restored from the persistent database, along with a message queued for one
+# of them? Needs a broker built with WITH_PERSISTENCE.
+
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 5
+subscribe_packet = mosq_test.gen_subscribe(mid, "$share/group/persist/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+publish1_packet = mosq_test.gen_publish("persist/test", qos=1, mid=1, payload="message-1")
+puback1_packet = mosq_test.gen_puback(1)
+publish2_packet = mosq_test.gen_publish("persist/test", qos=1, mid=2, payload="message-2")
+puback2_packet = mosq_test.gen_puback(2)
+publish3_packet = mosq_test.gen_publish("persist/test", qos=1, mid=3, payload="message-3")
+puback3_packet = mosq_test.gen_puback(3)
+
+try:
+    os.remove('05-shared-sub-persist.db')
+except OSError:
+    pass
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-shared-sub-persist.conf'], stderr=subprocess.PIPE)
+
+sub1 = None
+sub2 = None
+pub = None
+try:
+    time.sleep(0.5)
+
+    sub1 = mosq_test.connect("shared-persist-1", keepalive, connack_packet, clean_session=False)
+    sub2 = mosq_test.connect("shared-persist-2", keepalive, connack_packet, clean_session=False)
+    # Members are taken in the order they subscribed, so sub1 has to be in
+    # before sub2 asks.
+    sub1.send(subscribe_packet)
+    subscribed = mosq_test.expect_packet(sub1, "suback 1", suback_packet)
+    if subscribed:
+        sub2.send(subscribe_packet)
+    if subscribed and mosq_test.expect_packet(sub2, "suback 2", suback_packet):
+        sub1.send(disconnect_packet)
+        sub1.close()
+        sub1 = None
+        sub2.send(disconnect_packet)
+        sub2.close()
+        sub2 = None
+
+        pub = mosq_test.connect("shared-persist-pub", keepalive, connack_packet)
+        pub.send(publish1_packet)
+        if mosq_test.expect_packet(pub, "puback 1", puback1_packet):
+            pub.close()
+            pub = None
+
+            # The database is saved on the way out, the group has to come
+            # back from it.
+            broker.terminate()
+            broker.wait()
+            broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-shared-sub-persist.conf'], stderr=subprocess.PIPE)
+            time.sleep(0.5)
+
+            sub1 = mosq_test.connect("shared-persist-1", keepalive, connack_packet, clean_session=False)
+            if mosq_test.expect_packet(sub1, "publish 1", publish1_packet):
+                sub1.send(mosq_test.gen_puback(1))
+
+                # Neither member subscribes again, both are still in the group.
+                sub2 = mosq_test.connect("shared-persist-2", keepalive, connack_packet, clean_session=False)
+                pub = mosq_test.connect("shared-persist-pub", keepalive, connack_packet)
+                pub.send(publish2_packet)
+                pub.send(publish3_packet)
+                if mosq_test.expect_packet(pub, "puback 2", puback2_packet) \
+                        and mosq_test.expect_packet(pub, "puback 3", puback3_packet):
+                    # The members take turns, starting with either of them.
+                    packet1 = sub1.recv(len(publish2_packet))
+                    packet2 = sub2.recv(len(publish2_packet))
+                    if (packet1 == mosq_test.gen_publish("persist/test", qos=1, mid=2, payload="message-2")
+                            and packet2 == mosq_test.gen_publish("persist/test", qos=1, mid=1, payload="message-3")) \
+                            or (packet1 == mosq_test.gen_publish("persist/test", qos=1, mid=2, payload="message-3")
+                            and packet2 == mosq_test.gen_publish("persist/test", qos=1, mid=1, payload="message-2")):
+                        rc = 0
+                    else:
+                        print("FAIL: Received incorrect publishes.")
+                        print("Received: "+mosq_test.to_string(packet1))
+                        print("Received: "+mosq_test.to_string(packet2))
+finally:
+    for sock in (sub1, sub2, pub):
+        if sock:
+            sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    try:
+        os.remove('05-shared-sub-persist.db')
+    except OSError:
+        pass
+
+exit(rc)
@@ -0,0 +1,147 @@
+#!/usr/bin/env python
+
+# Does a multi-connection bridge keep per-topic ordering across a failover?
+# Messages published while the topic's own connection is down go out on the
+# other connection, and keep going there after the first one comes back until
+# they have been acknowledged.
+
+import os
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def partition(topic, count):
+    # Same FNV-1a hash as mqtt3_bridge_partition()
+    h = 2166136261
+    for c in topic:
+        h = ((h ^ ord(c)) * 16777619) & 0xFFFFFFFF
+    return h % count
+
+def read_packet(sock):
+    packet = sock.recv(2)
+    if len(packet) == 2:
+        packet = packet + sock.recv(ord(packet[1]))
+    return packet
+
+# Returns the partition that connected, its socket and the last mid it used.
+def accept_partition(ssock):
+    (sock, address) = ssock.accept()
+    sock.settimeout(10)
+    packet = read_packet(sock)
+    for i in range(2):
+        if packet == connect_packets[i]:
+            sock.send(connack_packet)
+            # The bridge unsubscribes from its "out" topics on every connect.
+            packet = read_packet(sock)
+            if len(packet) > 4 and ord(packet[0]) == 162:
+                return (i, sock, struct.unpack('!H', packet[2:4])[0])
+            break
+    print("FAIL: Unexpected packet.")
+    print("Received: "+mosq_test.to_string(packet))
+    sock.close()
+    return (-1, None, 0)
+
+rc = 1
+keepalive = 60
+topic = "bridge/failover/test"
+home = partition(topic, 2)
+other = 1 - home
+
+client_id = socket.gethostname()+".bridge_failover"
+connect_packets = [
+    mosq_test.gen_connect(client_id, keepalive=keepalive, clean_session=False, proto_ver=128+3),
+    mosq_test.gen_connect(client_id+".1", keepalive=keepalive, clean_session=False, proto_ver=128+3)]
+connack_packet = mosq_test.gen_connack(rc=0)
+
+pub_connect_packet = mosq_test.gen_connect("bridge-failover-pub", keepalive=keepalive)
+
+publish1_packet = mosq_test.gen_publish(topic, qos=1, mid=1, payload="message-1")
+puback1_packet = mosq_test.gen_puback(1)
+publish2_packet = mosq_test.gen_publish(topic, qos=1, mid=2, payload="message-2")
+puback2_packet = mosq_test.gen_puback(2)
+publish3_packet = mosq_test.gen_publish(topic, qos=1, mid=3, payload="message-3")
+puback3_packet = mosq_test.gen_puback(3)
+
+ssock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+ssock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+ssock.settimeout(10)
+ssock.bind(('', 1888))
+ssock.listen(5)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '06-bridge-partition-failover.conf'], stderr=subprocess.PIPE)
+
+bridges = [None, None]
+mids = [0, 0]
+pub = None
+try:
+    time.sleep(0.5)
+
+    for i in range(2):
+        (p, sock, mid) = accept_partition(ssock)
+        if p == -1:
+            raise ValueError
+        bridges[p] = sock
+        mids[p] = mid
+
+    # Take the topic's own connection down.
+    bridges[home].close()
+    bridges[home] = None
+    time.sleep(0.5)
+
+    pub = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    pub.settimeout(10)
+    pub.connect(("127.0.0.1", 1889))
+    pub.send(pub_connect_packet)
+    if mosq_test.expect_packet(pub, "connack", connack_packet):
+        pub.send(publish1_packet)
+        if mosq_test.expect_packet(pub, "puback", puback1_packet):
+            bridge1_packet = mosq_test.gen_publish(topic, qos=1, mid=mids[other]+1, payload="message-1")
+            if mosq_test.expect_packet(bridges[other], "publish 1", bridge1_packet):
+                # Wait for the topic's connection to come back.
+                (p, sock, mid) = accept_partition(ssock)
+                if p == home:
+                    bridges[home] = sock
+                    mids[home] = mid
+                    time.sleep(0.5)
+
+                    # Message 1 is still unacknowledged, so message 2 must
+                    # follow it on the same connection.
+                    pub.send(publish2_packet)
+                    bridge2_packet = mosq_test.gen_publish(topic, qos=1, mid=mids[other]+2, payload="message-2")
+                    if mosq_test.expect_packet(pub, "puback", puback2_packet):
+                        if mosq_test.expect_packet(bridges[other], "publish 2", bridge2_packet):
+                            bridges[other].send(mosq_test.gen_puback(mids[other]+1))
+                            bridges[other].send(mosq_test.gen_puback(mids[other]+2))
+                            time.sleep(0.5)
+
+                            # Everything has been acknowledged, the topic
+                            # goes back to its own connection.
+                            bridge3_packet = mosq_test.gen_publish(topic, qos=1, mid=mids[home]+1, payload="message-3")
+                            pub.send(publish3_packet)
+                            if mosq_test.expect_packet(pub, "puback", puback3_packet):
+                                if mosq_test.expect_packet(bridges[home], "publish 3", bridge3_packet):
+                                    rc = 0
+finally:
+    for sock in bridges:
+        if sock:
+            sock.close()
+    if pub:
+        pub.close()
+
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    ssock.close()
+
+exit(rc)
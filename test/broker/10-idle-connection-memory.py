@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+
+# Does each idle client cost the broker less memory than it did before the
+# per-client state for queues, lanes and windows was added? Kernel socket
+# buffers aren't part of the broker's resident set, so the RSS growth over a
+# batch of connected, idle clients is what the broker itself spends on them.
+# A client that has only connected must not need struct mosquitto_cold.
+
+import resource
+import subprocess
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def connect_many(first, count):
+    for i in range(first, first+count):
+        sock = mosq_test.connect("idle-%06d" % (i), keepalive, connack_packet)
+        if sock is None:
+            return False
+        socks.append(sock)
+    return True
+
+def rss(pid):
+    f = open("/proc/%d/status" % (pid))
+    try:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])*1024
+    finally:
+        f.close()
+    return 0
+
+rc = 1
+keepalive = 600
+connack_packet = mosq_test.gen_connack(rc=0)
+# Measured the same way on 8746575, x86_64 glibc.
+baseline_bytes = 593
+
+# Both ends of every connection are in this host's fd limits.
+(soft, hard) = resource.getrlimit(resource.RLIMIT_NOFILE)
+if hard != resource.RLIM_INFINITY and hard < 2100:
+    soft = hard
+else:
+    soft = max(soft, 2100)
+resource.setrlimit(resource.RLIMIT_NOFILE, (soft, hard))
+# The first batch warms up the allocator and the broker's context arrays.
+warm = min(200, (soft-100)/4)
+count = min(2000-warm, (soft-100)/2-warm)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-idle-connection-memory.conf'], stderr=subprocess.PIPE)
+
+socks = []
+try:
+    time.sleep(0.5)
+
+    if connect_many(0, warm):
+        time.sleep(0.5)
+        before = rss(broker.pid)
+        if connect_many(warm, count):
+            time.sleep(0.5)
+            after = rss(broker.pid)
+            per_client = (after-before)/count
+            if per_client < baseline_bytes:
+                rc = 0
+            else:
+                print("FAIL: %d bytes per idle client, expected less than the %d of the baseline." % (per_client, baseline_bytes))
+finally:
+    for sock in socks:
+        sock.close()
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -1,3 +1,4 @@
+import socket
 import struct
 
 def expect_packet(sock, name, expected):
@@ -308,6 +309,31 @@ def gen_pingresp():
 def gen_disconnect():
     return struct.pack('!BB', 224, 0)
 
+def connect(client_id, keepalive, connack, clean_session=True, port=1888):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(("localhost", port))
+    sock.send(gen_connect(client_id, keepalive=keepalive, clean_session=clean_session))
+    if expect_packet(sock, "connack", connack):
+        return sock
+    sock.close()
+    return None
+
+def expect_nothing(sock, timeout=0.5):
+    sock.settimeout(timeout)
+    try:
+        packet = sock.recv(1)
+        print("FAIL: Received unexpected data.")
+        return False
+    except socket.timeout:
+        return True
+    finally:
+        sock.settimeout(10)
+
+def publish(sock, topic, payload, mid):
+    sock.send(gen_publish(topic, qos=1, mid=mid, payload=payload))
+    return expect_packet(sock, "puback", gen_puback(mid))
+
 def pack_remaining_length(remaining_length):
     s = ""
     while True: